@@ -0,0 +1,133 @@
+#ifndef _C4_TPL_ARENA_HPP_
+#define _C4_TPL_ARENA_HPP_
+
+#include "c4/tpl/common.hpp"
+#include "c4/allocator.hpp"
+
+namespace c4 {
+namespace tpl {
+
+/** A bump allocator for the strings produced while rendering (eg,
+ * escaped values). The memory is obtained in chunks which are never
+ * relocated, so the strings it hands out remain valid until the next
+ * call to reset(); this is needed because the rope keeps only
+ * non-owning views of them. On reset(), multiple chunks are coalesced
+ * into a single one, so that after the first few renders the arena
+ * settles on a single allocation. */
+class Arena
+{
+public:
+
+    struct chunk
+    {
+        chunk *m_prev;  ///< the previous chunk
+        size_t m_cap;   ///< the capacity of this chunk, in bytes
+        size_t m_pos;   ///< the current position within this chunk
+        char * mem() { return reinterpret_cast<char*>(this + 1); }
+    };
+
+    chunk * m_curr;             ///< the current chunk, ie the last allocated
+    size_t  m_total_cap;        ///< the summed capacity of all chunks
+    allocator_mr<char> m_alloc; ///< a polymorphic allocator
+
+public:
+
+    Arena(allocator_mr<char> const& a={}) : m_curr(nullptr), m_total_cap(0), m_alloc(a) {}
+    Arena(size_t cap, allocator_mr<char> const& a={}) : Arena(a) { reserve(cap); }
+    ~Arena() { free(); }
+
+    Arena(Arena const&) = delete;
+    Arena& operator= (Arena const&) = delete;
+
+    Arena(Arena && that) : m_curr(that.m_curr), m_total_cap(that.m_total_cap), m_alloc(that.m_alloc)
+    {
+        that.m_curr = nullptr;
+        that.m_total_cap = 0;
+    }
+    Arena& operator= (Arena && that)
+    {
+        free();
+        m_curr = that.m_curr;
+        m_total_cap = that.m_total_cap;
+        m_alloc = that.m_alloc;
+        that.m_curr = nullptr;
+        that.m_total_cap = 0;
+        return *this;
+    }
+
+public:
+
+    size_t capacity() const { return m_total_cap; }
+
+    /** ensure there is a chunk with at least cap free bytes */
+    void reserve(size_t cap)
+    {
+        if(m_curr && m_curr->m_cap - m_curr->m_pos >= cap) return;
+        _add_chunk(cap);
+    }
+
+    /** get a buffer with len bytes, valid until the next reset() */
+    substr alloc(size_t len)
+    {
+        if(C4_UNLIKELY(m_curr == nullptr || m_curr->m_cap - m_curr->m_pos < len))
+        {
+            size_t sz = m_total_cap > len ? m_total_cap : len; // grow geometrically
+            sz = sz > 256 ? sz : 256;
+            _add_chunk(sz);
+        }
+        substr s(m_curr->mem() + m_curr->m_pos, len);
+        m_curr->m_pos += len;
+        return s;
+    }
+
+    /** copy a string into the arena */
+    csubstr copy(csubstr s)
+    {
+        if(s.empty()) return s;
+        substr cp = alloc(s.len);
+        memcpy(cp.str, s.str, s.len);
+        return cp;
+    }
+
+    /** give back all the memory obtained with alloc(). If more than one
+     * chunk was used, these are coalesced into a single chunk. */
+    void reset()
+    {
+        if(m_curr == nullptr) return;
+        if(m_curr->m_prev != nullptr)
+        {
+            size_t cap = m_total_cap;
+            free();
+            _add_chunk(cap);
+        }
+        m_curr->m_pos = 0;
+    }
+
+    void free()
+    {
+        while(m_curr)
+        {
+            chunk *prev = m_curr->m_prev;
+            m_alloc.deallocate((char*)m_curr, sizeof(chunk) + m_curr->m_cap, alignof(chunk));
+            m_curr = prev;
+        }
+        m_total_cap = 0;
+    }
+
+private:
+
+    void _add_chunk(size_t cap)
+    {
+        chunk *c = (chunk*) m_alloc.allocate(sizeof(chunk) + cap, alignof(chunk));
+        c->m_prev = m_curr;
+        c->m_cap = cap;
+        c->m_pos = 0;
+        m_curr = c;
+        m_total_cap += cap;
+    }
+};
+
+} // namespace tpl
+} // namespace c4
+
+#endif /* _C4_TPL_ARENA_HPP_ */
@@ -1,72 +1,133 @@
 #ifndef _C4_TPL_ENGINE_HPP_
 #define _C4_TPL_ENGINE_HPP_
 
+#include <memory>
+#include <c4/std/string.hpp>
 #include "./token.hpp"
+#include "./syntax.hpp"
 
 namespace c4 {
 namespace tpl {
 
+/** marks the tokens, with no virtual calls for the known token types */
+struct MarkTokens
+{
+    template<class T> void operator() (T &tk) const { tk.template mark_as<T>(); }
+    void operator() (TokenBase &tk) const { tk.mark(); }
+};
+
 class Engine
 {
 public:
 
     csubstr m_src;
+    std::string m_src_buf;           ///< the source, when it needed to be preprocessed
     TokenContainer m_tokens;
+    Syntax   m_syntax;               ///< the delimiters of the tags
+    Escape_e m_escape;               ///< the escape mode for the values of expressions
+    mutable RenderContext m_ctx;     ///< holds the strings produced in the last render
+    TemplateRegistry const* m_registry;  ///< where to look for the templates of {% include %}
+    Rope const* m_rope;              ///< the rope given to parse()
 
 public:
 
-    Engine() : m_src(), m_tokens() {}
+    Engine() : m_src(), m_src_buf(), m_tokens(), m_syntax(), m_escape(ESCAPE_NONE), m_ctx(), m_registry(nullptr), m_rope(nullptr) {}
+    explicit Engine(Escape_e escape) : m_src(), m_src_buf(), m_tokens(), m_syntax(), m_escape(escape), m_ctx(), m_registry(nullptr), m_rope(nullptr) {}
+    explicit Engine(Syntax const& syntax, Escape_e escape=ESCAPE_NONE) : m_src(), m_src_buf(), m_tokens(), m_syntax(syntax), m_escape(escape), m_ctx(), m_registry(nullptr), m_rope(nullptr) {}
+    explicit Engine(TemplateRegistry const* registry, Escape_e escape=ESCAPE_NONE, allocator_mr<char> const& a={}) : m_src(), m_src_buf(), m_tokens(a), m_syntax(), m_escape(escape), m_ctx(a), m_registry(registry), m_rope(nullptr) {}
+    /** use the given allocator for the tokens and for the strings
+     * produced while rendering, eg Engine(&mmap_resource). See
+     * MemoryResourceMmap. */
+    explicit Engine(allocator_mr<char> const& a, Escape_e escape=ESCAPE_NONE) : m_src(), m_src_buf(), m_tokens(a), m_syntax(), m_escape(escape), m_ctx(a), m_registry(nullptr), m_rope(nullptr) {}
 
     bool empty() const { return m_tokens.empty() || m_src.empty(); }
     void clear()
     {
         m_tokens.clear();
+        m_tokens.m_token_seq.clear();
+        m_tokens.m_root_seq.clear();
+        m_tokens.m_macros.clear();
+        m_tokens.clear_blocks();
     }
 
+    /** parse the source. The source must outlive the engine, unless
+     * it uses a syntax other than the default, or has whitespace
+     * control markers: then it is preprocessed into a copy held by the
+     * engine. */
     void parse(csubstr src, Rope *rope)
     {
         if(m_tokens.num_pools() == 0)
         {
             register_known_tokens(m_tokens);
         }
+        src = preprocess(m_syntax, src, &m_src_buf);
         m_src = src;
         clear();
+        m_tokens.m_registry = m_registry;
+        m_rope = nullptr;
         if(m_src.empty()) return;
+        m_rope = rope;
+        C4_CHECK_MSG(m_src.len < UINT32_MAX, "the source is too large");
+        m_tokens.m_src = m_src;
+        m_tokens.m_rope = rope;
+        // size the pools and the rope up front, instead of growing them
+        // while parsing. Each token takes about three rope entries: itself,
+        // the text after it, and the text before its nested tokens.
+        size_t num_tokens = m_tokens.reserve_for(m_src);
+        rope->reserve(rope->num_entries() + 1 + 3 * num_tokens);
         TplLocation pos{rope, {rope->append(src), 0}};
         csubstr rem = m_src;
         while( ! rem.empty())
         {
             auto tk_pos = m_tokens.next_token(&rem, &pos);
             if(tk_pos == NONE) break; // we're done
+            m_tokens.m_root_seq.push_back(tk_pos);
             auto *tk = m_tokens.get(tk_pos);
             tk->parse(&rem, &pos);
             tk->parse_body(&m_tokens);
         }
+        m_tokens.resolve_calls();
     }
 
     void mark()
     {
-        for(auto &tk : m_tokens)
-        {
-            tk.mark();
-        }
+        visit_known_tokens(m_tokens, MarkTokens{});
     }
 
+    /** render into the given rope. The rope may point at strings held
+     * by the engine (eg escaped values), which remain valid until the
+     * next call to render(). */
     void render(c4::yml::NodeRef & root, Rope *rope) const
     {
-        if( ! m_tokens.empty())
+        m_ctx.start(m_escape);
+        render(root, rope, &m_ctx);
+    }
+
+    /** render with the given context, which is not reset first: the
+     * names bound in it are visible to the template. This is used by
+     * {% include %}. */
+    void render(c4::yml::NodeRef & root, Rope *rope, RenderContext *ctx) const
+    {
+        if(m_rope != nullptr && rope != m_rope)
         {
-            C4_ASSERT(m_tokens.size() == m_tokens.m_token_seq.size());
-            Rope const* parsed_rope = m_tokens.get(m_tokens.m_token_seq[0])->rope();
-            if(rope != parsed_rope)
-            {
-                *rope = *parsed_rope;
-            }
+            *rope = *m_rope;
         }
-        for(auto const& token : m_tokens)
+        render_tokens(root, rope, ctx);
+    }
+
+    /** render the tokens into a rope which already is a copy of the
+     * rope given to parse(). */
+    void render_tokens(c4::yml::NodeRef & root, Rope *rope, RenderContext *ctx) const
+    {
+        C4_ASSERT(m_tokens.size() == m_tokens.m_token_seq.size());
+        // render in the order of the source: eg, a {% set %} must be
+        // rendered before the tokens after it. The nested tokens are
+        // rendered by the tokens containing them.
+        for(size_t id : m_tokens.m_root_seq)
         {
-            if( ! token.m_root_level) continue;
-            token.render(root, rope);
+            TokenBase const* token = m_tokens.get(id);
+            C4_ASSERT(token->m_root_level);
+            token->render(root, rope, ctx);
         }
     }
 
@@ -91,6 +152,266 @@ public:
 
 };
 
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+/** a set of named templates, for {% include "name" %} and
+ * {% extends "name" %}. Each template is parsed once, and the templates
+ * including it refer to its parsed form when rendering, so parsing
+ * memory grows with the number of distinct templates, not with the
+ * number of includes.
+ *
+ * Inheritance is resolved when a template is added: the
+ * {% block name %}...{% endblock %} overrides of a template extending
+ * another are placed into the source of the base, and the result is
+ * parsed without any block tags. Rendering it then costs the same as
+ * rendering the equivalent hand-written template. The text of an
+ * extending template outside of its blocks is ignored. */
+class TemplateRegistry
+{
+public:
+
+    struct entry
+    {
+        std::string m_name;
+        std::string m_pre_buf;     ///< for templates which need it: the preprocessed source. See preprocess()
+        std::string m_layout_buf;  ///< for templates extending another: the source of the base, with the blocks of this template
+        std::string m_src_buf;     ///< for templates with blocks: the source without the block tags
+        csubstr m_layout;          ///< the source with the block tags, which templates extending this one override
+        Rope   m_rope;             ///< the parsed rope. It is copied for rendering.
+        Engine m_engine;
+        size_t m_index;            ///< the position in the registry
+
+        entry(csubstr name, TemplateRegistry const* registry, Escape_e escape, allocator_mr<char> const& a, size_t index)
+            : m_name(name.str, name.len), m_pre_buf(), m_layout_buf(), m_src_buf(), m_layout(), m_rope(a), m_engine(registry, escape, a), m_index(index) {}
+    };
+
+    struct name_index
+    {
+        csubstr name;
+        size_t  hash;
+        size_t  index;  ///< the position in m_entries, or npos if the slot is empty
+    };
+
+    std::vector<std::unique_ptr<entry>> m_entries;
+    /** an open-addressing hash table (with linear probing) from the
+     * template names to m_entries. Its size is a power of two, kept at
+     * least twice the number of templates. */
+    std::vector<name_index> m_index;
+    Syntax   m_syntax;  ///< the delimiters of the tags in the added sources
+    Escape_e m_escape;
+    allocator_mr<char> m_alloc;  ///< for the tokens and the ropes of the templates
+
+public:
+
+    TemplateRegistry() : m_entries(), m_index(), m_syntax(), m_escape(ESCAPE_NONE), m_alloc() {}
+    explicit TemplateRegistry(Escape_e escape) : m_entries(), m_index(), m_syntax(), m_escape(escape), m_alloc() {}
+    explicit TemplateRegistry(Syntax const& syntax, Escape_e escape=ESCAPE_NONE) : m_entries(), m_index(), m_syntax(syntax), m_escape(escape), m_alloc() {}
+    explicit TemplateRegistry(allocator_mr<char> const& a, Escape_e escape=ESCAPE_NONE) : m_entries(), m_index(), m_syntax(), m_escape(escape), m_alloc(a) {}
+    TemplateRegistry(Syntax const& syntax, Escape_e escape, allocator_mr<char> const& a) : m_entries(), m_index(), m_syntax(syntax), m_escape(escape), m_alloc(a) {}
+
+    /** parse a template and register it with the given name. The
+     * source must outlive the registry. The templates it includes or
+     * extends must have been registered before.
+     * @return the engine holding the parsed template. It may be used
+     * to render the template directly. */
+    Engine const& add(csubstr name, csubstr src)
+    {
+        C4_CHECK_MSG(find(name) == nullptr, "template already registered");
+        m_entries.emplace_back(new entry(name, this, m_escape, m_alloc, m_entries.size()));
+        entry *e = m_entries.back().get();
+        _add_name(to_csubstr(e->m_name), m_entries.size() - 1);
+
+        // preprocess first, so that the blocks are found with any
+        // syntax, and with or without whitespace control. The engine
+        // then gets a source in the default syntax.
+        src = preprocess(m_syntax, src, &e->m_pre_buf);
+        e->m_layout = src;
+        csubstr base_name;
+        if(_extends(src, &base_name))
+        {
+            entry const* base = find(base_name);
+            C4_CHECK_MSG(base != nullptr, "{% extends %}: template not found");
+            std::vector<block_def> overrides;
+            _collect_blocks(src, &overrides);
+            _flatten(base->m_layout, overrides, /*keep_tags*/true, &e->m_layout_buf);
+            e->m_layout = to_csubstr(e->m_layout_buf);
+        }
+
+        csubstr parsed = e->m_layout;
+        if(_find(parsed, 0, "{% block ") != npos)
+        {
+            _flatten(parsed, {}, /*keep_tags*/false, &e->m_src_buf);
+            parsed = to_csubstr(e->m_src_buf);
+        }
+        e->m_engine.parse(parsed, &e->m_rope);
+        return e->m_engine;
+    }
+
+    entry const* find(csubstr name) const
+    {
+        if(m_index.empty()) return nullptr;
+        size_t h = hash_name(name);
+        size_t mask = m_index.size() - 1;
+        for(size_t i = h & mask; ; i = (i + 1) & mask)
+        {
+            name_index const& e = m_index[i];
+            if(e.index == npos) return nullptr;
+            if(e.hash == h && e.name == name) return m_entries[e.index].get();
+        }
+    }
+
+    size_t size() const { return m_entries.size(); }
+
+public:
+
+    void _add_name(csubstr name, size_t index)
+    {
+        if(2 * m_entries.size() > m_index.size())
+        {
+            // grow, and reinsert the names
+            size_t sz = m_index.empty() ? 16 : 2 * m_index.size();
+            std::vector<name_index> prev;
+            prev.swap(m_index);
+            m_index.assign(sz, name_index{csubstr{}, 0, npos});
+            for(name_index const& e : prev)
+            {
+                if(e.index != npos) _insert_name(e);
+            }
+        }
+        _insert_name(name_index{name, hash_name(name), index});
+    }
+
+    void _insert_name(name_index const& e)
+    {
+        size_t mask = m_index.size() - 1;
+        size_t i = e.hash & mask;
+        while(m_index[i].index != npos)
+        {
+            i = (i + 1) & mask;
+        }
+        m_index[i] = e;
+    }
+
+    struct block_def
+    {
+        csubstr name;
+        csubstr body;
+        csubstr full;  ///< from {% block to the end of {% endblock %}
+    };
+
+    /** is the template of the form {% extends "base" %}...? */
+    static bool _extends(csubstr src, csubstr *base_name)
+    {
+        src = src.triml(" \t\r\n");
+        if( ! src.begins_with("{% extends ")) return false;
+        size_t pos = src.find("%}");
+        C4_CHECK_MSG(pos != npos, "{% extends %}: parse error");
+        csubstr name = src.range(11, pos).trim(' '); // 11==strlen("{% extends ")
+        C4_CHECK_MSG(name.len >= 2 && (name.begins_with('"') || name.begins_with('\'')) && name[name.len - 1] == name[0],
+                     "{% extends %}: the template name must be a quoted string");
+        *base_name = name.unquoted();
+        return true;
+    }
+
+    /** find the first block in s, skipping the blocks nested in it */
+    static bool _next_block(csubstr s, block_def *b)
+    {
+        size_t start = _find(s, 0, "{% block ");
+        if(start == npos) return false;
+        size_t pos = s.find("%}", start);
+        C4_CHECK_MSG(pos != npos, "{% block %}: parse error");
+        b->name = s.range(start + 9, pos).trim(' '); // 9==strlen("{% block ")
+        C4_CHECK_MSG( ! b->name.empty(), "{% block %}: parse error");
+        size_t body_start = pos + 2;
+        csubstr r = s.sub(body_start);
+        size_t level = 1;
+        while(true)
+        {
+            auto result = r.first_of_any("{% block ", "{% endblock", TokenRaw::s_stoken());
+            C4_CHECK_MSG(result, "{% block %}: missing {% endblock %}");
+            size_t at = static_cast<size_t>(r.str - s.str) + result.pos;
+            if(result.which == 2)
+            {
+                r = TokenRaw::skip(s.sub(at));
+                continue;
+            }
+            if(result.which == 0)
+            {
+                ++level;
+            }
+            else if(--level == 0)
+            {
+                size_t end = s.find("%}", at); // {% endblock %} or {% endblock name %}
+                C4_CHECK_MSG(end != npos, "{% endblock %}: parse error");
+                b->body = s.range(body_start, at);
+                b->full = s.range(start, end + 2);
+                return true;
+            }
+            r = s.sub(at + 9);
+        }
+    }
+
+    /** find a pattern, skipping the contents of raw blocks */
+    static size_t _find(csubstr s, size_t pos, csubstr pattern)
+    {
+        while(true)
+        {
+            size_t p = s.find(pattern, pos);
+            size_t raw = s.find(TokenRaw::s_stoken(), pos);
+            if(raw == npos || p < raw) return p;
+            pos = static_cast<size_t>(TokenRaw::skip(s.sub(raw)).str - s.str);
+        }
+    }
+
+    /** collect all the blocks in s, including the nested ones */
+    static void _collect_blocks(csubstr s, std::vector<block_def> *blocks)
+    {
+        block_def b;
+        while(_next_block(s, &b))
+        {
+            blocks->push_back(b);
+            _collect_blocks(b.body, blocks);
+            s = s.sub(static_cast<size_t>(b.full.end() - s.str));
+        }
+    }
+
+    /** write s to out, replacing the body of its blocks with the
+     * overriding ones, if any */
+    static void _flatten(csubstr s, std::vector<block_def> const& overrides, bool keep_tags, std::string *out)
+    {
+        block_def b;
+        while(_next_block(s, &b))
+        {
+            out->append(s.str, static_cast<size_t>(b.full.str - s.str));
+            csubstr body = b.body;
+            for(auto const& o : overrides)
+            {
+                if(o.name == b.name)
+                {
+                    body = o.body;
+                    break;
+                }
+            }
+            if(keep_tags)
+            {
+                out->append("{% block ");
+                out->append(b.name.str, b.name.len);
+                out->append(" %}");
+            }
+            _flatten(body, overrides, keep_tags, out);
+            if(keep_tags)
+            {
+                out->append("{% endblock %}");
+            }
+            s = s.sub(static_cast<size_t>(b.full.end() - s.str));
+        }
+        out->append(s.str, s.len);
+    }
+};
+
 } // namespace tpl
 } // namespace c4
 
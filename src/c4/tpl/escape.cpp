@@ -0,0 +1,256 @@
+#include "c4/tpl/escape.hpp"
+#include "c4/tpl/arena.hpp"
+
+#if defined(C4TPL_NO_SIMD)
+    // scalar only
+#elif defined(__AVX2__)
+#   define C4TPL_ESCAPE_AVX2
+#   include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define C4TPL_ESCAPE_SSE2
+#   include <emmintrin.h>
+#endif
+
+namespace c4 {
+namespace tpl {
+
+namespace {
+
+C4_ALWAYS_INLINE bool _needs_html(char c)
+{
+    return c == '<' || c == '>' || c == '&' || c == '"' || c == '\'';
+}
+
+C4_ALWAYS_INLINE bool _needs_json(char c)
+{
+    return c == '"' || c == '\\' || ((unsigned char)c) < 0x20;
+}
+
+C4_ALWAYS_INLINE unsigned _ctz(unsigned mask)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctz(mask);
+#else
+    unsigned n = 0;
+    while((mask & 1u) == 0) { mask >>= 1; ++n; }
+    return n;
+#endif
+}
+
+} // anon namespace
+
+
+//-----------------------------------------------------------------------------
+
+size_t first_to_escape_html(csubstr s)
+{
+    size_t i = 0;
+#if defined(C4TPL_ESCAPE_AVX2)
+    const __m256i lt = _mm256_set1_epi8('<'), gt = _mm256_set1_epi8('>'), amp = _mm256_set1_epi8('&');
+    const __m256i dq = _mm256_set1_epi8('"'), sq = _mm256_set1_epi8('\'');
+    for( ; i + 32 <= s.len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((__m256i const*)(s.str + i));
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, gt)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(v, amp),
+                                                    _mm256_or_si256(_mm256_cmpeq_epi8(v, dq), _mm256_cmpeq_epi8(v, sq))));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if(mask) return i + _ctz(mask);
+    }
+#elif defined(C4TPL_ESCAPE_SSE2)
+    const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>'), amp = _mm_set1_epi8('&');
+    const __m128i dq = _mm_set1_epi8('"'), sq = _mm_set1_epi8('\'');
+    for( ; i + 16 <= s.len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((__m128i const*)(s.str + i));
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, amp),
+                                              _mm_or_si128(_mm_cmpeq_epi8(v, dq), _mm_cmpeq_epi8(v, sq))));
+        unsigned mask = (unsigned)_mm_movemask_epi8(m);
+        if(mask) return i + _ctz(mask);
+    }
+#endif
+    for( ; i < s.len; ++i)
+    {
+        if(_needs_html(s.str[i])) return i;
+    }
+    return npos;
+}
+
+size_t first_to_escape_json(csubstr s)
+{
+    size_t i = 0;
+#if defined(C4TPL_ESCAPE_AVX2)
+    const __m256i dq = _mm256_set1_epi8('"'), bs = _mm256_set1_epi8('\\'), ctl = _mm256_set1_epi8(0x1f);
+    for( ; i + 32 <= s.len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((__m256i const*)(s.str + i));
+        // v <= 0x1f (unsigned) iff max(v, 0x1f) == 0x1f
+        __m256i c = _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctl), ctl);
+        __m256i m = _mm256_or_si256(c, _mm256_or_si256(_mm256_cmpeq_epi8(v, dq), _mm256_cmpeq_epi8(v, bs)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if(mask) return i + _ctz(mask);
+    }
+#elif defined(C4TPL_ESCAPE_SSE2)
+    const __m128i dq = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\'), ctl = _mm_set1_epi8(0x1f);
+    for( ; i + 16 <= s.len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((__m128i const*)(s.str + i));
+        // v <= 0x1f (unsigned) iff max(v, 0x1f) == 0x1f
+        __m128i c = _mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl);
+        __m128i m = _mm_or_si128(c, _mm_or_si128(_mm_cmpeq_epi8(v, dq), _mm_cmpeq_epi8(v, bs)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(m);
+        if(mask) return i + _ctz(mask);
+    }
+#endif
+    for( ; i < s.len; ++i)
+    {
+        if(_needs_json(s.str[i])) return i;
+    }
+    return npos;
+}
+
+size_t first_to_escape(Escape_e e, csubstr s)
+{
+    switch(e)
+    {
+    case ESCAPE_HTML: return first_to_escape_html(s);
+    case ESCAPE_JSON: return first_to_escape_json(s);
+    default: break;
+    }
+    return npos;
+}
+
+
+//-----------------------------------------------------------------------------
+
+namespace {
+
+/** write a piece of the result, if there is space for it */
+C4_ALWAYS_INLINE void _put(substr buf, size_t *pos, csubstr s)
+{
+    if(*pos + s.len <= buf.len)
+    {
+        memcpy(buf.str + *pos, s.str, s.len);
+    }
+    *pos += s.len;
+}
+
+csubstr _html_entity(char c)
+{
+    switch(c)
+    {
+    case '<':  return "&lt;";
+    case '>':  return "&gt;";
+    case '&':  return "&amp;";
+    case '"':  return "&quot;";
+    case '\'': return "&#39;";
+    default: break;
+    }
+    C4_ERROR("never reach");
+    return {};
+}
+
+csubstr _json_entity(char c, char (&ubuf)[6])
+{
+    switch(c)
+    {
+    case '"':  return "\\\"";
+    case '\\': return "\\\\";
+    case '\b': return "\\b";
+    case '\f': return "\\f";
+    case '\n': return "\\n";
+    case '\r': return "\\r";
+    case '\t': return "\\t";
+    default: break;
+    }
+    const char hex[] = "0123456789abcdef";
+    ubuf[0] = '\\'; ubuf[1] = 'u'; ubuf[2] = '0'; ubuf[3] = '0';
+    ubuf[4] = hex[(((unsigned char)c) >> 4) & 0xf];
+    ubuf[5] = hex[((unsigned char)c) & 0xf];
+    return csubstr(ubuf, 6);
+}
+
+template<class FindFn, class EntityFn>
+size_t _escape(substr buf, csubstr s, size_t first, FindFn &&find, EntityFn &&entity)
+{
+    size_t pos = 0;
+    while(first != npos)
+    {
+        _put(buf, &pos, s.first(first));
+        _put(buf, &pos, entity(s[first]));
+        s = s.sub(first + 1);
+        first = find(s);
+    }
+    _put(buf, &pos, s);
+    return pos;
+}
+
+} // anon namespace
+
+size_t escape_html(substr buf, csubstr s)
+{
+    return _escape(buf, s, first_to_escape_html(s), &first_to_escape_html, &_html_entity);
+}
+
+size_t escape_json(substr buf, csubstr s)
+{
+    char ubuf[6];
+    return _escape(buf, s, first_to_escape_json(s), &first_to_escape_json,
+                   [&ubuf](char c) { return _json_entity(c, ubuf); });
+}
+
+size_t escape(Escape_e e, substr buf, csubstr s)
+{
+    switch(e)
+    {
+    case ESCAPE_HTML: return escape_html(buf, s);
+    case ESCAPE_JSON: return escape_json(buf, s);
+    default: break;
+    }
+    if(s.len <= buf.len && s.len)
+    {
+        memcpy(buf.str, s.str, s.len);
+    }
+    return s.len;
+}
+
+csubstr escape(Escape_e e, csubstr s, Arena *arena)
+{
+    size_t first = first_to_escape(e, s);
+    if(first == npos)
+    {
+        return s; // nothing to escape: use the original
+    }
+    // the characters before the first escaped one are copied verbatim,
+    // so the size computation can start there
+    size_t sz = first + escape(e, substr{}, s.sub(first));
+    substr buf = arena->alloc(sz);
+    size_t ret = escape(e, buf, s);
+    C4_ASSERT(ret == sz); C4_UNUSED(ret);
+    return buf;
+}
+
+bool escape_from_name(csubstr name, Escape_e *e)
+{
+    if(name == "html" || name == "xml" || name == "true")
+    {
+        *e = ESCAPE_HTML;
+    }
+    else if(name == "json")
+    {
+        *e = ESCAPE_JSON;
+    }
+    else if(name == "none" || name == "false")
+    {
+        *e = ESCAPE_NONE;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+} // namespace tpl
+} // namespace c4
@@ -0,0 +1,45 @@
+#ifndef _C4_TPL_ESCAPE_HPP_
+#define _C4_TPL_ESCAPE_HPP_
+
+#include "c4/tpl/common.hpp"
+
+namespace c4 {
+namespace tpl {
+
+class Arena;
+
+typedef enum {
+    ESCAPE_NONE,  //!< emit the values as they are
+    ESCAPE_HTML,  //!< escape <>&"' as HTML/XML entities
+    ESCAPE_JSON,  //!< escape "\ and the control characters, for use inside a JSON string
+} Escape_e;
+
+/** parse the name of an escape mode: "html", "xml", "json", "none";
+ * or "true" and "false" as in jinja's {% autoescape true %}, which are
+ * the same as "html" and "none".
+ * @return true if the name was recognized */
+bool escape_from_name(csubstr name, Escape_e *e);
+
+
+/** @return the position of the first character which needs escaping, or npos.
+ * These use SSE2 or AVX2 when available, scanning 16 or 32 bytes at a time */
+size_t first_to_escape_html(csubstr s);
+size_t first_to_escape_json(csubstr s);
+size_t first_to_escape(Escape_e e, csubstr s);
+
+
+/** escape s into buf. Like to_chars(), the required size is returned,
+ * and buf is written only if it is large enough. */
+size_t escape_html(substr buf, csubstr s);
+size_t escape_json(substr buf, csubstr s);
+size_t escape(Escape_e e, substr buf, csubstr s);
+
+
+/** escape s, placing the result in the arena. When nothing needs
+ * escaping, s is returned without any copy. */
+csubstr escape(Escape_e e, csubstr s, Arena *arena);
+
+} // namespace tpl
+} // namespace c4
+
+#endif /* _C4_TPL_ESCAPE_HPP_ */
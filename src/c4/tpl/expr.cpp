@@ -0,0 +1,945 @@
+#include "c4/tpl/expr.hpp"
+#include "c4/tpl/token.hpp"
+#include <cmath>
+#include <cstring>
+
+namespace c4 {
+namespace tpl {
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+void Expr::Operand::init(csubstr s)
+{
+    m_str = s;
+    if(s.len >= 2 && (s.begins_with('\'') || s.begins_with('"')) && s.ends_with(s[0]))
+    {
+        m_type = LITERAL;
+        m_val = Value::str(s.sub(1, s.len - 2));
+    }
+    else if(s == "true" || s == "false")
+    {
+        m_type = LITERAL;
+        m_val = Value::boolean(s == "true");
+    }
+    else if(Value::from_number_str(s, &m_val))
+    {
+        m_type = LITERAL;
+    }
+    else
+    {
+        m_name = s.left_of(s.first_of(".["));
+        m_type = PATH;
+        if(m_name == "loop" && s.len > 5 && s[4] == '.' && LoopInfo::field_from_name(s.sub(5), &m_loop_field))
+        {
+            m_type = LOOP;
+        }
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace {
+
+typedef enum {
+    L_END,
+    L_LPAREN,
+    L_RPAREN,
+    L_OPERAND,
+    L_AND,
+    L_OR,
+    L_NOT,
+    L_IN,
+    L_EQ,
+    L_NE,
+    L_LT,
+    L_LE,
+    L_GT,
+    L_GE,
+    L_PLUS,
+    L_MINUS,
+    L_STAR,
+    L_SLASH,
+    L_SLASH2,
+    L_PERCENT,
+    L_TILDE,
+    L_LBRACKET,
+    L_RBRACKET,
+    L_COLON,
+    L_COMMA,
+} Lex_e;
+
+struct Lexeme
+{
+    Lex_e   type;
+    csubstr str;
+};
+
+C4_ALWAYS_INLINE bool _is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+C4_ALWAYS_INLINE bool _is_name_start(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+C4_ALWAYS_INLINE bool _is_name_char(char c)
+{
+    return _is_name_start(c) || _is_digit(c) || c == '.';
+}
+
+/** signs are not part of number literals: they are unary operators */
+bool _is_number_start(csubstr s)
+{
+    if(_is_digit(s[0])) return true;
+    return s.len > 1 && s[0] == '.' && _is_digit(s[1]);
+}
+
+/** get the length of the number at the start of s. The format is
+ * validated later, by Value::from_number_str() */
+size_t _scan_number(csubstr s)
+{
+    size_t i = 0;
+    while(i < s.len && (_is_digit(s[i]) || s[i] == '.')) ++i;
+    if(i < s.len && (s[i] == 'e' || s[i] == 'E'))
+    {
+        ++i;
+        if(i < s.len && (s[i] == '+' || s[i] == '-')) ++i;
+        while(i < s.len && _is_digit(s[i])) ++i;
+    }
+    return i;
+}
+
+/** find the ] closing the [ at s[pos], and whether the brackets
+ * enclose a slice, ie a : at their level */
+size_t _bracket_end(csubstr s, size_t pos, bool *is_slice)
+{
+    C4_ASSERT(s[pos] == '[');
+    size_t level = 0;
+    *is_slice = false;
+    for(size_t i = pos; i < s.len; ++i)
+    {
+        char c = s[i];
+        if(c == '[')
+        {
+            ++level;
+        }
+        else if(c == ']')
+        {
+            if(--level == 0) return i;
+        }
+        else if(c == ':' && level == 1)
+        {
+            *is_slice = true;
+        }
+        else if(c == '\'' || c == '"')
+        {
+            size_t q = s.sub(i + 1).find(c);
+            C4_CHECK_MSG(q != npos, "parse error: unterminated string");
+            i += q + 1;
+        }
+    }
+    C4_ERROR("parse error: expected ]");
+    return npos;
+}
+
+/** get the next lexeme from the expression, and consume it */
+Lexeme _lex(csubstr *rem)
+{
+    csubstr s = rem->triml(" \t\r\n");
+    Lexeme l;
+    l.type = L_END;
+    if(s.empty())
+    {
+        l.str = s;
+        *rem = s;
+        return l;
+    }
+    size_t len = 1;
+    char c = s[0];
+    switch(c)
+    {
+    case '(': l.type = L_LPAREN; break;
+    case ')': l.type = L_RPAREN; break;
+    case '+': l.type = L_PLUS; break;
+    case '-': l.type = L_MINUS; break;
+    case '*': l.type = L_STAR; break;
+    case '%': l.type = L_PERCENT; break;
+    case '~': l.type = L_TILDE; break;
+    case '[': l.type = L_LBRACKET; break;
+    case ']': l.type = L_RBRACKET; break;
+    case ':': l.type = L_COLON; break;
+    case ',': l.type = L_COMMA; break;
+    case '/':
+        if(s.len > 1 && s[1] == '/')
+        {
+            l.type = L_SLASH2;
+            len = 2;
+        }
+        else
+        {
+            l.type = L_SLASH;
+        }
+        break;
+    case '=':
+        C4_CHECK_MSG(s.len > 1 && s[1] == '=', "parse error: expected ==");
+        l.type = L_EQ;
+        len = 2;
+        break;
+    case '!':
+        C4_CHECK_MSG(s.len > 1 && s[1] == '=', "parse error: expected !=");
+        l.type = L_NE;
+        len = 2;
+        break;
+    case '<':
+    case '>':
+        if(s.len > 1 && s[1] == '=')
+        {
+            l.type = c == '<' ? L_LE : L_GE;
+            len = 2;
+        }
+        else
+        {
+            l.type = c == '<' ? L_LT : L_GT;
+        }
+        break;
+    case '"':
+    case '\'':
+    {
+        size_t pos = s.sub(1).find(c);
+        C4_CHECK_MSG(pos != npos, "parse error: unterminated string");
+        l.type = L_OPERAND;
+        len = pos + 2;
+        break;
+    }
+    default:
+        if(_is_number_start(s))
+        {
+            l.type = L_OPERAND;
+            len = _scan_number(s);
+        }
+        else if(_is_name_start(c))
+        {
+            while(len < s.len)
+            {
+                if(_is_name_char(s[len]))
+                {
+                    ++len;
+                }
+                else if(s[len] == '-' && s[len - 1] != '.' && s[len - 1] != ']' && len + 1 < s.len && _is_name_start(s[len + 1]))
+                {
+                    // a hyphen between names is part of the name, eg
+                    // my-key, as in the yaml keys
+                    len += 2;
+                }
+                else if(s[len] == '[')
+                {
+                    // subscripts are part of the path; slices are not
+                    bool is_slice;
+                    size_t pos = _bracket_end(s, len, &is_slice);
+                    if(is_slice) break;
+                    len = pos + 1;
+                }
+                else
+                {
+                    break;
+                }
+            }
+            csubstr w = s.first(len);
+            if(w == "and")      l.type = L_AND;
+            else if(w == "or")  l.type = L_OR;
+            else if(w == "not") l.type = L_NOT;
+            else if(w == "in")  l.type = L_IN;
+            else                l.type = L_OPERAND;
+        }
+        else
+        {
+            C4_ERROR("parse error: unexpected character in expression");
+        }
+        break;
+    }
+    l.str = s.first(len);
+    *rem = s.sub(len);
+    return l;
+}
+
+/** a recursive descent parser emitting the postfix code. From the
+ * lowest to the highest precedence:
+ *
+ *   or   := and ('or' and)*
+ *   and  := not ('and' not)*
+ *   not  := 'not' not | cmp
+ *   cmp  := cat (('=='|'!='|'<'|'<='|'>'|'>='|'in'|'not' 'in') cat)?
+ *   cat  := add ('~' add)*
+ *   add  := mul (('+'|'-') mul)*
+ *   mul  := unary (('*'|'/'|'//'|'%') unary)*
+ *   unary := ('-'|'+') unary | postfix
+ *   postfix := primary ('[' or? ':' or? (':' or?)? ']')*
+ *   primary := '(' or ')' | literal | path | 'range' '(' or (',' or)* ')'
+ */
+struct ExprCompiler
+{
+    Expr   *m_expr;
+    csubstr m_rem;
+    Lexeme  m_curr;
+    size_t  m_depth;
+    size_t  m_max_depth;
+
+    ExprCompiler(Expr *e, csubstr s) : m_expr(e), m_rem(s), m_curr(), m_depth(0), m_max_depth(0) {}
+
+    void compile()
+    {
+        _advance();
+        _or();
+        C4_CHECK_MSG(m_curr.type == L_END, "parse error: unexpected token in expression");
+        C4_CHECK_MSG(m_max_depth <= Expr::StackSize, "expression is too deeply nested");
+    }
+
+    void _advance()
+    {
+        m_curr = _lex(&m_rem);
+    }
+
+    Lex_e _peek() const
+    {
+        csubstr r = m_rem;
+        return _lex(&r).type;
+    }
+
+    size_t _emit(Expr::Op_e op, size_t arg=0)
+    {
+        Expr::Instr in;
+        in.op = op;
+        in.arg = static_cast<uint32_t>(arg);
+        m_expr->m_code.push_back(in);
+        return m_expr->m_code.size() - 1;
+    }
+
+    /** make a jump land at the next instruction */
+    void _patch(size_t jump)
+    {
+        m_expr->m_code[jump].arg = static_cast<uint32_t>(m_expr->m_code.size());
+    }
+
+    /** and/or: when the left side decides the result, jump over the
+     * right side leaving the left value on the stack. */
+    void _logical(Lex_e lex, Expr::Op_e op, void (ExprCompiler::*operand)())
+    {
+        (this->*operand)();
+        while(m_curr.type == lex)
+        {
+            _advance();
+            size_t jump = _emit(op);
+            --m_depth; // the left value is popped when not jumping
+            (this->*operand)();
+            _patch(jump);
+        }
+    }
+
+    void _or()
+    {
+        _logical(L_OR, Expr::OP_OR, &ExprCompiler::_and);
+    }
+
+    void _and()
+    {
+        _logical(L_AND, Expr::OP_AND, &ExprCompiler::_not);
+    }
+
+    void _not()
+    {
+        if(m_curr.type == L_NOT)
+        {
+            _advance();
+            _not();
+            _emit(Expr::OP_NOT);
+            return;
+        }
+        _cmp();
+    }
+
+    void _cmp()
+    {
+        _cat();
+        Expr::Op_e op;
+        switch(m_curr.type)
+        {
+        case L_EQ: op = Expr::OP_EQ; break;
+        case L_NE: op = Expr::OP_NE; break;
+        case L_LT: op = Expr::OP_LT; break;
+        case L_LE: op = Expr::OP_LE; break;
+        case L_GT: op = Expr::OP_GT; break;
+        case L_GE: op = Expr::OP_GE; break;
+        case L_IN: op = Expr::OP_IN; break;
+        case L_NOT:
+            C4_CHECK_MSG(_peek() == L_IN, "parse error: expected in after not");
+            _advance();
+            op = Expr::OP_NOT_IN;
+            break;
+        default:
+            return;
+        }
+        _advance();
+        _cat();
+        _emit(op);
+        --m_depth;
+    }
+
+    /** a left-associative chain of binary operators */
+    void _binary(Lex_e const* lexes, Expr::Op_e const* ops, size_t num, void (ExprCompiler::*operand)())
+    {
+        (this->*operand)();
+        while(true)
+        {
+            size_t i = 0;
+            while(i < num && m_curr.type != lexes[i]) ++i;
+            if(i == num) break;
+            _advance();
+            (this->*operand)();
+            _emit(ops[i]);
+            --m_depth;
+        }
+    }
+
+    void _cat()
+    {
+        static const Lex_e lexes[] = {L_TILDE};
+        static const Expr::Op_e ops[] = {Expr::OP_CAT};
+        _binary(lexes, ops, 1, &ExprCompiler::_add);
+    }
+
+    void _add()
+    {
+        static const Lex_e lexes[] = {L_PLUS, L_MINUS};
+        static const Expr::Op_e ops[] = {Expr::OP_ADD, Expr::OP_SUB};
+        _binary(lexes, ops, 2, &ExprCompiler::_mul);
+    }
+
+    void _mul()
+    {
+        static const Lex_e lexes[] = {L_STAR, L_SLASH, L_SLASH2, L_PERCENT};
+        static const Expr::Op_e ops[] = {Expr::OP_MUL, Expr::OP_DIV, Expr::OP_FLOORDIV, Expr::OP_MOD};
+        _binary(lexes, ops, 4, &ExprCompiler::_unary);
+    }
+
+    void _unary()
+    {
+        if(m_curr.type == L_PLUS)
+        {
+            _advance();
+            _unary();
+            return;
+        }
+        if(m_curr.type != L_MINUS)
+        {
+            _postfix();
+            return;
+        }
+        _advance();
+        size_t pos = m_expr->m_code.size();
+        _unary();
+        // fold negative number literals into the literal
+        Expr::Instr const& last = m_expr->m_code.back();
+        if(m_expr->m_code.size() == pos + 1 && last.op == Expr::OP_PUSH)
+        {
+            Expr::Operand &op = m_expr->m_operands[last.arg];
+            if(op.m_type == Expr::Operand::LITERAL && op.m_val.is_number())
+            {
+                op.m_val = op.m_val.m_type == Value::INT ?
+                    Value::integer(static_cast<int64_t>(0u - static_cast<uint64_t>(op.m_val.m_int))) :
+                    Value::floating(-op.m_val.m_float);
+                return;
+            }
+        }
+        _emit(Expr::OP_NEG);
+    }
+
+    void _postfix()
+    {
+        _primary();
+        while(m_curr.type == L_LBRACKET)
+        {
+            // a slice: [start:stop:step], each of them optional
+            _advance();
+            size_t parts = 0;
+            if(m_curr.type != L_COLON)
+            {
+                _or();
+                parts |= Expr::SLICE_START;
+            }
+            C4_CHECK_MSG(m_curr.type == L_COLON, "parse error: expected :");
+            _advance();
+            if(m_curr.type != L_COLON && m_curr.type != L_RBRACKET)
+            {
+                _or();
+                parts |= Expr::SLICE_STOP;
+            }
+            if(m_curr.type == L_COLON)
+            {
+                _advance();
+                if(m_curr.type != L_RBRACKET)
+                {
+                    _or();
+                    parts |= Expr::SLICE_STEP;
+                }
+            }
+            C4_CHECK_MSG(m_curr.type == L_RBRACKET, "parse error: expected ]");
+            _advance();
+            _emit(Expr::OP_SLICE, parts);
+            for(size_t bit = Expr::SLICE_START; bit <= Expr::SLICE_STEP; bit <<= 1)
+            {
+                if(parts & bit) --m_depth;
+            }
+        }
+    }
+
+    void _call(csubstr name)
+    {
+        C4_CHECK_MSG(name == "range", "parse error: unknown function");
+        C4_ASSERT(m_curr.type == L_LPAREN);
+        _advance();
+        size_t num_args = 0;
+        while(m_curr.type != L_RPAREN)
+        {
+            if(num_args)
+            {
+                C4_CHECK_MSG(m_curr.type == L_COMMA, "parse error: expected ,");
+                _advance();
+            }
+            _or();
+            ++num_args;
+        }
+        _advance();
+        C4_CHECK_MSG(num_args >= 1 && num_args <= 3, "parse error: range() takes 1 to 3 arguments");
+        _emit(Expr::OP_RANGE, num_args);
+        m_depth -= num_args - 1;
+    }
+
+    void _primary()
+    {
+        if(m_curr.type == L_LPAREN)
+        {
+            _advance();
+            _or();
+            C4_CHECK_MSG(m_curr.type == L_RPAREN, "parse error: expected )");
+            _advance();
+            return;
+        }
+        C4_CHECK_MSG(m_curr.type == L_OPERAND, "parse error: expected an operand");
+        if(_is_name_start(m_curr.str[0]) && _peek() == L_LPAREN)
+        {
+            csubstr name = m_curr.str;
+            _advance();
+            _call(name);
+            return;
+        }
+        m_expr->m_operands.emplace_back();
+        Expr::Operand &op = m_expr->m_operands.back();
+        op.init(m_curr.str);
+        C4_CHECK_MSG(op.m_type == Expr::Operand::LITERAL || _is_name_start(m_curr.str[0]), "parse error: invalid number");
+        _emit(Expr::OP_PUSH, m_expr->m_operands.size() - 1);
+        if(++m_depth > m_max_depth) m_max_depth = m_depth;
+        _advance();
+    }
+};
+
+} // anon namespace
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+void Expr::compile(csubstr str)
+{
+    m_str = str;
+    m_code.clear();
+    m_operands.clear();
+    ExprCompiler c(this, str);
+    c.compile();
+}
+
+namespace {
+
+NodeRef _find_child(NodeRef n, csubstr key)
+{
+    return n.valid() && n.is_map() ? n.find_child(key) : NodeRef();
+}
+
+/** walk down the rest of a path from a node, eg .b[0]['c'] */
+Value _walk(NodeRef n, csubstr rest, csubstr path)
+{
+    while( ! rest.empty() && n.valid())
+    {
+        if(rest[0] == '.')
+        {
+            rest = rest.sub(1);
+            csubstr key = rest.left_of(rest.first_of(".["));
+            n = _find_child(n, key);
+            rest = rest.sub(key.len);
+        }
+        else
+        {
+            C4_ASSERT(rest[0] == '[');
+            size_t pos = rest.find(']');
+            C4_ASSERT(pos != npos);
+            csubstr key = rest.range(1, pos).trim(' ');
+            rest = rest.sub(pos + 1);
+            size_t idx;
+            if( ! key.empty() && _is_digit(key[0]) && from_chars(key, &idx))
+            {
+                n = idx < n.num_children() ? n.child(idx) : NodeRef();
+            }
+            else
+            {
+                n = _find_child(n, key.unquoted());
+            }
+        }
+    }
+    return n.valid() ? Value::node(n) : Value::nil(path);
+}
+
+} // anon namespace
+
+Value Expr::_load(Operand const& op, NodeRef const& root, RenderContext *ctx) const
+{
+    switch(op.m_type)
+    {
+    case Operand::LITERAL:
+        return op.m_val;
+    case Operand::LOOP:
+        if( ! ctx->m_loops.empty())
+        {
+            return ctx->m_loops.back().get(op.m_loop_field);
+        }
+        break; // not in a loop: look in the tree
+    case Operand::PATH:
+        break;
+    }
+    NodeRef n;
+    if(Value const* bound = ctx->lookup(op.m_name))
+    {
+        if(op.m_name.len == op.m_str.len)
+        {
+            return *bound;
+        }
+        if( ! bound->is_node())
+        {
+            return Value::nil(op.m_str);
+        }
+        n = bound->get_node();
+    }
+    else
+    {
+        n = _find_child(root, op.m_name);
+    }
+    return _walk(n, op.m_str.sub(op.m_name.len), op.m_str);
+}
+
+int Expr::_compare(Value const& a, Value const& b, Arena *arena)
+{
+    // numbers are compared as numbers only if neither side is a
+    // string literal
+    if(a.m_type != Value::STR && b.m_type != Value::STR)
+    {
+        Value na, nb;
+        if(a.get_number(&na) && b.get_number(&nb))
+        {
+            return na.compare_number(nb);
+        }
+    }
+    return a.to_str(arena).compare(b.to_str(arena));
+}
+
+bool Expr::_contains(Value const& container, Value const& val, Arena *arena)
+{
+    // names which are not found are taken literally, ie in
+    // `c0 in seq`, c0 is the string c0 unless it is in the data tree
+    csubstr v = val.is_nil() ? val.m_str : val.to_str(arena);
+    if(container.is_nil())
+    {
+        return false;
+    }
+    if(container.is_range())
+    {
+        Value::Range const& r = container.m_range;
+        if(container.is_slice())
+        {
+            c4::yml::Tree const* t = container.m_tree;
+            size_t ch = container.slice_first();
+            for(size_t i = 0, num = r.size(); i < num; ++i)
+            {
+                if(t->has_val(ch) && t->val(ch) == v) return true;
+                ch = container.slice_next(ch);
+            }
+            return false;
+        }
+        Value n;
+        if( ! val.get_number(&n) || n.m_type != Value::INT) return false;
+        int64_t i = n.m_int;
+        if(r.step > 0 ? (i < r.start || i >= r.stop) : (i > r.start || i <= r.stop)) return false;
+        return (i - r.start) % r.step == 0;
+    }
+    if(container.is_container())
+    {
+        NodeRef n = container.get_node();
+        if(n.is_map())
+        {
+            return n.find_child(v).valid();
+        }
+        for(auto ch : n.children())
+        {
+            if(ch.is_val() && ch.val() == v)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    return container.to_str(arena).find(v) != npos;
+}
+
+Value Expr::_arith(Op_e op, Value const& a, Value const& b)
+{
+    Value na, nb;
+    if( ! a.get_number(&na) || ! b.get_number(&nb))
+    {
+        return Value::nil();
+    }
+    if(op == OP_DIV) // always a floating point division
+    {
+        double d = nb.as_double();
+        return d != 0. ? Value::floating(na.as_double() / d) : Value::nil();
+    }
+    if(na.m_type == Value::INT && nb.m_type == Value::INT)
+    {
+        int64_t x = na.m_int, y = nb.m_int;
+        // wrap around on overflow, rather than invoking undefined behavior
+        uint64_t ux = static_cast<uint64_t>(x), uy = static_cast<uint64_t>(y);
+        switch(op)
+        {
+        case OP_ADD: return Value::integer(static_cast<int64_t>(ux + uy));
+        case OP_SUB: return Value::integer(static_cast<int64_t>(ux - uy));
+        case OP_MUL: return Value::integer(static_cast<int64_t>(ux * uy));
+        case OP_FLOORDIV:
+        {
+            if(y == 0) return Value::nil();
+            if(y == -1) return Value::integer(static_cast<int64_t>(0u - ux));
+            int64_t q = x / y;
+            if((x % y != 0) && ((x < 0) != (y < 0))) --q; // round towards -inf
+            return Value::integer(q);
+        }
+        case OP_MOD:
+        {
+            if(y == 0) return Value::nil();
+            if(y == -1) return Value::integer(0);
+            int64_t r = x % y;
+            if(r != 0 && ((r < 0) != (y < 0))) r += y; // the sign of the divisor
+            return Value::integer(r);
+        }
+        default:
+            break;
+        }
+    }
+    else
+    {
+        double x = na.as_double(), y = nb.as_double();
+        switch(op)
+        {
+        case OP_ADD: return Value::floating(x + y);
+        case OP_SUB: return Value::floating(x - y);
+        case OP_MUL: return Value::floating(x * y);
+        case OP_FLOORDIV:
+            return y != 0. ? Value::floating(std::floor(x / y)) : Value::nil();
+        case OP_MOD:
+        {
+            if(y == 0.) return Value::nil();
+            double r = std::fmod(x, y);
+            if(r != 0. && ((r < 0.) != (y < 0.))) r += y;
+            return Value::floating(r);
+        }
+        default:
+            break;
+        }
+    }
+    C4_ERROR("unknown opcode");
+    return Value::nil();
+}
+
+namespace {
+bool _get_int(Value const& v, int64_t *i)
+{
+    Value n;
+    if( ! v.get_number(&n)) return false;
+    *i = n.m_type == Value::INT ? n.m_int : static_cast<int64_t>(n.m_float);
+    return true;
+}
+} // anon namespace
+
+Value Expr::_range(Value const* args, size_t num_args)
+{
+    int64_t a[3] = {0, 0, 1}; // start, stop, step
+    int64_t *first = num_args == 1 ? a + 1 : a;
+    for(size_t i = 0; i < num_args; ++i)
+    {
+        if( ! _get_int(args[i], first + i)) return Value::nil();
+    }
+    if(a[2] == 0) return Value::nil();
+    return Value::range(a[0], a[1], a[2]);
+}
+
+Value Expr::_slice(Value const& seq, Value const* args, size_t parts)
+{
+    // the same semantics as python: negative positions count from
+    // the end, and the positions are clamped to the sequence.
+    int64_t start = 0, stop = 0, step = 1;
+    bool has_start = parts & SLICE_START, has_stop = parts & SLICE_STOP;
+    if(has_start && ! _get_int(*args++, &start)) return Value::nil();
+    if(has_stop  && ! _get_int(*args++, &stop))  return Value::nil();
+    if((parts & SLICE_STEP) && ! _get_int(*args++, &step)) return Value::nil();
+    if(step == 0) return Value::nil();
+    int64_t len;
+    if(seq.is_container() && step > 0 && start >= 0 && has_stop && stop >= 0)
+    {
+        // the bounds do not depend on the length: clamp stop by walking
+        // the children up to it, instead of counting all of them
+        int64_t pos = 0; // min(stop, len)
+        for(size_t ch = seq.m_tree->first_child(seq.m_node); ch != NONE && pos < stop; ch = seq.m_tree->next_sibling(ch))
+        {
+            ++pos;
+        }
+        return Value::slice(seq.get_node(), start, pos, step);
+    }
+    else if(seq.is_container())
+    {
+        len = static_cast<int64_t>(seq.get_node().num_children());
+    }
+    else if(seq.is_range())
+    {
+        len = static_cast<int64_t>(seq.m_range.size());
+    }
+    else
+    {
+        return Value::nil();
+    }
+    auto adjust = [len, step](int64_t pos) -> int64_t {
+        if(pos < 0) pos += len;
+        if(step > 0) return pos < 0 ? 0 : (pos > len ? len : pos);
+        return pos < -1 ? -1 : (pos > len - 1 ? len - 1 : pos);
+    };
+    start = has_start ? adjust(start) : (step > 0 ? 0 : len - 1);
+    stop  = has_stop  ? adjust(stop)  : (step > 0 ? len : -1);
+    if(seq.is_container())
+    {
+        return Value::slice(seq.get_node(), start, stop, step);
+    }
+    // a slice of a range is another range
+    Value::Range const& r = seq.m_range;
+    Value ret = Value::range(r.start + start * r.step, r.start + stop * r.step, r.step * step);
+    ret.m_tree = seq.m_tree;
+    ret.m_node = seq.m_node;
+    return ret;
+}
+
+Value Expr::_concat(Value const& a, Value const& b, Arena *arena)
+{
+    csubstr sa = a.to_str(arena), sb = b.to_str(arena);
+    if(sb.empty()) return Value::str(sa);
+    if(sa.empty()) return Value::str(sb);
+    substr buf = arena->alloc(sa.len + sb.len);
+    memcpy(buf.str, sa.str, sa.len);
+    memcpy(buf.str + sa.len, sb.str, sb.len);
+    return Value::str(buf);
+}
+
+Value Expr::eval(NodeRef const& root, RenderContext *ctx) const
+{
+    C4_ASSERT( ! m_code.empty());
+    Value stack[StackSize];
+    size_t sp = 0;
+    for(size_t ip = 0, end = m_code.size(); ip < end; ++ip)
+    {
+        Instr const& in = m_code[ip];
+        switch(in.op)
+        {
+        case OP_PUSH:
+            C4_ASSERT(sp < StackSize);
+            stack[sp++] = _load(m_operands[in.arg], root, ctx);
+            break;
+        case OP_NOT:
+            C4_ASSERT(sp >= 1);
+            stack[sp-1] = Value::boolean( ! stack[sp-1].truthy());
+            break;
+        case OP_NEG:
+            C4_ASSERT(sp >= 1);
+            stack[sp-1] = _arith(OP_SUB, Value::integer(0), stack[sp-1]);
+            break;
+        case OP_RANGE:
+            C4_ASSERT(sp >= in.arg && in.arg >= 1);
+            sp -= in.arg;
+            stack[sp] = _range(stack + sp, in.arg);
+            ++sp;
+            break;
+        case OP_SLICE:
+        {
+            size_t num = (in.arg & SLICE_START ? 1 : 0) + (in.arg & SLICE_STOP ? 1 : 0) + (in.arg & SLICE_STEP ? 1 : 0);
+            C4_ASSERT(sp >= num + 1);
+            sp -= num;
+            stack[sp-1] = _slice(stack[sp-1], stack + sp, in.arg);
+            break;
+        }
+        case OP_AND:
+        case OP_OR:
+            C4_ASSERT(sp >= 1);
+            if(stack[sp-1].truthy() == (in.op == OP_OR))
+            {
+                C4_ASSERT(in.arg > ip && in.arg <= end);
+                ip = in.arg - 1; // the loop increments it
+            }
+            else
+            {
+                --sp;
+            }
+            break;
+        default:
+        {
+            C4_ASSERT(sp >= 2);
+            --sp;
+            Value const& b = stack[sp];
+            Value const& a = stack[sp-1];
+            Arena *arena = &ctx->m_arena;
+            bool r = false;
+            switch(in.op)
+            {
+            case OP_EQ:     r = _compare(a, b, arena) == 0; break;
+            case OP_NE:     r = _compare(a, b, arena) != 0; break;
+            case OP_LT:     r = _compare(a, b, arena) <  0; break;
+            case OP_LE:     r = _compare(a, b, arena) <= 0; break;
+            case OP_GT:     r = _compare(a, b, arena) >  0; break;
+            case OP_GE:     r = _compare(a, b, arena) >= 0; break;
+            case OP_IN:     r =   _contains(b, a, arena); break;
+            case OP_NOT_IN: r = ! _contains(b, a, arena); break;
+            case OP_CAT:
+                stack[sp-1] = _concat(a, b, arena);
+                continue;
+            default:
+                stack[sp-1] = _arith(in.op, a, b);
+                continue;
+            }
+            stack[sp-1] = Value::boolean(r);
+            break;
+        }
+        }
+    }
+    C4_ASSERT(sp == 1);
+    return stack[0];
+}
+
+} // namespace tpl
+} // namespace c4
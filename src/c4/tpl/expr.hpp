@@ -0,0 +1,134 @@
+#ifndef _C4_TPL_EXPR_HPP_
+#define _C4_TPL_EXPR_HPP_
+
+#include <vector>
+#include "c4/tpl/render_context.hpp"
+#include "c4/tpl/value.hpp"
+
+namespace c4 {
+namespace tpl {
+
+using NodeRef = c4::yml::NodeRef;
+
+/** A compiled expression, eg a {% if %} condition or the contents of
+ * a {{ }} expression:
+ *
+ *   not (a.b > 3 and c in d) or e == "foo"
+ *   price * qty + 1
+ *   prefix ~ name
+ *
+ * Supported are the boolean operators and, or, not; the comparisons
+ * ==, !=, <, <=, >, >=, in, not in; the arithmetic operators +, -, *,
+ * / (always floating point), // (floor division), %, and unary -; the
+ * string concatenation ~; parentheses; string, number and boolean
+ * (true/false) literals; paths into the data tree; and the fields of
+ * the innermost loop (loop.index, loop.first, etc). Sequences can be
+ * sliced, eg items[10:20] or items[-5:], and range(start, stop, step)
+ * gives a sequence of integers; neither makes a copy of the data. The
+ * first name in a path is looked up in the names bound while rendering
+ * (eg, loop variables) before looking in the data tree. Arithmetic on
+ * values which are not numbers, or dividing by zero, yields nil.
+ *
+ * A hyphen followed by a letter or _ is part of a name, so that keys
+ * like my-key can be used in paths: a subtraction of names needs
+ * spaces, eg a - b. n-1 is a subtraction. Keys with other characters
+ * are accessed with a quoted subscript, eg a["my key"].
+ *
+ * The expression is compiled once into a postfix program which is
+ * evaluated with a fixed-size stack; and/or are compiled to jumps, so
+ * evaluation is short-circuited. */
+struct Expr
+{
+public:
+
+    enum : size_t { StackSize = 16 };
+
+    /** an operand, classified when the expression is compiled */
+    struct Operand
+    {
+        typedef enum {
+            LITERAL,  //!< a string, number or bool (true/false) literal
+            PATH,     //!< a path into the data tree; resolved on every evaluation
+            LOOP,     //!< a field of the innermost loop, eg loop.index
+        } Type_e;
+
+        Type_e  m_type;
+        csubstr m_str;    //!< the path, or the text of the literal
+        csubstr m_name;   //!< the first name in the path, looked up in the bound names and then in the tree
+        Value   m_val;    //!< the value of the literal
+        LoopInfo::Field_e m_loop_field;
+
+        void init(csubstr s);
+    };
+
+    typedef enum : uint8_t {
+        OP_PUSH,      //!< push operand[arg]
+        OP_NOT,
+        OP_AND,       //!< if the top is falsy, jump to arg; otherwise pop it
+        OP_OR,        //!< if the top is truthy, jump to arg; otherwise pop it
+        OP_EQ,
+        OP_NE,
+        OP_LT,
+        OP_LE,
+        OP_GT,
+        OP_GE,
+        OP_IN,
+        OP_NOT_IN,
+        OP_NEG,
+        OP_ADD,
+        OP_SUB,
+        OP_MUL,
+        OP_DIV,
+        OP_FLOORDIV,
+        OP_MOD,
+        OP_CAT,       //!< concatenate the values as strings, into the arena
+        OP_RANGE,     //!< range() with arg arguments
+        OP_SLICE,     //!< slice a sequence; arg has the SLICE_ flags of the parts given
+    } Op_e;
+
+    enum : uint32_t { SLICE_START = 1, SLICE_STOP = 2, SLICE_STEP = 4 };
+
+    struct Instr
+    {
+        Op_e     op;
+        uint32_t arg;
+    };
+
+public:
+
+    csubstr m_str;
+    std::vector<Instr>   m_code;
+    std::vector<Operand> m_operands;
+
+public:
+
+    Expr() : m_str(), m_code(), m_operands() {}
+
+    bool empty() const { return m_code.empty(); }
+
+    /** compile the expression. Errors are reported with C4_ERROR(). */
+    void compile(csubstr str);
+
+    /** evaluate the expression. Strings produced by the evaluation
+     * are placed in the arena of the context. */
+    Value eval(NodeRef const& root, RenderContext *ctx) const;
+
+    /** evaluate the expression, and get its value as a boolean */
+    bool eval_bool(NodeRef const& root, RenderContext *ctx) const { return eval(root, ctx).truthy(); }
+
+private:
+
+    Value _load(Operand const& op, NodeRef const& root, RenderContext *ctx) const;
+
+    static int  _compare(Value const& a, Value const& b, Arena *arena);
+    static bool _contains(Value const& container, Value const& val, Arena *arena);
+    static Value _arith(Op_e op, Value const& a, Value const& b);
+    static Value _concat(Value const& a, Value const& b, Arena *arena);
+    static Value _range(Value const* args, size_t num_args);
+    static Value _slice(Value const& seq, Value const* args, size_t parts);
+};
+
+} // namespace tpl
+} // namespace c4
+
+#endif /* _C4_TPL_EXPR_HPP_ */
@@ -2,6 +2,7 @@
 #define C4_TPL_MGR_HPP_
 
 #include <stddef.h>
+#include <vector>
 #include <c4/allocator.hpp>
 #include <c4/memory_util.hpp>
 #include <c4/substr.hpp>
@@ -16,6 +17,18 @@ namespace tpl {
 //-----------------------------------------------------------------------------
 
 using REFIID = void const*;
+
+/** FNV-1a, for the hash tables of names */
+inline size_t hash_name(csubstr s)
+{
+    size_t h = size_t(14695981039346656037ull);
+    for(char c : s)
+    {
+        h ^= (size_t)(unsigned char)c;
+        h *= size_t(1099511628211ull);
+    }
+    return h;
+}
 //#define __uuidof(T) T::s_uuidof()
 
 
@@ -128,24 +141,36 @@ struct ObjMgr
 {
     using pool_type = ObjPool<B, Pool>;
     using pool_collection_type = pool_collection<ObjPool<B, Pool>, NumPoolsMax>;
+    using allocator_type = typename Pool::allocator_type;
     using I = typename pool_type::I;
 
     struct name_id
     {
         csubstr name;
-        I id;
+        size_t  hash;
+        I id;  ///< the pool of the type, or no_type if the slot is empty
     };
 
+    enum : I { no_type = I(-1) };
+
 public:
 
     pool_collection<ObjPool<B, Pool>, NumPoolsMax> m_pools;
-    I m_size;
 
-    name_id m_type_ids; ///< @todo
+    /** an open-addressing hash table (with linear probing) from the
+     * type names to the pools, built by register_type(). Its size is a
+     * power of two, kept at least twice the number of types. */
+    std::vector<name_id> m_type_ids;
+
+    allocator_type m_allocator; ///< for the pools
 
 public:
 
-    ObjMgr() : m_pools(), m_size(0), m_type_ids()
+    ObjMgr() : m_pools(), m_type_ids(), m_allocator()
+    {
+    }
+
+    explicit ObjMgr(allocator_type const& a) : m_pools(a), m_type_ids(), m_allocator(a)
     {
     }
 
@@ -174,10 +199,23 @@ public:
     {
         clear();
         m_pools.free();
+        m_type_ids.clear();
     }
 
-    bool empty() const { return m_size == 0; }
-    I size() const { return m_size; }
+    bool empty() const { return size() == 0; }
+
+    /** the number of objects. It is the sum of the sizes of the pools,
+     * so that the objects can be created concurrently when the pools
+     * allow it. */
+    I size() const
+    {
+        I sz = 0;
+        for(auto const& p : m_pools)
+        {
+            sz += p.size();
+        }
+        return sz;
+    }
 
 public:
 
@@ -185,13 +223,14 @@ public:
     I register_type(I size=sizeof(T), I align=alignof(T))
     {
         static_assert(std::is_base_of<B, T>::value, "B must be base of T");
-        I type_id = m_pools.add_pool(size, align, 0);
+        I type_id = m_pools.add_pool(size, align, 0, varargs, m_allocator);
         T::_s_set_type_id(type_id);
         pool_type *p = m_pools.get_pool(type_id);
         p->m_type_id = type_id;
         p->m_type_name = to_csubstr(T::s_type_name());
         p->m_type_create = &T::_s_create_base;
         p->m_type_destroy = &T::_s_destroy;
+        _add_type_name(p->m_type_name, type_id);
         return type_id;
     }
 
@@ -223,26 +262,58 @@ public:
 
     pool_type * get_pool(csubstr type_name)
     {
-        for(auto &p : m_pools)
+        I id = _find_type_name(type_name);
+        return id != no_type ? m_pools.get_pool(id) : nullptr;
+    }
+
+    pool_type const* get_pool(csubstr type_name) const
+    {
+        I id = _find_type_name(type_name);
+        return id != no_type ? m_pools.get_pool(id) : nullptr;
+    }
+
+public:
+
+    I _find_type_name(csubstr name) const
+    {
+        if(m_type_ids.empty()) return no_type;
+        size_t h = hash_name(name);
+        size_t mask = m_type_ids.size() - 1;
+        for(size_t i = h & mask; ; i = (i + 1) & mask)
         {
-            if(p.m_type_name == type_name)
-            {
-                return &p;
-            }
+            name_id const& e = m_type_ids[i];
+            if(e.id == no_type) return no_type;
+            if(e.hash == h && e.name == name) return e.id;
         }
-        return nullptr;
     }
 
-    pool_type const* get_pool(csubstr type_name) const
+    void _add_type_name(csubstr name, I id)
     {
-        for(auto &p : m_pools)
+        C4_CHECK_MSG(_find_type_name(name) == no_type, "type name already registered");
+        if(2 * (size_t(m_pools.num_pools()) + 1) > m_type_ids.size())
         {
-            if(p.m_type_name == type_name)
+            // grow, and reinsert the names
+            size_t sz = m_type_ids.empty() ? 16 : 2 * m_type_ids.size();
+            std::vector<name_id> prev;
+            prev.swap(m_type_ids);
+            m_type_ids.assign(sz, name_id{csubstr{}, 0, no_type});
+            for(name_id const& e : prev)
             {
-                return &p;
+                if(e.id != no_type) _insert_type_name(e);
             }
         }
-        return nullptr;
+        _insert_type_name(name_id{name, hash_name(name), id});
+    }
+
+    void _insert_type_name(name_id const& e)
+    {
+        size_t mask = m_type_ids.size() - 1;
+        size_t i = e.hash & mask;
+        while(m_type_ids[i].id != no_type)
+        {
+            i = (i + 1) & mask;
+        }
+        m_type_ids[i] = e;
     }
 
 public:
@@ -255,7 +326,6 @@ public:
         pool_type *p = get_pool(type_id);
         T* tptr = new (m_pools.get(id)) T(std::forward<CtorArgs>(args)...);
         tptr->_set_id(id);
-        ++m_size;
         return tptr;
     }
 
@@ -265,24 +335,26 @@ public:
         pool_type *p = get_pool(type_id);
         B* tptr = p->m_type_create(m_pools.get(id));
         tptr->_set_id(id);
-        ++m_size;
         return tptr;
     }
 
     B * create_from_pool(csubstr type_name)
     {
         pool_type *p = this->get_pool(type_name);
+        C4_CHECK_MSG(p != nullptr, "type not registered");
         I id = m_pools.claim(p->m_type_id);
         B* tptr = p->m_type_create(m_pools.get(id));
         tptr->_set_id(id);
-        ++m_size;
         return tptr;
     }
 
+    /** destroy an object. Its memory is reused by the next objects
+     * created from the same pool. */
     void release(I id)
     {
+        pool_type *p = get_pool(m_pools.decode_pool(id));
+        p->m_type_destroy(m_pools.get(id));
         m_pools.release(id);
-        --m_size;
     }
 
 public:
@@ -300,6 +372,49 @@ public:
         return ptr;
     }
 
+public:
+
+    /** call fn(T&) for each object of type T. The objects are visited
+     * in the memory of their pool, with their type known at compile
+     * time, so the calls made by fn can be inlined. */
+    template<class T, class Fn>
+    void for_each(Fn &&fn)
+    {
+        get_pool<T>()->template for_each<T>(fn);
+    }
+
+    template<class T, class Fn>
+    void for_each(Fn &&fn) const
+    {
+        get_pool<T>()->template for_each<T const>(fn);
+    }
+
+    /** visit all the objects, calling v(T&) with the types given in Ts
+     * for the objects of those types, and v(B&) for the objects of any
+     * other type. */
+    template<class... Ts, class Visitor>
+    void visit_all(Visitor &&v)
+    {
+        for(auto &p : m_pools)
+        {
+            bool done = false;
+            using expand = int[];
+            (void)expand{0, (done = done || _visit_as<Ts>(p, v), 0)...};
+            if( ! done)
+            {
+                p.template for_each<B>(v);
+            }
+        }
+    }
+
+    template<class T, class Visitor>
+    static bool _visit_as(pool_type &p, Visitor &v)
+    {
+        if(p.m_type_id != T::s_type_id()) return false;
+        p.template for_each<T>(v);
+        return true;
+    }
+
 public:
 
     using       iterator = pool_iterator_impl<      pool_type,       B>;
@@ -0,0 +1,214 @@
+#include "c4/tpl/mmap.hpp"
+#include <string.h>
+
+#if defined(__unix__) || defined(__unix) || defined(__APPLE__)
+#   define C4TPL_HAS_MMAP
+#   include <sys/mman.h>
+#   include <unistd.h>
+#endif
+
+namespace c4 {
+namespace tpl {
+
+namespace {
+
+C4_ALWAYS_INLINE size_t _round_up(size_t sz, size_t alignment)
+{
+    return (sz + alignment - 1) & ~(alignment - 1);
+}
+
+C4_ALWAYS_INLINE size_t _log2_ceil(size_t sz)
+{
+    size_t n = 0;
+    while((size_t(1) << n) < sz)
+    {
+        ++n;
+    }
+    return n;
+}
+
+} // anon namespace
+
+
+MemoryResourceMmap::MemoryResourceMmap(size_t arena_size, uint32_t flags)
+    : m_arena_size(_round_up(arena_size > HugePageSize ? arena_size : HugePageSize, HugePageSize)),
+      m_flags(flags),
+      m_arenas(),
+      m_pos(nullptr),
+      m_end(nullptr),
+      m_bins(),
+      m_mapped_bytes(0),
+      m_allocated_bytes(0),
+      m_mutex()
+{
+    name = "c4tpl_mmap";
+}
+
+MemoryResourceMmap::~MemoryResourceMmap()
+{
+    for(arena const& a : m_arenas)
+    {
+        _unmap(a.m_mem, a.m_size);
+    }
+}
+
+size_t MemoryResourceMmap::num_arenas() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_arenas.size();
+}
+
+size_t MemoryResourceMmap::mapped_bytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_mapped_bytes;
+}
+
+size_t MemoryResourceMmap::allocated_bytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_allocated_bytes;
+}
+
+size_t MemoryResourceMmap::_bin(size_t sz, size_t alignment)
+{
+    sz = sz > alignment ? sz : alignment;
+    sz = sz > MinBlockSize ? sz : MinBlockSize;
+    return _log2_ceil(sz);
+}
+
+void* MemoryResourceMmap::do_allocate(size_t sz, size_t alignment, void* /*hint*/)
+{
+    size_t bin = _bin(sz, alignment);
+    size_t block_size = size_t(1) << bin;
+    alignment = alignment > MinBlockSize ? alignment : MinBlockSize;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(block_size > m_arena_size / 4)
+    {
+        // large allocations are mapped on their own
+        void *mem = _map(_round_up(sz, HugePageSize));
+        if(mem)
+        {
+            m_allocated_bytes += _round_up(sz, HugePageSize);
+        }
+        return mem;
+    }
+    // reuse a released block
+    free_block *b = m_bins[bin];
+    if(b != nullptr && (((uintptr_t)b) & (alignment - 1)) == 0)
+    {
+        m_bins[bin] = b->m_next;
+        m_allocated_bytes += block_size;
+        return b;
+    }
+    // otherwise, bump from the current arena
+    char *pos = (char*)_round_up((uintptr_t)m_pos, alignment);
+    if(m_pos == nullptr || pos + block_size > m_end)
+    {
+        char *mem = (char*)_map(m_arena_size);
+        if( ! mem) return nullptr;
+        m_arenas.push_back({mem, m_arena_size});
+        m_end = mem + m_arena_size;
+        pos = (char*)_round_up((uintptr_t)mem, alignment);
+    }
+    m_pos = pos + block_size;
+    m_allocated_bytes += block_size;
+    return pos;
+}
+
+void* MemoryResourceMmap::do_reallocate(void* ptr, size_t oldsz, size_t newsz, size_t alignment)
+{
+    if(ptr != nullptr && _bin(oldsz, alignment) == _bin(newsz, alignment) && (size_t(1) << _bin(newsz, alignment)) <= m_arena_size / 4)
+    {
+        return ptr; // still fits in the same block
+    }
+    void *mem = do_allocate(newsz, alignment, ptr);
+    if(mem && ptr)
+    {
+        memcpy(mem, ptr, oldsz < newsz ? oldsz : newsz);
+        do_deallocate(ptr, oldsz, alignment);
+    }
+    return mem;
+}
+
+void MemoryResourceMmap::do_deallocate(void* ptr, size_t sz, size_t alignment)
+{
+    if(ptr == nullptr) return;
+    size_t bin = _bin(sz, alignment);
+    size_t block_size = size_t(1) << bin;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(block_size > m_arena_size / 4)
+    {
+        _unmap(ptr, _round_up(sz, HugePageSize));
+        m_allocated_bytes -= _round_up(sz, HugePageSize);
+        return;
+    }
+    free_block *b = (free_block*)ptr;
+    b->m_next = m_bins[bin];
+    m_bins[bin] = b;
+    m_allocated_bytes -= block_size;
+}
+
+void* MemoryResourceMmap::_map(size_t sz)
+{
+    void *mem = nullptr;
+#ifdef C4TPL_HAS_MMAP
+    int mmap_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    bool huge = (m_flags & HUGE_PAGES) != 0;
+    #ifdef MAP_POPULATE
+    // with huge pages, the memory is populated only after the advice
+    if((m_flags & POPULATE) && ! huge)
+    {
+        mmap_flags |= MAP_POPULATE;
+    }
+    #endif
+    // with huge pages, map a huge page more to be able to align
+    size_t map_sz = huge ? sz + HugePageSize : sz;
+    char *raw = (char*) ::mmap(nullptr, map_sz, PROT_READ|PROT_WRITE, mmap_flags, -1, 0);
+    if(raw == (char*)MAP_FAILED) return nullptr;
+    char *aligned = raw;
+    if(huge)
+    {
+        // trim the unaligned head and the tail
+        aligned = (char*)_round_up((uintptr_t)raw, HugePageSize);
+        if(aligned != raw)
+        {
+            ::munmap(raw, (size_t)(aligned - raw));
+        }
+        size_t tail = (size_t)((raw + map_sz) - (aligned + sz));
+        if(tail)
+        {
+            ::munmap(aligned + sz, tail);
+        }
+        #ifdef MADV_HUGEPAGE
+        ::madvise(aligned, sz, MADV_HUGEPAGE);
+        #endif
+        if(m_flags & POPULATE)
+        {
+            const size_t page_size = (size_t)::sysconf(_SC_PAGESIZE);
+            for(size_t i = 0; i < sz; i += page_size)
+            {
+                ((volatile char*)aligned)[i] = 0;
+            }
+        }
+    }
+    mem = aligned;
+#else
+    mem = get_memory_resource()->allocate(sz, HugePageSize);
+#endif
+    m_mapped_bytes += sz;
+    return mem;
+}
+
+void MemoryResourceMmap::_unmap(void *mem, size_t sz)
+{
+#ifdef C4TPL_HAS_MMAP
+    ::munmap(mem, sz);
+#else
+    get_memory_resource()->deallocate(mem, sz, HugePageSize);
+#endif
+    m_mapped_bytes -= sz;
+}
+
+} // namespace tpl
+} // namespace c4
@@ -0,0 +1,101 @@
+#ifndef _C4_TPL_MMAP_HPP_
+#define _C4_TPL_MMAP_HPP_
+
+#include <mutex>
+#include <vector>
+#include "c4/tpl/common.hpp"
+#include "c4/allocator.hpp"
+
+namespace c4 {
+namespace tpl {
+
+/** A memory resource for the long-lived storage of parsed templates
+ * (the token pools and the ropes), to reduce the TLB misses when
+ * walking them. It maps large arenas with mmap(), advising the kernel
+ * to back them with huge pages, and hands out blocks from them. The
+ * blocks are sized in powers of two; released blocks are kept in a free
+ * list per size, and reused by the next allocations of the same size.
+ * Allocations larger than a quarter of the arena are mapped on their
+ * own. The arenas are unmapped when the resource is destroyed, so it
+ * must outlive everything allocated from it.
+ *
+ * Pass it to the objects using it as an allocator_mr<char>, eg
+ * Engine(&mr), Rope(&mr) or TokenContainer(&mr). It is thread safe.
+ * Where mmap() is not available, the arenas are obtained from the
+ * global memory resource. */
+class MemoryResourceMmap : public MemoryResource
+{
+public:
+
+    typedef enum : uint32_t {
+        HUGE_PAGES = 1u << 0,  //!< advise the kernel to back the arenas with huge pages (MADV_HUGEPAGE)
+        POPULATE   = 1u << 1,  //!< pre-fault the arenas when they are mapped (MAP_POPULATE)
+    } Flags_e;
+
+    enum : size_t {
+        DefaultArenaSize = size_t(32) << 20,
+        HugePageSize = size_t(2) << 20,
+        MinBlockSize = 64,
+        NumBins = 8 * sizeof(size_t),
+    };
+
+public:
+
+    explicit MemoryResourceMmap(size_t arena_size=DefaultArenaSize, uint32_t flags=HUGE_PAGES);
+    ~MemoryResourceMmap() override;
+
+    MemoryResourceMmap(MemoryResourceMmap const&) = delete;
+    MemoryResourceMmap& operator= (MemoryResourceMmap const&) = delete;
+
+public:
+
+    uint32_t flags() const { return m_flags; }
+    size_t arena_size() const { return m_arena_size; }
+
+    size_t num_arenas() const;
+    /** the bytes currently mapped, including the large allocations */
+    size_t mapped_bytes() const;
+    /** the bytes currently handed out, rounded up to the block sizes */
+    size_t allocated_bytes() const;
+
+protected:
+
+    void* do_allocate(size_t sz, size_t alignment, void* hint) override;
+    void* do_reallocate(void* ptr, size_t oldsz, size_t newsz, size_t alignment) override;
+    void  do_deallocate(void* ptr, size_t sz, size_t alignment) override;
+
+private:
+
+    struct arena
+    {
+        char * m_mem;
+        size_t m_size;
+    };
+
+    struct free_block
+    {
+        free_block *m_next;
+    };
+
+    static size_t _bin(size_t sz, size_t alignment);
+
+    void* _map(size_t sz);
+    void  _unmap(void *mem, size_t sz);
+
+private:
+
+    size_t   m_arena_size;
+    uint32_t m_flags;
+    std::vector<arena> m_arenas;
+    char *   m_pos;     ///< the current position in the last arena
+    char *   m_end;     ///< the end of the last arena
+    free_block * m_bins[NumBins];  ///< the released blocks, by log2 of their size
+    size_t   m_mapped_bytes;
+    size_t   m_allocated_bytes;
+    mutable std::mutex m_mutex;
+};
+
+} // namespace tpl
+} // namespace c4
+
+#endif /* _C4_TPL_MMAP_HPP_ */
@@ -2,6 +2,7 @@
 #define _C4_POOL_HPP_
 
 #include "c4/allocator.hpp"
+#include <atomic>
 
 namespace c4 {
 
@@ -124,12 +125,56 @@ public:
         C4_ASSERT(id <= m_num_objs);
         return (((char*)m_mem) + id * m_obj_size);
     }
+
+    void *_at(I slot) const { return get(slot); }
+    bool _is_free(I) const { return false; }
+
+    /** call fn(T&) for each object. T must be the type of the objects,
+     * or a base placed at their start. */
+    template<class T, class Fn>
+    void for_each(Fn &fn) const
+    {
+        char *mem = (char*)m_mem;
+        if(sizeof(T) == m_obj_size)
+        {
+            T *objs = (T*)mem;
+            for(I i = 0; i < m_num_objs; ++i)
+            {
+                fn(objs[i]);
+            }
+        }
+        else
+        {
+            for(I i = 0; i < m_num_objs; ++i)
+            {
+                fn(*(T*)(mem + i * m_obj_size));
+            }
+        }
+    }
 };
 
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
+/** Define C4_POOL_GENERATIONS to 1 to have the paged pools keep in the
+ * ids a count of the reuses of their slot, and assert that the ids of
+ * released objects are not used. It is enabled by default in debug
+ * builds. */
+#ifndef C4_POOL_GENERATIONS
+#   ifdef NDEBUG
+#       define C4_POOL_GENERATIONS 0
+#   else
+#       define C4_POOL_GENERATIONS 1
+#   endif
+#endif
+
+/** A pool allocating its objects in pages, which are never relocated.
+ * Released objects are placed in an intrusive free list (the slot of a
+ * free object holds the index of the next free slot), and reused by
+ * the next claims, so both claim() and release() are O(1) and the
+ * memory stays bounded when objects are created and released
+ * continuously. */
 template<size_t PageSize_, class I, class Allocator>
 struct pool_linear_paged
 {
@@ -144,16 +189,21 @@ public:
 
     struct Page
     {
-        void * mem;   ///< the memory for this page
-        I      numpg; ///< number of pages allocated in this block
-                      ///< (the following numpg pages are allocated together
-                      ///< with this block, and their numpg is set to 0)
+        void *    mem;   ///< the memory for this page
+        uint8_t * slots; ///< the state of each slot of this page: bit 0 is set when the slot
+                         ///< is free; the other bits have the generation of the slot. It is
+                         ///< held in the memory block, after the objects of all its pages.
+        I         numpg; ///< number of pages allocated in this block
+                         ///< (the following numpg pages are allocated together
+                         ///< with this block, and their numpg is set to 0)
     };
 
     Page *    m_pages;      ///< the page buffer
     I         m_obj_size;   ///< the size of each object
     I         m_obj_align;  ///< the alignment of each object
-    I         m_num_objs;   ///< the current number of objects
+    I         m_num_objs;   ///< the current number of slots in use, including the free ones
+    I         m_num_free;   ///< the current number of free slots
+    I         m_free_head;  ///< the first free slot
 
     /** first: the number of pages
      * second: the allocator */
@@ -170,12 +220,26 @@ public:
         /** page lsb: the number of bits complementary to PageSize. Use to
          * extract the page of an index. */
         page_lsb = lsb11<I, PageSize>::value,
+        /** the end of the free list */
+        free_end = I(-1),
+        /** the number of bits of the generation in the ids. Only with
+         * 64 bit ids, as they are placed below the top 16 bits, which
+         * are left for the pool collections. */
+        gen_bits = (C4_POOL_GENERATIONS && sizeof(I) >= 8) ? I(7) : I(0),
+        gen_shift = I(8) * I(sizeof(I)) - I(16) - gen_bits,
+        /** slot mask: use to extract the slot of an id */
+        slot_mask = gen_bits != I(0) ? ((I(1) << gen_shift) - I(1)) : I(-1),
     };
 
+    /** whether the ids have a generation */
+    static constexpr const bool has_gen = gen_bits != I(0);
+
     static constexpr inline I _page(I id) { return id >> page_lsb; }
     static constexpr inline I _pos (I id) { return id &  id_mask; }
     static constexpr inline I _id(I pg, I pos) { return (pg << page_lsb) | pos; }
 
+    static constexpr inline I _slot(I id) { return id & slot_mask; }
+
 public:
 
     C4_NO_COPY_OR_MOVE(pool_linear_paged);
@@ -186,6 +250,8 @@ public:
         m_obj_size{0},
         m_obj_align{0},
         m_num_objs{0},
+        m_num_free{0},
+        m_free_head{free_end},
         m_numpg_allocator{0, {}}
     {
     }
@@ -195,7 +261,7 @@ public:
         :
         pool_linear_paged()
     {
-        m_numpg_allocator.second = {std::forward<AllocatorArgs>(args)...};
+        m_numpg_allocator.second() = Allocator(std::forward<AllocatorArgs>(args)...);
     }
 
     pool_linear_paged(I obj_size, I obj_align, I capacity)
@@ -224,8 +290,8 @@ public:
 
 public:
 
-    I size() const { return m_num_objs; }
-    I size_bytes() const { return m_num_objs * m_obj_size; }
+    I size() const { return m_num_objs - m_num_free; }
+    I size_bytes() const { return size() * m_obj_size; }
 
     I capacity() const { return m_numpg_allocator.first() * PageSize; }
     I capacity_bytes() const { return m_numpg_allocator.first() * PageSize * m_obj_size; }
@@ -233,6 +299,7 @@ public:
     Allocator const& allocator() const { return m_numpg_allocator.second(); }
 
     I num_pages() const { return m_numpg_allocator.first(); }
+    I num_free() const { return m_num_free; }
 
     static constexpr inline I page_size() { return PageSize; }
 
@@ -242,6 +309,7 @@ public:
     {
         I np = (cap + PageSize - 1) / PageSize;
         if(np <= m_numpg_allocator.first()) return;
+        C4_ASSERT_MSG(m_obj_size >= sizeof(I), "the objects must be large enough to hold the free list");
 
         auto a = m_numpg_allocator.second();
         auto pg_a = a.template rebound<Page>();
@@ -257,23 +325,25 @@ public:
         }
         m_pages = pgs;
 
-        // allocate page mem
+        // allocate page mem, with the slot states after the objects
         I more_pages = np - np_old;
-        auto* mem = a.allocate(more_pages * PageSize * m_obj_size, m_obj_align);//, last);
+        auto* mem = a.allocate(_block_size(more_pages), m_obj_align);//, last);
+        uint8_t *slots = (uint8_t*)mem + more_pages * PageSize * m_obj_size;
+        memset(slots, 0, more_pages * PageSize);
         // the first page owns the mem (by setting numpg to the number of pages in this mem block)
-        m_pages[np_old].mem = mem;
-        m_pages[np_old].numpg = more_pages;
         // remaining pages only have their pointers set (and numpg is set to 0)
-        for(I i = np_old+1; i < np; ++i)
+        for(I i = np_old; i < np; ++i)
         {
-            m_pages[i].mem = (void*)((char*)mem + i * PageSize);
+            m_pages[i].mem = (void*)((char*)mem + (i - np_old) * PageSize * m_obj_size);
+            m_pages[i].slots = slots + (i - np_old) * PageSize;
             m_pages[i].numpg = 0;
         }
+        m_pages[np_old].numpg = more_pages;
     }
 
     void free()
     {
-        C4_ASSERT(m_num_objs == 0);
+        C4_ASSERT(size() == 0);
         I np = m_numpg_allocator.first();
         auto &a = m_numpg_allocator.second();
         if(np == 0) return;
@@ -281,26 +351,37 @@ public:
         {
             Page *p = m_pages + i;
             if(p->numpg == 0) continue;
-            a.deallocate((char*)p->mem, p->numpg * PageSize * m_obj_size);
-            i += p->numpg;
-            C4_ASSERT(i <= np);
+            a.deallocate((char*)p->mem, _block_size(p->numpg));
+            i += p->numpg - 1;
+            C4_ASSERT(i < np);
         }
         a.template rebound<Page>().deallocate(m_pages, np);
         m_numpg_allocator.first() = 0;
         m_pages = nullptr;
+        m_num_objs = 0;
+        m_num_free = 0;
+        m_free_head = free_end;
     }
 
     template<class Destructor>
     void destroy(Destructor fn)
     {
         C4_ASSERT( ! !fn);
-        for(I id = 0; id < m_num_objs; ++id)
+        for(I slot = 0; slot < m_num_objs; ++slot)
         {
-            void *obj = get(id);
+            if(_is_free(slot))
+            {
+                _state(slot) &= uint8_t(~1u);
+                continue;
+            }
+            void *obj = _at(slot);
             C4_ASSERT(obj != nullptr);
             fn(obj);
+            _next_gen(slot);
         }
         m_num_objs = 0;
+        m_num_free = 0;
+        m_free_head = free_end;
     }
 
 public:
@@ -308,11 +389,20 @@ public:
     I claim(I n=1)
     {
         C4_ASSERT(n >= 1);
+        if(n == 1 && m_free_head != free_end)
+        {
+            I slot = m_free_head;
+            C4_ASSERT(_is_free(slot));
+            m_free_head = *(I*)_at(slot);
+            _state(slot) &= uint8_t(~1u);
+            --m_num_free;
+            return _id_of(slot);
+        }
         if(m_num_objs + n > capacity())
         {
             reserve(m_num_objs + n); // adds a single page
         }
-        I id = m_num_objs;
+        I id = _id_of(m_num_objs);
         m_num_objs += n;
         return id;
     }
@@ -320,19 +410,118 @@ public:
     void release(I id, I n=1)
     {
         C4_ASSERT(n >= 1);
-        // no-op unless id is the most recent (ie, we're still at the
-        // end), in which case the size is decreased
-        if(id+n == m_num_objs)
+        _check(id);
+        I slot = _slot(id);
+        C4_ASSERT(slot + n <= m_num_objs);
+        for(I i = slot; i < slot + n; ++i)
+        {
+            _next_gen(i);
+        }
+        // the most recent objects are released by decreasing the size;
+        // the others are placed in the free list
+        if(slot+n == m_num_objs)
         {
             m_num_objs -= n;
+            return;
         }
+        for(I i = slot + n; i > slot; --i)
+        {
+            *(I*)_at(i - 1) = m_free_head;
+            _state(i - 1) |= uint8_t(1);
+            m_free_head = i - 1;
+        }
+        m_num_free += n;
     }
 
     void* get(I id) const
     {
-        C4_ASSERT(id < m_num_objs);
-        void *mem = ((char*) m_pages[_page(id)].mem) + _pos(id) * m_obj_size;
-        return mem;
+        _check(id);
+        return _at(_slot(id));
+    }
+
+    /** call fn(T&) for each object, walking the memory of each page.
+     * T must be the type of the objects, or a base placed at their
+     * start. */
+    template<class T, class Fn>
+    void for_each(Fn &fn) const
+    {
+        for(I pg = 0, first = 0; first < m_num_objs; ++pg, first += PageSize)
+        {
+            char *mem = (char*)m_pages[pg].mem;
+            I n = m_num_objs - first < PageSize ? m_num_objs - first : I(PageSize);
+            if(m_num_free)
+            {
+                uint8_t const* slots = m_pages[pg].slots;
+                for(I i = 0; i < n; ++i)
+                {
+                    if(slots[i] & uint8_t(1)) continue;
+                    fn(*(T*)(mem + i * m_obj_size));
+                }
+            }
+            else if(sizeof(T) == m_obj_size)
+            {
+                T *objs = (T*)mem;
+                for(I i = 0; i < n; ++i)
+                {
+                    fn(objs[i]);
+                }
+            }
+            else
+            {
+                for(I i = 0; i < n; ++i)
+                {
+                    fn(*(T*)(mem + i * m_obj_size));
+                }
+            }
+        }
+    }
+
+public:
+
+    /** get the memory of a slot, free or not */
+    C4_ALWAYS_INLINE void* _at(I slot) const
+    {
+        C4_ASSERT(slot < m_num_objs);
+        return ((char*) m_pages[_page(slot)].mem) + _pos(slot) * m_obj_size;
+    }
+
+    C4_ALWAYS_INLINE bool _is_free(I slot) const
+    {
+        return (_state(slot) & uint8_t(1)) != 0;
+    }
+
+    C4_ALWAYS_INLINE I _id_of(I slot) const
+    {
+        return has_gen ? (slot | (I(_state(slot) >> 1) << gen_shift)) : slot;
+    }
+
+    C4_ALWAYS_INLINE void _next_gen(I slot)
+    {
+        if(has_gen)
+        {
+            _state(slot) = uint8_t(_state(slot) + 2u);
+        }
+    }
+
+    /** the state of a slot */
+    C4_ALWAYS_INLINE uint8_t& _state(I slot) const
+    {
+        return m_pages[_page(slot)].slots[_pos(slot)];
+    }
+
+    /** the size of a memory block with the given number of pages: the
+     * objects, followed by the slot states */
+    C4_ALWAYS_INLINE I _block_size(I numpg) const
+    {
+        return numpg * PageSize * (m_obj_size + I(1));
+    }
+
+    C4_ALWAYS_INLINE void _check(I id) const
+    {
+        C4_ASSERT(_slot(id) < m_num_objs);
+        C4_ASSERT_MSG( ! _is_free(_slot(id)), "the object was released");
+        C4_ASSERT_MSG(_id_of(_slot(id)) == id, "the object was released, and its slot was reused");
+        C4_UNUSED(id);
     }
 
 };
@@ -342,6 +531,274 @@ public:
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
+/** A paged pool whose objects can be claimed concurrently from several
+ * threads, eg to parse several templates into a shared ObjMgr.
+ *
+ * The ids are claimed with an atomic increment. The memory is held in
+ * segments which are never moved: segment k has PageSize<<k objects,
+ * so a fixed array of segment pointers is enough for any number of
+ * objects. A segment is allocated by the first claim needing it, and
+ * published with a compare-and-swap; a thread losing the race frees its
+ * allocation. get() is wait-free: it loads a single segment pointer.
+ *
+ * Released objects are only marked as such (so that destroy() and the
+ * iterators skip them); their memory is not reused until destroy().
+ * release() may be called concurrently for different objects, but not
+ * while iterating. destroy(), reserve() and free() must not be called
+ * concurrently with anything else. */
+template<size_t PageSize_, class I, class Allocator>
+struct pool_linear_paged_mt
+{
+    static_assert(PageSize_ > 0, "PageSize must be nonzero");
+    static_assert((PageSize_ & (PageSize_ - 1)) == 0, "PageSize must be a power of two");
+    static_assert(std::is_same<char, typename Allocator::value_type>::value, "Allocator must be a raw allocator");
+
+    using index_type = I;
+    using allocator_type = Allocator;
+
+public:
+
+    enum : I
+    {
+        PageSize = (I)PageSize_,
+        page_lsb = lsb11<I, PageSize>::value,
+        /** the max number of segments needed to address all the ids */
+        max_segments = I(8) * I(sizeof(I)) - page_lsb,
+    };
+
+    std::atomic<char*> m_segments[max_segments];  ///< the memory of each segment: the objects, followed by a state byte for each
+    std::atomic<I>     m_num_objs;      ///< the current number of claimed objects, including the released ones
+    std::atomic<I>     m_num_released;  ///< the current number of released objects
+    I         m_obj_size;   ///< the size of each object
+    I         m_obj_align;  ///< the alignment of each object
+    Allocator m_allocator;
+
+public:
+
+    /** get the segment of an id, and its position in the segment */
+    static C4_ALWAYS_INLINE I _segment(I id, I *pos)
+    {
+        I pg = (id >> page_lsb) + I(1);
+        I seg = msb(pg);
+        *pos = id - (((I(1) << seg) - I(1)) << page_lsb);
+        return seg;
+    }
+
+    static constexpr inline I _segment_size(I seg) { return PageSize << seg; }
+
+public:
+
+    C4_NO_COPY_OR_MOVE(pool_linear_paged_mt);
+
+    pool_linear_paged_mt()
+        :
+        m_num_objs{0},
+        m_num_released{0},
+        m_obj_size{0},
+        m_obj_align{0},
+        m_allocator{}
+    {
+        for(auto &s : m_segments)
+        {
+            s.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    pool_linear_paged_mt(I obj_size, I obj_align, I capacity)
+        :
+        pool_linear_paged_mt()
+    {
+        m_obj_size = obj_size;
+        m_obj_align = obj_align;
+        reserve(capacity);
+    }
+
+    template<class ...AllocatorArgs>
+    pool_linear_paged_mt(I obj_size, I obj_align, I capacity, varargs_t, AllocatorArgs && ...args)
+        :
+        pool_linear_paged_mt()
+    {
+        m_allocator = Allocator(std::forward<AllocatorArgs>(args)...);
+        m_obj_size = obj_size;
+        m_obj_align = obj_align;
+        reserve(capacity);
+    }
+
+    ~pool_linear_paged_mt()
+    {
+        free();
+    }
+
+public:
+
+    I size() const { return m_num_objs.load(std::memory_order_relaxed) - m_num_released.load(std::memory_order_relaxed); }
+    I size_bytes() const { return size() * m_obj_size; }
+
+    I capacity() const
+    {
+        I cap = 0;
+        for(I seg = 0; seg < max_segments; ++seg)
+        {
+            if(m_segments[seg].load(std::memory_order_relaxed) == nullptr) continue;
+            cap += _segment_size(seg);
+        }
+        return cap;
+    }
+
+    Allocator const& allocator() const { return m_allocator; }
+
+    static constexpr inline I page_size() { return PageSize; }
+
+public:
+
+    void reserve(I cap)
+    {
+        if(cap == 0) return;
+        I pos;
+        I last = _segment(cap - I(1), &pos);
+        for(I seg = 0; seg <= last; ++seg)
+        {
+            _ensure_segment(seg);
+        }
+    }
+
+    void free()
+    {
+        C4_ASSERT(size() == 0);
+        for(I seg = 0; seg < max_segments; ++seg)
+        {
+            char *mem = m_segments[seg].load(std::memory_order_relaxed);
+            if(mem == nullptr) continue;
+            m_allocator.deallocate(mem, _segment_bytes(seg), m_obj_align);
+            m_segments[seg].store(nullptr, std::memory_order_relaxed);
+        }
+        m_num_objs.store(0, std::memory_order_relaxed);
+        m_num_released.store(0, std::memory_order_relaxed);
+    }
+
+    template<class Destructor>
+    void destroy(Destructor fn)
+    {
+        I num = m_num_objs.load(std::memory_order_acquire);
+        for(I id = 0; id < num; ++id)
+        {
+            uint8_t *state = _state(id);
+            if(*state == 0)
+            {
+                fn(_at(id));
+            }
+            *state = 0;
+        }
+        m_num_objs.store(0, std::memory_order_relaxed);
+        m_num_released.store(0, std::memory_order_relaxed);
+    }
+
+public:
+
+    /** claim n consecutive ids. This can be called concurrently. */
+    I claim(I n=1)
+    {
+        C4_ASSERT(n >= 1);
+        I id = m_num_objs.fetch_add(n, std::memory_order_relaxed);
+        I pos;
+        I first = _segment(id, &pos);
+        I last = _segment(id + n - I(1), &pos);
+        for(I seg = first; seg <= last; ++seg)
+        {
+            _ensure_segment(seg);
+        }
+        return id;
+    }
+
+    void release(I id, I n=1)
+    {
+        C4_ASSERT(n >= 1);
+        for(I i = id; i < id + n; ++i)
+        {
+            C4_ASSERT_MSG(*_state(i) == 0, "the object was already released");
+            *_state(i) = 1;
+        }
+        m_num_released.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    C4_ALWAYS_INLINE void* get(I id) const
+    {
+        C4_ASSERT(id < m_num_objs.load(std::memory_order_relaxed));
+        C4_ASSERT_MSG(*_state(id) == 0, "the object was released");
+        return _at(id);
+    }
+
+    /** call fn(T&) for each object, walking the memory of each
+     * segment. T must be the type of the objects, or a base placed at
+     * their start. This must not be called concurrently with claims. */
+    template<class T, class Fn>
+    void for_each(Fn &fn) const
+    {
+        I num = m_num_objs.load(std::memory_order_acquire);
+        bool has_released = m_num_released.load(std::memory_order_relaxed) != 0;
+        for(I seg = 0, first = 0; first < num; first += _segment_size(seg), ++seg)
+        {
+            char *mem = m_segments[seg].load(std::memory_order_acquire);
+            I n = num - first < _segment_size(seg) ? num - first : _segment_size(seg);
+            uint8_t const* states = (uint8_t const*)(mem + _segment_size(seg) * m_obj_size);
+            for(I i = 0; i < n; ++i)
+            {
+                if(has_released && states[i]) continue;
+                fn(*(T*)(mem + i * m_obj_size));
+            }
+        }
+    }
+
+public:
+
+    C4_ALWAYS_INLINE void* _at(I id) const
+    {
+        I pos;
+        I seg = _segment(id, &pos);
+        char *mem = m_segments[seg].load(std::memory_order_acquire);
+        C4_ASSERT(mem != nullptr);
+        return mem + pos * m_obj_size;
+    }
+
+    C4_ALWAYS_INLINE bool _is_free(I id) const
+    {
+        return *_state(id) != 0;
+    }
+
+    C4_ALWAYS_INLINE uint8_t* _state(I id) const
+    {
+        I pos;
+        I seg = _segment(id, &pos);
+        char *mem = m_segments[seg].load(std::memory_order_acquire);
+        C4_ASSERT(mem != nullptr);
+        return (uint8_t*)(mem + _segment_size(seg) * m_obj_size + pos);
+    }
+
+    I _segment_bytes(I seg) const
+    {
+        return _segment_size(seg) * (m_obj_size + I(1));
+    }
+
+    void _ensure_segment(I seg)
+    {
+        C4_ASSERT(seg < max_segments);
+        if(m_segments[seg].load(std::memory_order_acquire) != nullptr) return;
+        I num_bytes = _segment_bytes(seg);
+        char *mem = (char*)m_allocator.allocate(num_bytes, m_obj_align);
+        memset(mem + _segment_size(seg) * m_obj_size, 0, _segment_size(seg));
+        char *expected = nullptr;
+        if( ! m_segments[seg].compare_exchange_strong(expected, mem, std::memory_order_acq_rel, std::memory_order_acquire))
+        {
+            // another thread allocated it first
+            m_allocator.deallocate(mem, num_bytes, m_obj_align);
+        }
+    }
+};
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
 C4_BEGIN_NAMESPACE(detail)
 template<class Pool, class CollectionImpl, class I>
 struct _pool_collection_crtp
@@ -362,7 +819,7 @@ struct _pool_collection_crtp
         C4_ASSERT(n >= 1);
         I pool = decode_pool(id);
         I pos = decode_pos(id);
-        Pool *p = _c4cthis->get_pool(pool);
+        Pool *p = _c4this->get_pool(pool);
         p->release(pos, n);
     }
 
@@ -431,7 +888,7 @@ public:
 
     enum : I {
         s_num_pools_max = I(NumPoolsMax),
-        s_pool_bits  = msb11<I, NumPoolsMax-1>::value, ///< it's the MSB of the max pool id (which is NumPoolsMax-1)
+        s_pool_bits  = msb11<I, NumPoolsMax-1>::value + 1, ///< the bits needed for the max pool id (which is NumPoolsMax-1)
         s_pool_shift = I(8) * I(sizeof(I)) - s_pool_bits, ///< reserve the highest bits
         s_pos_mask   = ((I(1) << s_pool_shift) - 1)
     };
@@ -445,6 +902,10 @@ public:
     pool_collection() : m_num_pools(0)
     {
     }
+    /** the pools are held inline: the allocator is not needed */
+    explicit pool_collection(typename Pool::allocator_type const&) : pool_collection()
+    {
+    }
     ~pool_collection()
     {
         free();
@@ -506,29 +967,175 @@ public:
     const_iterator end  () const { return reinterpret_cast<Pool const*>(m_pools) + m_num_pools; }
 
     Pool& front() { C4_ASSERT(m_num_pools > 0); return *(reinterpret_cast<Pool *>(m_pools)); }
-    Pool& back () { C4_ASSERT(m_num_pools > 0); return *(reinterpret_cast<Pool *>(m_pools) + m_num_pools); }
+    Pool& back () { C4_ASSERT(m_num_pools > 0); return *(reinterpret_cast<Pool *>(m_pools) + m_num_pools - 1); }
 
     Pool const& front() const { C4_ASSERT(m_num_pools > 0); return *(reinterpret_cast<Pool const*>(m_pools)); }
-    Pool const& back () const { C4_ASSERT(m_num_pools > 0); return *(reinterpret_cast<Pool const*>(m_pools) + m_num_pools); }
+    Pool const& back () const { C4_ASSERT(m_num_pools > 0); return *(reinterpret_cast<Pool const*>(m_pools) + m_num_pools - 1); }
 };
 
 
 //-----------------------------------------------------------------------------
 
 /** pool collection with a runtime-determined number of pools, allocated from
- * the heap */
+ * the heap. The ids are encoded as in the fixed-size collection, with the
+ * number of bits for the pool computed from the current capacity. Growing
+ * the capacity may change the encoding, so it can only be done while the
+ * pools are empty, ie, the pools must be added before creating any
+ * objects. */
 template<class Pool>
 struct pool_collection<Pool, 0>
     :
     public detail::_pool_collection_crtp<Pool, pool_collection<Pool, 0>, typename Pool::index_type>
 {
+public:
+
     using I = typename Pool::index_type;
+    using allocator_type = typename Pool::allocator_type;
 
-    Pool *m_pools{nullptr};
-    I m_num_pools;
-    I m_capacity;
+public:
+
+    Pool *m_pools;
+    I     m_num_pools;
+    I     m_capacity;
+    I     m_pool_shift;  ///< the ids hold the pool in the bits from this one up
+    I     m_pos_mask;
+    allocator_type m_allocator;
+
+public:
+
+    static constexpr C4_ALWAYS_INLINE I _num_bits() noexcept { return I(8) * I(sizeof(I)); }
+
+    C4_ALWAYS_INLINE I _pool_shift() const noexcept { return m_pool_shift; }
+    C4_ALWAYS_INLINE I _pos_mask() const noexcept { return m_pos_mask; }
+    C4_ALWAYS_INLINE I _num_pools_max() const noexcept { return m_capacity; }
+
+public:
+
+    C4_NO_COPY_OR_MOVE(pool_collection);
+
+    pool_collection()
+        :
+        m_pools(nullptr),
+        m_num_pools(0),
+        m_capacity(0),
+        m_pool_shift(_num_bits()),
+        m_pos_mask(~I(0)),
+        m_allocator()
+    {
+    }
+
+    explicit pool_collection(I capacity) : pool_collection()
+    {
+        reserve(capacity);
+    }
+
+    explicit pool_collection(allocator_type const& a) : pool_collection()
+    {
+        m_allocator = a;
+    }
+
+    ~pool_collection()
+    {
+        free();
+    }
+
+public:
+
+    I capacity() const { return m_capacity; }
+    I num_pools() const { return m_num_pools; }
+    bool empty() const { return m_num_pools == 0; }
+
+    Pool      * pools()       { return m_pools; }
+    Pool const* pools() const { return m_pools; }
+
+    C4_ALWAYS_INLINE Pool* get_pool(I pool)
+    {
+        C4_ASSERT(pool <= m_num_pools);
+        return m_pools + pool;
+    }
+
+    C4_ALWAYS_INLINE Pool const* get_pool(I pool) const
+    {
+        C4_ASSERT(pool <= m_num_pools);
+        return m_pools + pool;
+    }
+
+public:
+
+    void reserve(I cap)
+    {
+        if(cap <= m_capacity) return;
+        I pool_bits = msb(I(cap - 1)) + I(1);
+        I pool_shift = _num_bits() - pool_bits;
+        if(pool_shift != m_pool_shift)
+        {
+            for(I i = 0; i < m_num_pools; ++i)
+            {
+                C4_CHECK_MSG(m_pools[i].size() == 0, "cannot change the encoding of the ids: there are objects in the pools");
+            }
+        }
+        auto a = m_allocator.template rebound<Pool>();
+        Pool *pools = a.allocate(cap);
+        if(m_pools)
+        {
+            // the pools point only at memory outside of themselves,
+            // so they are relocated by copying their bytes
+            memcpy((void*)pools, (void*)m_pools, m_num_pools * sizeof(Pool));
+            a.deallocate(m_pools, m_capacity);
+        }
+        m_pools = pools;
+        m_capacity = cap;
+        m_pool_shift = pool_shift;
+        m_pos_mask = (I(1) << pool_shift) - I(1);
+    }
+
+    template<class... PoolArgs>
+    I add_pool(PoolArgs && ...args)
+    {
+        if(m_num_pools == m_capacity)
+        {
+            reserve(m_capacity ? I(2) * m_capacity : I(8));
+        }
+        I pool_id = m_num_pools;
+        ++m_num_pools;
+        Pool *p = get_pool(pool_id);
+        new ((void*)p) Pool(std::forward<PoolArgs>(args)...);
+        return pool_id;
+    }
+
+    void free()
+    {
+        for(I i = 0; i < m_num_pools; ++i)
+        {
+            m_pools[i].~Pool();
+        }
+        if(m_pools)
+        {
+            m_allocator.template rebound<Pool>().deallocate(m_pools, m_capacity);
+        }
+        m_pools = nullptr;
+        m_num_pools = 0;
+        m_capacity = 0;
+        m_pool_shift = _num_bits();
+        m_pos_mask = ~I(0);
+    }
+
+public:
+
+    using iterator = Pool*;
+    using const_iterator = Pool const*;
+
+    iterator begin() { return m_pools; }
+    iterator end  () { return m_pools + m_num_pools; }
+
+    const_iterator begin() const { return m_pools; }
+    const_iterator end  () const { return m_pools + m_num_pools; }
+
+    Pool& front() { C4_ASSERT(m_num_pools > 0); return m_pools[0]; }
+    Pool& back () { C4_ASSERT(m_num_pools > 0); return m_pools[m_num_pools - 1]; }
 
-    // TODO, WIP
+    Pool const& front() const { C4_ASSERT(m_num_pools > 0); return m_pools[0]; }
+    Pool const& back () const { C4_ASSERT(m_num_pools > 0); return m_pools[m_num_pools - 1]; }
 };
 
 
@@ -554,12 +1161,26 @@ struct pool_iterator_impl
         _next_if_invalid();
     }
 
+    /** move to the next slot holding an object, skipping the free
+     * slots and the empty pools */
     void _next_if_invalid()
     {
-        while(pos == pool->m_num_objs && pool != last_valid)
+        while(true)
         {
-            pos = 0;
-            ++pool;
+            if(pos == pool->m_num_objs)
+            {
+                if(pool == last_valid) return;
+                pos = 0;
+                ++pool;
+            }
+            else if(pool->_is_free(pos))
+            {
+                ++pos;
+            }
+            else
+            {
+                return;
+            }
         }
     }
     void _inc()
@@ -571,8 +1192,8 @@ struct pool_iterator_impl
 
     pool_iterator_impl operator++ () { _inc(); return *this; }
 
-    value_type* operator-> () { return  (Obj*)pool->get(pos); }
-    value_type& operator*  () { return *(Obj*)pool->get(pos); }
+    value_type* operator-> () { return  (Obj*)pool->_at(pos); }
+    value_type& operator*  () { return *(Obj*)pool->_at(pos); }
 
     bool operator!= (pool_iterator_impl that) const { return pool != that.pool || pos != that.pos; }
     bool operator== (pool_iterator_impl that) const { return !this->operator!=(that); }
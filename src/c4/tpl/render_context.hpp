@@ -0,0 +1,121 @@
+#ifndef _C4_TPL_RENDER_CONTEXT_HPP_
+#define _C4_TPL_RENDER_CONTEXT_HPP_
+
+#include <vector>
+#include <c4/allocator.hpp>
+#include "c4/tpl/arena.hpp"
+#include "c4/tpl/escape.hpp"
+#include "c4/tpl/rope.hpp"
+#include "c4/tpl/value.hpp"
+
+namespace c4 {
+namespace tpl {
+
+/** the state of a {% for %} loop, visible in its body as loop.* */
+struct LoopInfo
+{
+    typedef enum {
+        INDEX,     //!< The current iteration of the loop. (0 indexed)
+        LENGTH,    //!< The number of items in the sequence.
+        REVINDEX,  //!< The number of iterations from the end of the loop (0 indexed)
+        FIRST,     //!< 1 if first iteration, 0 otherwise.
+        LAST,      //!< 1 if last iteration, 0 otherwise.
+        ODD,       //!< 1 if the index is odd, 0 otherwise.
+        EVEN,      //!< 1 if the index is even, 0 otherwise.
+    } Field_e;
+
+    size_t m_index;
+    size_t m_length;
+
+    static bool field_from_name(csubstr name, Field_e *f)
+    {
+        if     (name == "index")    *f = INDEX;
+        else if(name == "length")   *f = LENGTH;
+        else if(name == "revindex") *f = REVINDEX;
+        else if(name == "first")    *f = FIRST;
+        else if(name == "last")     *f = LAST;
+        else if(name == "odd")      *f = ODD;
+        else if(name == "even")     *f = EVEN;
+        else return false;
+        return true;
+    }
+
+    Value get(Field_e f) const
+    {
+        switch(f)
+        {
+        case INDEX:    return Value::integer(static_cast<int64_t>(m_index));
+        case LENGTH:   return Value::integer(static_cast<int64_t>(m_length));
+        case REVINDEX: return Value::integer(static_cast<int64_t>(m_length - m_index - 1));
+        case FIRST:    return Value::integer(m_index == 0);
+        case LAST:     return Value::integer(m_index + 1 == m_length);
+        case ODD:      return Value::integer((m_index & 1) != 0);
+        case EVEN:     return Value::integer((m_index & 1) == 0);
+        }
+        C4_ERROR("never reach");
+        return {};
+    }
+};
+
+/** a name bound while rendering, eg the variable of a {% for %} loop */
+struct Binding
+{
+    csubstr m_name;
+    Value   m_value;
+};
+
+/** the state of a render, threaded through the render calls of the tokens */
+struct RenderContext
+{
+    typedef enum : uint8_t {
+        FLOW_NORMAL,
+        FLOW_BREAK,     //!< a {% break %} was rendered: skip the rest of the loop
+        FLOW_CONTINUE,  //!< a {% continue %} was rendered: skip the rest of the iteration
+    } Flow_e;
+
+    Arena    m_arena;   ///< storage for the strings produced while rendering
+    Escape_e m_escape;  ///< how to escape the values of expressions
+    Flow_e   m_flow;    ///< set by {% break %}/{% continue %}, until the innermost loop consumes it
+    std::vector<LoopInfo> m_loops;  ///< the loops being rendered, innermost last
+    std::vector<Binding>  m_vars;   ///< the names bound while rendering, innermost last. They shadow the data tree.
+    std::vector<size_t>   m_selection;  ///< the elements selected by the filters of the loops being rendered, innermost last
+    std::vector<Rope>     m_ropes;  ///< the scratch ropes of the included templates, by their index in the registry. They are kept between renders.
+
+    RenderContext() : m_arena(), m_escape(ESCAPE_NONE), m_flow(FLOW_NORMAL), m_loops(), m_vars(), m_selection(), m_ropes() {}
+    explicit RenderContext(allocator_mr<char> const& a) : m_arena(a), m_escape(ESCAPE_NONE), m_flow(FLOW_NORMAL), m_loops(), m_vars(), m_selection(), m_ropes() {}
+
+    /** prepare for a new render. This invalidates the strings produced
+     * in the previous render. */
+    void start(Escape_e escape)
+    {
+        m_arena.reset();
+        m_escape = escape;
+        m_flow = FLOW_NORMAL;
+        m_loops.clear();
+        m_vars.clear();
+        m_selection.clear();
+    }
+
+    void bind(csubstr name, Value const& v)
+    {
+        m_vars.push_back({name, v});
+    }
+
+    /** get the innermost value bound to a name, or null if the name is not bound */
+    Value const* lookup(csubstr name) const
+    {
+        for(size_t i = m_vars.size(); i > 0; --i)
+        {
+            if(m_vars[i-1].m_name == name)
+            {
+                return &m_vars[i-1].m_value;
+            }
+        }
+        return nullptr;
+    }
+};
+
+} // namespace tpl
+} // namespace c4
+
+#endif /* _C4_TPL_RENDER_CONTEXT_HPP_ */
@@ -77,7 +77,7 @@ public:
 
     ~Rope() { _free(); }
 
-    Rope(Rope const& that) : Rope() { _copy(that); }
+    Rope(Rope const& that) : Rope(that.m_alloc) { _copy(that); }
     Rope(Rope     && that) : Rope() { _move(&that); }
 
     Rope& operator= (Rope const& that) { _free(); _copy(that); return *this; }
@@ -106,6 +106,7 @@ private:
     {
         m_buf = that->m_buf;
         that->m_buf = nullptr;
+        m_alloc = that->m_alloc; // the buffer goes with its allocator
         _copy_members(*that);
     }
 
@@ -118,7 +119,6 @@ private:
         m_free_head = that.m_free_head;
         m_free_tail = that.m_free_tail;
         m_str_size  = that.m_str_size;
-        m_alloc     = that.m_alloc;
     }
 
 public:
@@ -143,28 +143,35 @@ public:
     void reserve(size_t cap)
     {
         if(cap <= m_cap) return;
-        if(m_free_head == NONE)
-        {
-            C4_ASSERT(m_free_tail == m_free_head);
-            m_free_head = m_cap;
-            m_free_tail = cap;
-        }
-        else
-        {
-            C4_ASSERT(m_buf != nullptr);
-            C4_ASSERT(m_free_tail != NONE);
-            m_buf[m_free_tail].m_next = m_cap;
-        }
         rope_entry *buf = (rope_entry*) m_alloc.allocate(cap * sizeof(rope_entry));//, /*hint*/m_buf);
         if(m_buf)
         {
             memcpy(buf, m_buf, m_cap * sizeof(rope_entry));
             m_alloc.deallocate((char*)m_buf, m_cap * sizeof(rope_entry));
         }
-        size_t first = m_cap, del = cap - m_cap;
-        m_cap = cap;
         m_buf = buf;
-        _clear_range(first, del);
+        _append_free(cap);
+    }
+
+    /** make this rope a copy of that one. Unlike the copy assignment,
+     * the buffer is reused when it is large enough, so that copying
+     * the same rope repeatedly allocates only once. */
+    void assign(Rope const& that)
+    {
+        if(m_cap < that.m_cap)
+        {
+            _free();
+            m_alloc = that.m_alloc;
+            _copy(that);
+            return;
+        }
+        size_t cap = m_cap;
+        if(that.m_cap)
+        {
+            memcpy(m_buf, that.m_buf, that.m_cap * sizeof(rope_entry));
+        }
+        _copy_members(that);
+        _append_free(cap);
     }
 
     void clear()
@@ -173,12 +180,33 @@ public:
         m_size = 0;
         m_head = NONE;
         m_tail = NONE;
-        m_free_head = 0;
-        m_free_tail = m_cap;
+        m_free_head = m_cap ? 0 : NONE;
+        m_free_tail = m_cap ? m_cap - 1 : NONE;
     }
 
 private:
 
+    /** add the entries from m_cap up to cap to the end of the free
+     * list. The buffer must already hold them. */
+    void _append_free(size_t cap)
+    {
+        if(cap <= m_cap) return;
+        if(m_free_head == NONE)
+        {
+            C4_ASSERT(m_free_tail == m_free_head);
+            m_free_head = m_cap;
+        }
+        else
+        {
+            C4_ASSERT(m_free_tail != NONE);
+            m_buf[m_free_tail].m_next = m_cap;
+        }
+        size_t first = m_cap, del = cap - m_cap;
+        m_cap = cap;
+        m_free_tail = cap - 1;
+        _clear_range(first, del);
+    }
+
     void _clear(size_t i)
     {
         _p(i).s.clear();
@@ -0,0 +1,162 @@
+#include "c4/tpl/syntax.hpp"
+#include "c4/tpl/whitespace.hpp"
+#include <c4/std/string.hpp>
+
+namespace c4 {
+namespace tpl {
+
+namespace {
+
+enum { BLOCK, EXPR, COMMENT, NUM_KINDS };
+
+csubstr const s_default_open[NUM_KINDS] = {"{%", "{{", "{#"};
+csubstr const s_default_close[NUM_KINDS] = {"%}", "}}", "#}"};
+
+C4_ALWAYS_INLINE void _append(std::string *out, csubstr s)
+{
+    out->append(s.str, s.len);
+}
+
+/** append a default opener. A literal { right before it would form
+ * another opener with it (eg {{{ is taken as {{ followed by {), so it
+ * is protected first */
+void _append_opener(std::string *out, csubstr opener)
+{
+    if( ! out->empty() && out->back() == '{')
+    {
+        out->pop_back();
+        out->append("{% raw %}{{% endraw %}");
+    }
+    _append(out, opener);
+}
+
+} // anon namespace
+
+bool Syntax::is_default() const
+{
+    return m_block_open == s_default_open[BLOCK] && m_block_close == s_default_close[BLOCK]
+        && m_expr_open == s_default_open[EXPR] && m_expr_close == s_default_close[EXPR]
+        && m_comment_open == s_default_open[COMMENT] && m_comment_close == s_default_close[COMMENT];
+}
+
+void apply_syntax(Syntax const& syntax, csubstr src, std::string *out)
+{
+    csubstr const open[NUM_KINDS] = {syntax.m_block_open, syntax.m_expr_open, syntax.m_comment_open};
+    csubstr const close[NUM_KINDS] = {syntax.m_block_close, syntax.m_expr_close, syntax.m_comment_close};
+    // the default openers which are not openers in this syntax are
+    // literal text, and must be protected
+    bool is_literal[NUM_KINDS];
+    for(int k = 0; k < NUM_KINDS; ++k)
+    {
+        is_literal[k] = s_default_open[k] != open[BLOCK] && s_default_open[k] != open[EXPR] && s_default_open[k] != open[COMMENT];
+    }
+
+    // the next position of each opener, and of each literal default
+    // opener. They are searched again only after the cursor went past
+    // them, so the whole conversion is a single pass.
+    size_t next_open[NUM_KINDS], next_literal[NUM_KINDS];
+    for(int k = 0; k < NUM_KINDS; ++k)
+    {
+        next_open[k] = src.find(open[k]);
+        next_literal[k] = is_literal[k] ? src.find(s_default_open[k]) : npos;
+    }
+
+    out->clear();
+    out->reserve(src.len + src.len / 8);
+    size_t i = 0;
+    while(i < src.len)
+    {
+        // find the next tag, or the next text which would be taken for one
+        size_t best = npos;
+        int kind = -1;
+        bool literal = false;
+        for(int k = 0; k < NUM_KINDS; ++k)
+        {
+            if(next_open[k] != npos && next_open[k] < i)
+            {
+                next_open[k] = src.find(open[k], i);
+            }
+            size_t pos = next_open[k];
+            if(pos < best || (pos == best && pos != npos && open[k].len > open[kind].len))
+            {
+                best = pos;
+                kind = k;
+                literal = false;
+            }
+            if( ! is_literal[k]) continue;
+            if(next_literal[k] != npos && next_literal[k] < i)
+            {
+                next_literal[k] = src.find(s_default_open[k], i);
+            }
+            pos = next_literal[k];
+            if(pos < best)
+            {
+                best = pos;
+                kind = k;
+                literal = true;
+            }
+        }
+        if(best == npos)
+        {
+            _append(out, src.sub(i));
+            break;
+        }
+        _append(out, src.range(i, best));
+        if(literal)
+        {
+            _append_opener(out, "{% raw %}");
+            _append(out, s_default_open[kind]);
+            out->append("{% endraw %}");
+            i = best + s_default_open[kind].len;
+            continue;
+        }
+        size_t start = best + open[kind].len;
+        size_t end = src.find(close[kind], start);
+        C4_CHECK_MSG(end != npos, "unterminated tag");
+        csubstr interior = src.range(start, end);
+        _append_opener(out, s_default_open[kind]);
+        _append(out, interior);
+        _append(out, s_default_close[kind]);
+        i = end + close[kind].len;
+        // copy the contents of raw blocks as they are
+        if(kind == BLOCK && interior.trim(" -") == "raw")
+        {
+            size_t pos = i;
+            while(true)
+            {
+                pos = src.find(open[BLOCK], pos);
+                C4_CHECK_MSG(pos != npos, "{% raw %}: missing {% endraw %}");
+                size_t tag_end = src.find(close[BLOCK], pos + open[BLOCK].len);
+                C4_CHECK_MSG(tag_end != npos, "unterminated tag");
+                if(src.range(pos + open[BLOCK].len, tag_end).trim(" -") == "endraw") break;
+                pos += open[BLOCK].len;
+            }
+            _append(out, src.range(i, pos));
+            i = pos;
+        }
+    }
+}
+
+csubstr preprocess(Syntax const& syntax, csubstr src, std::string *buf)
+{
+    std::string tmp;
+    if( ! syntax.is_default())
+    {
+        apply_syntax(syntax, src, &tmp);
+        src = to_csubstr(tmp);
+    }
+    if(has_whitespace_control(src))
+    {
+        apply_whitespace_control(src, buf);
+        return to_csubstr(*buf);
+    }
+    if( ! tmp.empty())
+    {
+        buf->swap(tmp);
+        return to_csubstr(*buf);
+    }
+    return src;
+}
+
+} // namespace tpl
+} // namespace c4
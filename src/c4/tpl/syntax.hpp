@@ -0,0 +1,51 @@
+#ifndef _C4_TPL_SYNTAX_HPP_
+#define _C4_TPL_SYNTAX_HPP_
+
+#include <string>
+#include "c4/tpl/common.hpp"
+
+namespace c4 {
+namespace tpl {
+
+/** the delimiters of the tags of a template. The tokens are defined
+ * with the default (Jinja) delimiters: a source written with other
+ * delimiters is translated once, when it is parsed. The strings must
+ * outlive the engines using them. */
+struct Syntax
+{
+    csubstr m_block_open;    ///< eg {%
+    csubstr m_block_close;   ///< eg %}
+    csubstr m_expr_open;     ///< eg {{
+    csubstr m_expr_close;    ///< eg }}
+    csubstr m_comment_open;  ///< eg {#
+    csubstr m_comment_close; ///< eg #}
+
+    Syntax() : Syntax("{%", "%}", "{{", "}}", "{#", "#}") {}
+    Syntax(csubstr block_open, csubstr block_close, csubstr expr_open, csubstr expr_close, csubstr comment_open, csubstr comment_close)
+        : m_block_open(block_open), m_block_close(block_close),
+          m_expr_open(expr_open), m_expr_close(expr_close),
+          m_comment_open(comment_open), m_comment_close(comment_close)
+    {
+        C4_CHECK_MSG( ! block_open.empty() && ! block_close.empty() && ! expr_open.empty() && ! expr_close.empty() && ! comment_open.empty() && ! comment_close.empty(),
+                     "the delimiters cannot be empty");
+    }
+
+    bool is_default() const;
+};
+
+/** translate a source written with the given syntax to the default
+ * syntax. The text outside the tags which would be taken as a tag in
+ * the default syntax (eg, {{ when the expressions are delimited by
+ * << >>) is placed in a {% raw %} block. The contents of raw blocks
+ * are not changed. */
+void apply_syntax(Syntax const& syntax, csubstr src, std::string *out);
+
+/** get the source ready for parsing: translate its syntax, and resolve
+ * its whitespace control markers. When neither is needed, the source
+ * is returned as is; otherwise, the result is placed in buf. */
+csubstr preprocess(Syntax const& syntax, csubstr src, std::string *buf);
+
+} // namespace tpl
+} // namespace c4
+
+#endif /* _C4_TPL_SYNTAX_HPP_ */
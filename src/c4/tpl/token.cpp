@@ -1,4 +1,5 @@
 #include "c4/tpl/token.hpp"
+#include "c4/tpl/engine.hpp"
 
 namespace c4 {
 namespace tpl {
@@ -7,7 +8,14 @@ C4_DEFINE_MANAGED_BASE(TokenBase, size_t);
 C4_DEFINE_MANAGED(TokenExpression, size_t);
 C4_DEFINE_MANAGED(TokenIf, size_t);
 C4_DEFINE_MANAGED(TokenFor, size_t);
+C4_DEFINE_MANAGED(TokenBreak, size_t);
+C4_DEFINE_MANAGED(TokenContinue, size_t);
 C4_DEFINE_MANAGED(TokenComment, size_t);
+C4_DEFINE_MANAGED(TokenAutoescape, size_t);
+C4_DEFINE_MANAGED(TokenInclude, size_t);
+C4_DEFINE_MANAGED(TokenMacro, size_t);
+C4_DEFINE_MANAGED(TokenSet, size_t);
+C4_DEFINE_MANAGED(TokenRaw, size_t);
 
 
 //-----------------------------------------------------------------------------
@@ -17,41 +25,45 @@ void TokenBase::parse(csubstr *rem, TplLocation *curr_pos)
 {
     auto const s = stoken(), e = etoken();
     C4_ASSERT(rem->begins_with(s));
-
-    m_start = *curr_pos;
+    C4_ASSERT(m_tokens != nullptr && m_tokens->m_src.contains(*rem));
+    C4_ASSERT(curr_pos->m_rope == m_tokens->m_rope);
     // look for the end token, but skip nested start/end token pairs
     csubstr rem2 = skip_nested(*rem);
-    m_full_text = rem->left_of(rem2);
-    C4_ASSERT(m_full_text.len >= e.len + s.len);
-    C4_ASSERT(m_full_text.begins_with(s));
-    C4_ASSERT(m_full_text.ends_with(e));
-    m_interior_text = m_full_text.sub(s.len, m_full_text.len - (e.len + s.len));
+    csubstr full = rem->left_of(rem2);
+    C4_ASSERT(full.len >= e.len + s.len);
+    C4_ASSERT(full.begins_with(s));
+    C4_ASSERT(full.ends_with(e));
+    csubstr interior = full.sub(s.len, full.len - (e.len + s.len));
 
     // if the end token terminates with a line ending, "merge" it with any
     // line ending of the interior text
-    *rem = rem->sub(m_full_text.len);
-    if(m_interior_text.ends_with_any("\r\n") && rem->begins_with_any("\r\n"))
+    *rem = rem->sub(full.len);
+    size_t inc = 0;
+    if(interior.ends_with_any("\r\n") && rem->begins_with_any("\r\n"))
     {
-        size_t inc = 0;
         if((*rem)[0] == '\r' && (*rem)[1] == '\n') inc = 2;
         else if((*rem)[0] == '\n') inc = 1;
-        m_full_text.len += inc;
+        full.len += inc;
         *rem = rem->sub(inc);
     }
 
     auto &rp = curr_pos->m_rope_pos;
-    C4_ASSERT(curr_pos->m_rope->get(rp.entry)->s.len >= m_full_text.len);
-    rp.entry = curr_pos->m_rope->replace(rp.entry, rp.i, m_full_text.len, m_full_text);
-    m_rope_entry = rp.entry;
+    C4_ASSERT(curr_pos->m_rope->get(rp.entry)->s.len >= full.len);
+    rp.entry = curr_pos->m_rope->replace(rp.entry, rp.i, full.len, full);
+    C4_CHECK_MSG(rp.entry < UINT32_MAX, "too many rope entries");
+    m_rope_entry = (uint32_t)rp.entry;
+    m_offs = (uint32_t)(full.begin() - m_tokens->m_src.begin());
+    m_len = (uint32_t)full.len;
+    m_trail = (uint8_t)inc;
     rp.entry = curr_pos->m_rope->next(rp.entry);
     rp.i = 0;
-    m_end = *curr_pos;
-    C4_ASSERT(this->sub() == m_full_text);
+    C4_ASSERT(this->sub() == full && this->full_text() == full);
+    C4_ASSERT(this->interior_text() == interior);
 }
 
 void TokenBase::mark()
 {
-    m_start.m_rope->replace(m_start.m_rope_pos.entry, marker());
+    rope()->replace(m_rope_entry, marker());
 }
 
 TokenBase::PropResult TokenBase::get_property(NodeRef const& root, csubstr key, bool inside_brackets)
@@ -139,30 +151,6 @@ TokenBase::PropResult TokenBase::get_property(NodeRef const& root, csubstr key,
     return pr;
 }
 
-bool TokenBase::eval(NodeRef const& root, csubstr key, csubstr *value) const
-{
-    C4_ASSERT(root.valid());
-    PropResult pr = get_property(root, key);
-
-    if(pr)
-    {
-        if(pr.n.valid())
-        {
-            if(pr.n.is_map()) *value = "<<<map>>>";
-            else if(pr.n.is_seq()) *value = "<<<seq>>>";
-            else *value = pr.n.val();
-            return true;
-        }
-        else
-        {
-            *value = pr.val;
-            return true;
-        }
-    }
-
-    return false;
-}
-
 csubstr TokenBase::skip_nested(csubstr rem) const
 {
     auto const& s = stoken(), e = etoken();
@@ -171,9 +159,14 @@ csubstr TokenBase::skip_nested(csubstr rem) const
     size_t level = 1;
     while( ! r.empty())
     {
-        auto result = r.first_of_any(s, e);
+        auto result = r.first_of_any(s, e, TokenRaw::s_stoken());
         C4_CHECK_MSG(result, "invalid nested sequence");
-        C4_CHECK_MSG(result.which == 0 || result.which == 1, "internal error");
+        C4_CHECK_MSG(result.which <= 2, "internal error");
+        if(result.which == 2) // the contents of raw blocks are not looked at
+        {
+            r = TokenRaw::skip(r.sub(result.pos));
+            continue;
+        }
         if(result.which == 0)
         {
             ++level;
@@ -198,76 +191,99 @@ csubstr TokenBase::skip_nested(csubstr rem) const
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
-void TemplateBlock::parse(TokenContainer *cont)
-{
-    // this object may be relocated while this function is executed.
-    size_t tkid = owner_id, bid = block_id;
-#define _c4this cont->get(tkid)->get_block(bid)
-
-    _c4this->parts.clear();
-    _c4this->tokens = cont;
-    C4_ASSERT(_c4this->start.m_rope != nullptr);
-    csubstr curr = _c4this->body;
-    csubstr rem = _c4this->body;
-    TplLocation pos = _c4this->start;
-    Rope *rope = pos.m_rope;
-    auto &rp = pos.m_rope_pos;
-    rope->replace(rp.entry, _c4this->body);
-    rp.i = 0;
-    while( ! rem.empty())
+void TokenExpression::parse(csubstr *rem, TplLocation *curr_pos)
+{
+    base_type::parse(rem, curr_pos);
+    m_expr = interior_text().trim(" ");
+    std::vector<csubstr> args;
+    csubstr name;
+    m_call = NONE;
+    if(split_call(m_expr, &name, &args) && name != "range")
+    {
+        m_call = m_tokens->add_call(name, args);
+        return;
+    }
+    m_compiled.compile(m_expr);
+}
+
+size_t TokenExpression::_call(NodeRef & root, Rope *rope, size_t after, RenderContext *ctx) const
+{
+    C4_ASSERT(m_tokens != nullptr);
+    MacroCall const& c = m_tokens->m_calls[m_call];
+    C4_ASSERT(c.m_macro != NONE);
+    auto const* macro = static_cast<TokenMacro const*>(m_tokens->get(c.m_macro));
+    return macro->call(root, rope, after, m_tokens->m_call_args.data() + c.m_first_arg, c.m_num_args, ctx);
+}
+
+bool split_call(csubstr s, csubstr *name, std::vector<csubstr> *args)
+{
+    s = s.trim(" \t\r\n");
+    size_t i = 0;
+    if(s.empty() || !((s[0] >= 'a' && s[0] <= 'z') || (s[0] >= 'A' && s[0] <= 'Z') || s[0] == '_')) return false;
+    while(i < s.len && ((s[i] >= 'a' && s[i] <= 'z') || (s[i] >= 'A' && s[i] <= 'Z') || (s[i] >= '0' && s[i] <= '9') || s[i] == '_')) ++i;
+    *name = s.first(i);
+    s = s.sub(i).triml(' ');
+    if( ! s.begins_with('(') || ! s.ends_with(')')) return false;
+    // split at the commas which are not nested in parens, brackets or quotes
+    args->clear();
+    size_t level = 0, arg_start = 1;
+    for(i = 1; i < s.len; ++i)
     {
-        C4_ASSERT(rem == rope->sub(rp).sub(0, rem.len));
-        size_t tk_pos = cont->next_token(&rem, &pos);
-        if(tk_pos == NONE)
+        char c = s[i];
+        if(c == '(' || c == '[')
         {
-            _c4this->parts.emplace_back();
-            auto &p = _c4this->parts.back();
-            p.body = rem;
-            p.entry = rope->replace(rp.entry, rp.i, p.body.len, p.body);
-            curr = rem;
-            break;
+            ++level;
+        }
+        else if(c == ')' || c == ']')
+        {
+            if(level == 0)
+            {
+                if(i + 1 != s.len) return false; // eg f(a) + g(b)
+                break;
+            }
+            --level;
         }
-        // is there an entry for the block before the token?
-        if(rem.begin() != curr.begin())
+        else if(c == '\'' || c == '"')
         {
-            _c4this->parts.emplace_back();
-            auto &p = _c4this->parts.back();
-            p.body = curr.sub(0, rem.begin() - curr.begin());
-            p.entry = rp.entry;
-            rp.entry = rope->split(rp.entry, p.body.len);
-            rp.entry = rope->next(rp.entry);
-            C4_ASSERT(rp.entry != NONE);
-            rp.i = 0;
-            curr = rem;
+            size_t q = s.sub(i + 1).find(c);
+            C4_CHECK_MSG(q != npos, "parse error: unterminated string");
+            i += q + 1;
         }
-        // add the entry for the token
+        else if(c == ',' && level == 0)
         {
-            _c4this->parts.emplace_back();
-            auto &p = _c4this->parts.back();
-            p.token = tk_pos;
-            p.entry = NONE;
-            p.body = rem;
-            rope->replace(rp.entry, rem);
-            cont->get(tk_pos)->m_root_level = false;
-            cont->get(tk_pos)->parse(&rem, &pos);
-            cont->get(tk_pos)->parse_body(cont);
-            C4_ASSERT(p.body.contains(rem));
-            p.body = p.body.sub(0, rem.begin() - p.body.begin());
-            curr = rem;
+            args->push_back(s.range(arg_start, i).trim(' '));
+            arg_start = i + 1;
         }
     }
-
-#undef _c4this
+    csubstr last = s.range(arg_start, s.len - 1).trim(' ');
+    C4_CHECK_MSG( ! last.empty() || args->empty(), "parse error: empty argument");
+    if( ! last.empty())
+    {
+        args->push_back(last);
+    }
+    return true;
 }
 
-size_t TemplateBlock::render(NodeRef & root, Rope *rope) const
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+size_t TemplateBlock::render(NodeRef & root, Rope *rope, RenderContext *ctx) const
 {
     size_t e = NONE;
-    for(auto const& p : parts)
+    for(size_t i = 0; i < num_parts; ++i)
     {
+        auto const& p = part(i);
         if(p.token != NONE)
         {
-            e = tokens->get(p.token)->render(root, rope);
+            e = tokens->get(p.token)->render(root, rope, ctx);
+            if(ctx->m_flow != RenderContext::FLOW_NORMAL)
+            {
+                // a break/continue was rendered: the rest of the block is empty
+                _clear(rope, i + 1);
+                break;
+            }
         }
         else
         {
@@ -278,13 +294,18 @@ size_t TemplateBlock::render(NodeRef & root, Rope *rope) const
     return e;
 }
 
-size_t TemplateBlock::duplicate(NodeRef & root, Rope *rope, size_t start_entry) const
+size_t TemplateBlock::duplicate(NodeRef & root, Rope *rope, size_t start_entry, RenderContext *ctx) const
 {
-    for(auto const& p : parts)
+    for(size_t i = 0; i < num_parts; ++i)
     {
+        auto const& p = part(i);
         if(p.token != NONE)
         {
-            start_entry = tokens->get(p.token)->duplicate(root, rope, start_entry);
+            start_entry = tokens->get(p.token)->duplicate(root, rope, start_entry, ctx);
+            if(ctx->m_flow != RenderContext::FLOW_NORMAL)
+            {
+                break;
+            }
         }
         else
         {
@@ -294,10 +315,11 @@ size_t TemplateBlock::duplicate(NodeRef & root, Rope *rope, size_t start_entry)
     return start_entry;
 }
 
-void TemplateBlock::clear(Rope *rope) const
+void TemplateBlock::_clear(Rope *rope, size_t first) const
 {
-    for(auto const& p : parts)
+    for(size_t i = first; i < num_parts; ++i)
     {
+        auto const& p = part(i);
         if(p.token != NONE)
         {
             tokens->get(p.token)->clear(rope);
@@ -313,216 +335,61 @@ void TemplateBlock::clear(Rope *rope) const
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
-void IfCondition::_eval(TokenIf const* tk, NodeRef & root)
-{
-    m_argval = {};
-    if( ! m_arg.empty())
-    {
-        tk->eval(root, m_arg, &m_argval);
-    }
-    m_cmpval = {};
-    if( ! m_cmp.empty())
-    {
-        tk->eval(root, m_cmp, &m_cmpval);
-    }
-}
-
-bool IfCondition::resolve(TokenIf const* tk, NodeRef & root)
-{
-    switch(m_ctype)
-    {
-    case ELSE:                        return   true;
-    case ARG:        _eval(tk, root); return ! m_argval.empty();
-    case ARG_EQ_CMP: _eval(tk, root); return   m_argval.compare(m_cmpval) == 0;
-    case ARG_NE_CMP: _eval(tk, root); return   m_argval.compare(m_cmpval) != 0;
-    case ARG_GE_CMP: _eval(tk, root); return   m_argval.compare(m_cmpval) >= 0;
-    case ARG_GT_CMP: _eval(tk, root); return   m_argval.compare(m_cmpval) >  0;
-    case ARG_LE_CMP: _eval(tk, root); return   m_argval.compare(m_cmpval) <= 0;
-    case ARG_LT_CMP: _eval(tk, root); return   m_argval.compare(m_cmpval) <  0;
-    case ARG_IN_CMP:
-    case ARG_NOT_IN_CMP:
-    {
-        bool in_cmp;
-        C4_ASSERT(root.is_map());
-        NodeRef n = root.find_child(m_cmp);
-        if(n.valid())
-        {
-            if(n.is_map())
-            {
-                in_cmp = n.find_child(m_arg).valid();
-            }
-            else if(n.is_seq())
-            {
-                in_cmp = false;
-                for(auto ch : n.children())
-                {
-                    if(ch.is_val() && ch.val() == m_arg)
-                    {
-                        in_cmp = true;
-                        break;
-                    }
-                }
-            }
-            else
-            {
-                return false;
-            }
-            return m_ctype == ARG_IN_CMP ? in_cmp : ! in_cmp;
-        }
-        return false;
-    }
-    // do the other condition types
-    default:
-        C4_ERROR("unknown condition type");
-        break;
-    }
-    C4_ERROR("never reach");
-    return false;
-}
-
-void IfCondition::parse()
-{
-    /** @todo the scanning is inefficient. Use a for loop to iterate
-     * through the string characters instead of calling s.find(). This 
-     * was written in a hurry, which explains the lazy use of find(). */
-
-    C4_ASSERT(m_str.first_of("{}*") == npos);
-    auto pos = m_str.first_of('<');
-    if(pos != npos)
-    {
-        C4_ASSERT(pos+2 < m_str.len);
-        if(m_str[pos+1] == '=')
-        {
-            m_ctype = ARG_LE_CMP;
-            m_arg = m_str.left_of(pos).trim(' ');
-            m_cmp = m_str.right_of(pos+2, /*include*/true).trim(' ');
-        }
-        else
-        {
-            m_ctype = ARG_LT_CMP;
-            m_arg = m_str.left_of(pos).trim(' ');
-            m_cmp = m_str.right_of(pos+1, /*include*/true).trim(' ');
-        }
-        return;
-    }
-
-    pos = m_str.first_of('>');
-    if(pos != npos)
-    {
-        C4_ASSERT(pos+2 < m_str.len);
-        if(m_str[pos+1] == '=')
-        {
-            m_ctype = ARG_GE_CMP;
-            m_arg = m_str.left_of(pos).trim(' ');
-            m_cmp = m_str.right_of(pos+2, /*include*/true).trim(' ');
-        }
-        else
-        {
-            m_ctype = ARG_GT_CMP;
-            m_arg = m_str.left_of(pos).trim(' ');
-            m_cmp = m_str.right_of(pos+1, /*include*/true).trim(' ');
-        }
-        return;
-    }
-
-    pos = m_str.first_of('!');
-    if(pos != npos) // !=
-    {
-        C4_ASSERT(pos+2 < m_str.len);
-        C4_ASSERT(m_str[pos+1] == '=');
-        m_ctype = ARG_NE_CMP;
-        m_arg = m_str.left_of(pos).trim(' ');
-        m_cmp = m_str.right_of(pos+2, /*include*/true).trim(' ');
-        return;
-    }
-
-    pos = m_str.first_of('=');
-    if(pos != npos) // ==
-    {
-        C4_ASSERT(pos+2 < m_str.len);
-        C4_ASSERT(m_str[pos+1] == '=');
-        m_ctype = ARG_EQ_CMP;
-        m_arg = m_str.left_of(pos).trim(' ');
-        m_cmp = m_str.right_of(pos+2, /*include*/true).trim(' ');
-        return;
-    }
-
-    pos = m_str.find(" not in ");
-    if(pos != npos) //
-    {
-        m_ctype = ARG_NOT_IN_CMP;
-        m_arg = m_str.left_of(pos).trim(' ');
-        m_cmp = m_str.right_of(pos+8, /*include*/true).trim(' ');
-        return;
-    }
-
-    pos = m_str.find(" in ");
-    if(pos != npos) //
-    {
-        m_ctype = ARG_IN_CMP;
-        m_arg = m_str.left_of(pos).trim(' ');
-        m_cmp = m_str.right_of(pos+4, /*include*/true).trim(' ');
-        return;
-    }
-
-    m_ctype = ARG;
-    m_arg = m_str.trim(' ');
-    m_cmp.clear();
-}
-
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
 void TokenIf::parse(csubstr *rem, TplLocation *curr_pos)
 {
     base_type::parse(rem, curr_pos);
 
     // scan the condition
-    csubstr s = m_full_text;
+    csubstr const full = full_text();
+    csubstr s = full;
     csubstr c = _scan_condition(stoken(), &s);
-    condblock *cb = _add_block(c, s);
-    size_t block_beginning = s.str - m_full_text.str;
+    m_first_block = NONE;
+    m_first_condition = NONE;
+    m_num_blocks = 0;
+    size_t cb = _add_block(c, s);
+    TokenContainer *cont = m_tokens;
+    size_t block_beginning = s.str - full.str;
     size_t block_size = 0;
 
     // scan the branches
     while( ! s.empty())
     {
-        auto result = s.first_of_any("{% endif %}", "{% else %}", "{% elif ", "{% if ");
+        auto result = s.first_of_any("{% endif %}", "{% else %}", "{% elif ", "{% if ", TokenRaw::s_stoken());
         C4_CHECK_MSG(result, "invalid {% if %} structure");
         if(result.which == 0) // endif
         {
             block_size += result.pos;
-            csubstr block_body = m_full_text.sub(block_beginning, block_size);
-            cb->set_body(block_body); // terminate the current block
+            csubstr block_body = full.sub(block_beginning, block_size);
+            cont->m_blocks[cb].set_body(block_body); // terminate the current block
             break;
         }
         else if(result.which == 1) // else
         {
             // finish the current block
             block_size += result.pos;
-            csubstr block_body = m_full_text.sub(block_beginning, block_size);
-            cb->set_body(block_body);
+            csubstr block_body = full.sub(block_beginning, block_size);
+            cont->m_blocks[cb].set_body(block_body);
             // consume the else block
             block_beginning += block_size + 10;  // 10==strlen("{% else %}")
             block_size = 0;
-            block_body = m_full_text.sub(block_beginning, block_size);
+            block_body = full.sub(block_beginning, block_size);
             cb = _add_block({}, block_body, /*as_else*/true);
-            s = m_full_text.sub(block_beginning);
+            s = full.sub(block_beginning);
         }
         else if(result.which == 2) // elif
         {
             block_size += result.pos;
-            csubstr block_body = m_full_text.sub(block_beginning, block_size);
-            cb->set_body(block_body);
+            csubstr block_body = full.sub(block_beginning, block_size);
+            cont->m_blocks[cb].set_body(block_body);
             s = s.sub(result.pos);
             csubstr cond = _scan_condition("{% elif ", &s);
-            block_beginning = s.str - m_full_text.str;
+            block_beginning = s.str - full.str;
             block_size = 0;
-            cb = _add_block(cond, m_full_text.sub(block_beginning, block_size));
+            cb = _add_block(cond, full.sub(block_beginning, block_size));
         }
-        else if(result.which == 3) // nested if
+        else if(result.which == 3 || result.which == 4) // nested if, or raw block
         {
-            csubstr r = skip_nested(s.sub(result.pos));
+            csubstr r = result.which == 3 ? skip_nested(s.sub(result.pos)) : TokenRaw::skip(s.sub(result.pos));
             block_size += (r.str - s.str);
             s = r;
         }
@@ -532,57 +399,58 @@ void TokenIf::parse(csubstr *rem, TplLocation *curr_pos)
         }
     }
 
-    for(auto &cond : m_blocks)
+    for(size_t i = 0; i < m_num_blocks; ++i)
     {
-        C4_ASSERT(m_full_text.contains(cond.body) || cond.body.empty());
-        cond.body = cond.body.triml("\r\n");
-        cond.start.m_rope_pos.i = cond.body.begin() - m_full_text.begin();
+        TemplateBlock &b = cont->m_blocks[m_first_block + i];
+        C4_ASSERT(full.contains(b.body) || b.body.empty());
+        b.body = b.body.triml("\r\n");
+        b.start.m_rope_pos.i = b.body.begin() - full.begin();
     }
 }
 
-TokenIf::condblock* TokenIf::_add_block(csubstr cond, csubstr s, bool as_else)
+size_t TokenIf::_add_block(csubstr cond, csubstr s, bool as_else)
 {
-    C4_ASSERT(m_full_text.contains(s));
-    m_blocks.emplace_back();
-    auto *cb = &m_blocks.back();
-    cb->body = s;
-    cb->start.m_rope = m_start.m_rope;
-    cb->start.m_rope_pos.i = 0;
-    cb->owner_id = this->id();
-    cb->block_id = m_blocks.size() - 1;
-    if(m_blocks.size() == 1)
+    C4_ASSERT(full_text().contains(s));
+    TplLocation start = {rope(), {}};
+    if(m_num_blocks == 0)
     {
-        cb->start.m_rope_pos.entry = m_rope_entry;
+        start.m_rope_pos.entry = m_rope_entry;
     }
     else
     {
-        C4_ASSERT(m_blocks.size() >= 2);
-        auto prev = m_blocks[m_blocks.size() - 2].start.m_rope_pos.entry;
-        cb->start.m_rope_pos.entry = m_start.m_rope->insert_after(prev, s);
+        auto prev = block(m_first_block + m_num_blocks - 1).start.m_rope_pos.entry;
+        start.m_rope_pos.entry = rope()->insert_after(prev, s);
+    }
+    size_t bid = m_tokens->add_block(s, start);
+    // the blocks of this token are added before parsing the nested tokens,
+    // so they are contiguous
+    C4_ASSERT(m_num_blocks == 0 || bid == m_first_block + m_num_blocks);
+    std::vector<IfCondition> &conds = m_tokens->m_conditions;
+    C4_ASSERT(m_num_blocks == 0 || conds.size() == m_first_condition + m_num_blocks);
+    if(m_num_blocks == 0)
+    {
+        m_first_block = bid;
+        m_first_condition = conds.size();
     }
+    ++m_num_blocks;
+    conds.emplace_back();
     if(as_else)
     {
-        cb->condition.init_as_else();
+        conds.back().init_as_else();
     }
     else
     {
-        cb->condition.init(cond);
+        conds.back().init(cond);
     }
-    return cb;
+    return bid;
 }
 
 void TokenIf::parse_body(TokenContainer *cont) const
 {
-    // defend against relocation
-#define _c4this static_cast< TokenIf const* >(cont->get(my_id))
-
-    size_t my_id = this->id();
-    for(auto &b : _c4this->m_blocks)
+    for(size_t i = 0; i < m_num_blocks; ++i)
     {
-        b.parse(cont);
+        cont->parse_block(m_first_block + i);
     }
-
-#undef _c4this
 }
 
 csubstr TokenIf::_scan_condition(csubstr token, csubstr *s)
@@ -602,31 +470,35 @@ bool TokenIf::resolve(NodeRef const& /*root*/, csubstr * /*value*/) const
     return true;
 }
 
-size_t TokenIf::render(NodeRef & root, Rope *rope) const
+size_t TokenIf::_true_block(NodeRef const& root, RenderContext *ctx) const
 {
-    TemplateBlock const* true_block = nullptr;
-
-    // find the block corresponding to a true condition
-    for(auto const& cb : m_blocks)
+    for(size_t i = 0; i < m_num_blocks; ++i)
     {
-        if(cb.condition.resolve(this, root))
+        if(condition(i).resolve(root, ctx))
         {
-            true_block = &cb;
-            break;
+            return i;
         }
     }
+    return NONE;
+}
+
+size_t TokenIf::render(NodeRef & root, Rope *rope, RenderContext *ctx) const
+{
+    // find the block corresponding to a true condition
+    size_t true_block = _true_block(root, ctx);
 
     // render that block (if it exists) and clear all other blocks
     size_t entry = NONE;
-    for(auto const& cb : m_blocks)
+    for(size_t i = 0; i < m_num_blocks; ++i)
     {
-        if(&cb == true_block)
+        TemplateBlock const& b = block(m_first_block + i);
+        if(i == true_block)
         {
-            entry = cb.render(root, rope);
+            entry = b.render(root, rope, ctx);
         }
         else
         {
-            cb.clear(rope);
+            b.clear(rope);
         }
     }
 
@@ -638,31 +510,16 @@ size_t TokenIf::render(NodeRef & root, Rope *rope) const
     return entry;
 }
 
-size_t TokenIf::duplicate(NodeRef & root, Rope *rope, size_t start_entry) const
+size_t TokenIf::duplicate(NodeRef & root, Rope *rope, size_t start_entry, RenderContext *ctx) const
 {
-    TemplateBlock const* true_block = nullptr;
-
     // find the block corresponding to a true condition
-    for(auto const& cb : m_blocks)
-    {
-        if(cb.condition.resolve(this, root))
-        {
-            true_block = &cb;
-            break;
-        }
-    }
+    size_t true_block = _true_block(root, ctx);
 
-    // duplicate that block (if it exists) and clear all other blocks
-    for(auto const& cb : m_blocks)
+    // duplicate that block (if it exists). The other blocks are not
+    // cleared: their entries belong to the first rendering.
+    if(true_block != NONE)
     {
-        if(&cb == true_block)
-        {
-            start_entry = cb.duplicate(root, rope, start_entry);
-        }
-        else
-        {
-            cb.clear(rope);
-        }
+        start_entry = block(m_first_block + true_block).duplicate(root, rope, start_entry, ctx);
     }
 
     return start_entry;
@@ -670,9 +527,9 @@ size_t TokenIf::duplicate(NodeRef & root, Rope *rope, size_t start_entry) const
 
 void TokenIf::clear(Rope *rope) const
 {
-    for(auto const& cb : m_blocks)
+    for(size_t i = 0; i < m_num_blocks; ++i)
     {
-        cb.clear(rope);
+        block(m_first_block + i).clear(rope);
     }
 }
 
@@ -690,133 +547,562 @@ void TokenFor::parse(csubstr *rem, TplLocation *curr_pos)
 {
     base_type::parse(rem, curr_pos);
 
-    csubstr s = m_interior_text;
+    csubstr s = interior_text();
 
-    size_t pos = s.find(" in ");
-    C4_CHECK_MSG(pos != npos, "parse error");
-    m_var = s.left_of(pos);
-    m_val = s.right_of(pos + 4, /*include_pos*/true);
-    pos = m_val.first_of(' ');
+    size_t pos = s.find("%}");
     C4_CHECK_MSG(pos != npos, "parse error");
-    m_val = m_val.left_of(pos);
+    csubstr head = s.left_of(pos);
+    csubstr body = s.right_of(pos + 1);
+    body = body.triml("\r\n");
 
-    csubstr body = s.right_of(m_val);
-    pos = body.find(" %}");
+    // {% for v in seq %} or {% for k, v in map %}
+    pos = head.find(" in ");
     C4_CHECK_MSG(pos != npos, "parse error");
-    C4_CHECK_MSG(pos == 0, "parse error");
-    body = body.right_of(2);
-    body = body.triml("\r\n");
+    m_var = head.left_of(pos).trim(' ');
+    m_val = head.right_of(pos + 3).trim(' ');
+    m_key.clear();
+    pos = m_var.find(',');
+    if(pos != npos)
+    {
+        m_key = m_var.left_of(pos).trim(' ');
+        m_var = m_var.right_of(pos).trim(' ');
+        C4_CHECK_MSG( ! m_key.empty(), "parse error");
+    }
+    m_filter = Expr();
+    m_preselect = false;
+    pos = m_val.find(" if ");
+    if(pos != npos)
+    {
+        csubstr cond = m_val.right_of(pos + 3).trim(' ');
+        m_val = m_val.left_of(pos).trim(' ');
+        C4_CHECK_MSG( ! cond.empty(), "parse error");
+        m_filter.compile(cond);
+        m_preselect = _needs_length(body);
+    }
+    C4_CHECK_MSG( ! m_var.empty() && ! m_val.empty(), "parse error");
+    m_seq.compile(m_val);
 
-    m_block.owner_id = this->id();
-    m_block.block_id = 0;
-    m_block.body = body;
-    m_block.start.m_rope = m_start.m_rope;
-    m_block.start.m_rope_pos.i = body.begin() - m_full_text.begin();
-    m_block.start.m_rope_pos.entry = m_rope_entry;
+    TplLocation start = {rope(), {m_rope_entry, size_t(body.begin() - full_text().begin())}};
+    m_block = m_tokens->add_block(body, start);
 }
 
 void TokenFor::parse_body(TokenContainer *cont) const
 {
-    // watchout for relocations!!!
-    m_block.parse(cont);
+    cont->parse_block(m_block);
 }
 
-size_t TokenFor::render(NodeRef & root, Rope * rope) const
+size_t TokenFor::render(NodeRef & root, Rope * rope, RenderContext *ctx) const
 {
-    return _do_render(root, rope, NONE, false);
+    return _do_render(root, rope, NONE, false, ctx);
 }
 
-size_t TokenFor::duplicate(NodeRef & root, Rope *rope, size_t start_entry) const
+size_t TokenFor::duplicate(NodeRef & root, Rope *rope, size_t start_entry, RenderContext *ctx) const
 {
-    return _do_render(root, rope, start_entry, true);
+    return _do_render(root, rope, start_entry, true, ctx);
 }
 
 void TokenFor::clear(Rope *rope) const
 {
-    m_block.clear(rope);
+    block(m_block).clear(rope);
 }
 
-size_t TokenFor::_do_render(NodeRef& root, Rope *rope, size_t start_entry, bool duplicating) const
+size_t TokenFor::_do_render(NodeRef& root, Rope *rope, size_t start_entry, bool duplicating, RenderContext *ctx) const
 {
-    PropResult pr = get_property(root, m_val);
-    if(pr)
+    // iterate over the children of a container, over a slice of them,
+    // or over the integers of a range(). Slices and ranges are lazy:
+    // only the iterated elements are visited.
+    Value seq = m_seq.eval(root, ctx);
+    size_t num = 0;
+    size_t child = NONE;
+    if(seq.is_container())
+    {
+        NodeRef n = seq.get_node();
+        num = n.num_children();
+        child = n.first_child().id();
+    }
+    else if(seq.is_range())
+    {
+        num = seq.m_range.size();
+        if(seq.is_slice() && num)
+        {
+            child = seq.slice_first();
+        }
+    }
+    auto next = [&seq](size_t node) {
+        return seq.is_slice() ? seq.slice_next(node) : seq.m_tree->next_sibling(node);
+    };
+    auto nth_int = [&seq](size_t pos) {
+        return Value::integer(seq.m_range.start + static_cast<int64_t>(pos) * seq.m_range.step);
+    };
+
+    size_t frame = ctx->m_vars.size();
+    size_t selection = ctx->m_selection.size();
+    if(num && m_preselect)
+    {
+        // the body needs the number of selected elements: select them
+        // before entering the body, so that the loop fields count only
+        // the selected elements. The skipped elements cost only the
+        // evaluation of the condition. The loop fields in the condition
+        // are those of the outer loop.
+        for(size_t i = 0; i < num; ++i)
+        {
+            size_t elm = i;
+            if(child != NONE)
+            {
+                _bind_loop_vars(NodeRef(seq.m_tree, child), i, ctx);
+                elm = child;
+                child = next(child);
+            }
+            else
+            {
+                _bind_loop_vars(nth_int(i), i, ctx);
+            }
+            if(m_filter.eval_bool(root, ctx))
+            {
+                ctx->m_selection.push_back(elm);
+            }
+            ctx->m_vars.resize(frame);
+        }
+        num = ctx->m_selection.size() - selection;
+    }
+
+    // render the body for the variables bound last. Returns false
+    // when the loop is broken.
+    auto render_body = [&](size_t i) {
+        if(i == 0 && !duplicating)
+        {
+            start_entry = block(m_block).render(root, rope, ctx);
+        }
+        else
+        {
+            if(start_entry == NONE) start_entry = m_rope_entry;
+            start_entry = block(m_block).duplicate(root, rope, start_entry, ctx);
+        }
+        ctx->m_vars.resize(frame);
+        ++ctx->m_loops.back().m_index;
+        RenderContext::Flow_e flow = ctx->m_flow;
+        ctx->m_flow = RenderContext::FLOW_NORMAL;
+        return flow != RenderContext::FLOW_BREAK;
+    };
+
+    if(num && ! m_filter.empty() && ! m_preselect)
+    {
+        // evaluate the condition of each element just before rendering
+        // it, so that nothing is evaluated after a break. The loop
+        // fields in the condition are those of the outer loop, so this
+        // loop is pushed only for the body. The body does not use the
+        // number of selected elements, which is not known.
+        size_t count = 0;
+        for(size_t i = 0; i < num; ++i)
+        {
+            size_t node = child;
+            if(child != NONE)
+            {
+                _bind_loop_vars(NodeRef(seq.m_tree, child), i, ctx);
+                child = next(child);
+            }
+            else
+            {
+                _bind_loop_vars(nth_int(i), i, ctx);
+            }
+            bool selected = m_filter.eval_bool(root, ctx);
+            ctx->m_vars.resize(frame);
+            if( ! selected)
+            {
+                continue;
+            }
+            // bind again with the index of the selected element
+            if(node != NONE)
+            {
+                _bind_loop_vars(NodeRef(seq.m_tree, node), count, ctx);
+            }
+            else
+            {
+                _bind_loop_vars(nth_int(i), count, ctx);
+            }
+            ctx->m_loops.push_back({count, num});
+            bool go_on = render_body(count);
+            ctx->m_loops.pop_back();
+            ++count;
+            if( ! go_on)
+            {
+                break;
+            }
+        }
+    }
+    else if(num)
     {
-        C4_ASSERT(pr.n.valid());
-        bool first_child = true;
-        size_t num = pr.n.num_children();
-        size_t i = 0;
-        for(auto ch : pr.n.children())
+        ctx->m_loops.push_back({0, num});
+        for(size_t i = 0; i < num; ++i)
         {
-            _set_loop_properties(root, ch, i++, num);
-            if(first_child && !duplicating)
+            if(m_preselect)
+            {
+                size_t elm = ctx->m_selection[selection + i];
+                if(seq.is_container() || seq.is_slice())
+                {
+                    _bind_loop_vars(NodeRef(seq.m_tree, elm), i, ctx);
+                }
+                else
+                {
+                    _bind_loop_vars(nth_int(elm), i, ctx);
+                }
+            }
+            else if(child != NONE)
             {
-                start_entry = m_block.render(root, rope);
+                _bind_loop_vars(NodeRef(seq.m_tree, child), i, ctx);
+                child = next(child);
             }
             else
             {
-                if(start_entry == NONE) start_entry = m_rope_entry;
-                start_entry = m_block.duplicate(root, rope, start_entry);
+                _bind_loop_vars(nth_int(i), i, ctx);
+            }
+            if( ! render_body(i))
+            {
+                break;
             }
-            first_child = false;
-            _clear_loop_properties(root);
         }
+        ctx->m_loops.pop_back();
     }
+    ctx->m_selection.resize(selection);
 
     if(start_entry == NONE)
     {
         start_entry = m_rope_entry;
-        m_block.clear(rope);
+        block(m_block).clear(rope);
     }
 
     return start_entry;
 }
 
-void TokenFor::_set_loop_properties(NodeRef & root, NodeRef const& var, size_t i, size_t num) const
+/** whether the body of a loop uses the number of its elements, ie
+ * loop.length, loop.revindex or loop.last. This is a conservative
+ * scan of the text: it also finds the fields of the nested loops, and
+ * assumes that they are used by any included template or macro. */
+bool TokenFor::_needs_length(csubstr body)
 {
-    C4_ASSERT(num > 0);
-    C4_CHECK_MSG(!root.find_child(m_var).valid(), "cannot use an existing name for the loop variable value");
-    C4_CHECK_MSG(!root.find_child("loop").valid(), "cannot use an existing name for the loop information variable");
-    C4_CHECK_MSG(root.is_map() || root.is_seq(), "for can only loop over containers");
+    if(body.find(TokenInclude::s_stoken()) != npos)
+    {
+        return true;
+    }
+    for(size_t pos = body.find("loop."); pos != npos; pos = body.find("loop.", pos + 5))
+    {
+        csubstr name = body.sub(pos + 5);
+        size_t len = 0;
+        while(len < name.len && name[len] >= 'a' && name[len] <= 'z') ++len;
+        LoopInfo::Field_e f;
+        if(LoopInfo::field_from_name(name.first(len), &f)
+           && (f == LoopInfo::LENGTH || f == LoopInfo::REVINDEX || f == LoopInfo::LAST))
+        {
+            return true;
+        }
+    }
+    // macro calls, eg {{ name(x) }}
+    std::vector<csubstr> args;
+    for(size_t pos = body.find(TokenExpression::s_stoken()); pos != npos; pos = body.find(TokenExpression::s_stoken(), pos + 2))
+    {
+        csubstr interior = body.sub(pos + 2);
+        size_t end = interior.find(TokenExpression::s_etoken());
+        if(end == npos) break;
+        csubstr name;
+        if(split_call(interior.first(end), &name, &args) && name != "range")
+        {
+            return true;
+        }
+    }
+    return false;
+}
 
-    auto v = root.append_child();
-    v.set_key(m_var);
-    if(var.is_container())
+/** the loop variables are views of the child: nothing is copied. For
+ * `k, v`, k is the key of the child in a map, or its index in a seq. */
+void TokenFor::_bind_loop_vars(NodeRef const& child, size_t index, RenderContext *ctx) const
+{
+    if( ! m_key.empty())
     {
-        if(var.has_key())
+        if(child.has_key())
         {
-            v |= yml::SEQ;
-            v[0] = var.key();
-            var.duplicate(v, v.last_child());
+            ctx->bind(m_key, Value::data(child.key()));
         }
         else
         {
-            //var.duplicate(root, root.last_child());
-            var.duplicate_children(v, v.last_child());
+            ctx->bind(m_key, Value::integer(static_cast<int64_t>(index)));
         }
-        if(var.is_map()) v |= yml::MAP;
-        else if(var.is_seq()) v |= yml::SEQ;
     }
-    else
+    ctx->bind(m_var, Value::node(child));
+}
+
+void TokenFor::_bind_loop_vars(Value const& val, size_t index, RenderContext *ctx) const
+{
+    if( ! m_key.empty())
+    {
+        ctx->bind(m_key, Value::integer(static_cast<int64_t>(index)));
+    }
+    ctx->bind(m_var, val);
+}
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+size_t TokenBreak::render(NodeRef & /*root*/, Rope *rope, RenderContext *ctx) const
+{
+    C4_CHECK_MSG( ! ctx->m_loops.empty(), "{% break %} outside of a loop");
+    ctx->m_flow = RenderContext::FLOW_BREAK;
+    rope->replace(m_rope_entry, {});
+    return m_rope_entry;
+}
+
+size_t TokenBreak::duplicate(NodeRef & /*root*/, Rope * /*rope*/, size_t start_entry, RenderContext *ctx) const
+{
+    C4_CHECK_MSG( ! ctx->m_loops.empty(), "{% break %} outside of a loop");
+    ctx->m_flow = RenderContext::FLOW_BREAK;
+    return start_entry;
+}
+
+size_t TokenContinue::render(NodeRef & /*root*/, Rope *rope, RenderContext *ctx) const
+{
+    C4_CHECK_MSG( ! ctx->m_loops.empty(), "{% continue %} outside of a loop");
+    ctx->m_flow = RenderContext::FLOW_CONTINUE;
+    rope->replace(m_rope_entry, {});
+    return m_rope_entry;
+}
+
+size_t TokenContinue::duplicate(NodeRef & /*root*/, Rope * /*rope*/, size_t start_entry, RenderContext *ctx) const
+{
+    C4_CHECK_MSG( ! ctx->m_loops.empty(), "{% continue %} outside of a loop");
+    ctx->m_flow = RenderContext::FLOW_CONTINUE;
+    return start_entry;
+}
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+void TokenAutoescape::parse(csubstr *rem, TplLocation *curr_pos)
+{
+    base_type::parse(rem, curr_pos);
+
+    csubstr s = interior_text();
+    size_t pos = s.find("%}");
+    C4_CHECK_MSG(pos != npos, "parse error");
+    csubstr mode = s.left_of(pos).trim(' ');
+    C4_CHECK_MSG(escape_from_name(mode, &m_escape), "unknown autoescape mode");
+
+    csubstr body = s.right_of(pos + 1);
+    body = body.triml("\r\n");
+
+    TplLocation start = {rope(), {m_rope_entry, size_t(body.begin() - full_text().begin())}};
+    m_block = m_tokens->add_block(body, start);
+}
+
+void TokenAutoescape::parse_body(TokenContainer *cont) const
+{
+    cont->parse_block(m_block);
+}
+
+size_t TokenAutoescape::render(NodeRef & root, Rope *rope, RenderContext *ctx) const
+{
+    Escape_e prev = ctx->m_escape;
+    ctx->m_escape = m_escape;
+    size_t entry = block(m_block).render(root, rope, ctx);
+    ctx->m_escape = prev;
+    return entry != NONE ? entry : m_rope_entry;
+}
+
+size_t TokenAutoescape::duplicate(NodeRef & root, Rope *rope, size_t start_entry, RenderContext *ctx) const
+{
+    Escape_e prev = ctx->m_escape;
+    ctx->m_escape = m_escape;
+    start_entry = block(m_block).duplicate(root, rope, start_entry, ctx);
+    ctx->m_escape = prev;
+    return start_entry;
+}
+
+void TokenAutoescape::clear(Rope *rope) const
+{
+    block(m_block).clear(rope);
+}
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+void TokenInclude::parse(csubstr *rem, TplLocation *curr_pos)
+{
+    base_type::parse(rem, curr_pos);
+    csubstr name = interior_text().trim(" \r\n");
+    C4_CHECK_MSG(name.len >= 2 && (name.begins_with('"') || name.begins_with('\'')) && name[name.len - 1] == name[0],
+                 "{% include %}: the template name must be a quoted string");
+    m_name = name.unquoted();
+}
+
+void TokenInclude::parse_body(TokenContainer *cont) const
+{
+    C4_CHECK_MSG(cont->m_registry != nullptr, "{% include %}: the engine has no template registry");
+    auto const* e = cont->m_registry->find(m_name);
+    C4_CHECK_MSG(e != nullptr, "{% include %}: template not found");
+    m_tpl = &e->m_engine;
+    m_tpl_index = e->m_index;
+}
+
+size_t TokenInclude::render(NodeRef & root, Rope *rope, RenderContext *ctx) const
+{
+    rope->replace(m_rope_entry, {});
+    return _insert(root, rope, m_rope_entry, ctx);
+}
+
+size_t TokenInclude::duplicate(NodeRef & root, Rope *rope, size_t start_entry, RenderContext *ctx) const
+{
+    return _insert(root, rope, start_entry, ctx);
+}
+
+size_t TokenInclude::_insert(NodeRef & root, Rope *rope, size_t after, RenderContext *ctx) const
+{
+    C4_ASSERT(m_tpl != nullptr);
+    if(m_tpl->m_rope == nullptr) // empty template
     {
-        v = var.val();
+        return after;
     }
+    // the tokens of the included template refer to entries of its
+    // parsed rope, so render into a copy of it, then splice the copy.
+    // The copy is made into a scratch rope kept in the context for
+    // each template, which allocates only when it is first used, or
+    // when the parsed rope is larger. The ropes are sized for all the
+    // templates at once, so that the nested includes do not relocate
+    // them.
+    if(ctx->m_ropes.size() <= m_tpl_index)
+    {
+        ctx->m_ropes.resize(m_tokens->m_registry->size());
+    }
+    Rope &r = ctx->m_ropes[m_tpl_index];
+    r.assign(*m_tpl->m_rope);
+    size_t frame = ctx->m_vars.size(); // the names set in the template are not visible after it
+    m_tpl->render_tokens(root, &r, ctx);
+    ctx->m_vars.resize(frame);
+    return rope->insert_after(after, r);
+}
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+void TokenMacro::parse(csubstr *rem, TplLocation *curr_pos)
+{
+    base_type::parse(rem, curr_pos);
+
+    csubstr s = interior_text();
+    size_t pos = s.find("%}");
+    C4_CHECK_MSG(pos != npos, "parse error");
+    csubstr head = s.left_of(pos).trim(' ');
+    csubstr body = s.right_of(pos + 1);
+    body = body.triml("\r\n");
 
-    auto l = root.append_child();
-    l |= yml::MAP;
-    l.set_key("loop");
-    l["index"] << i;              // The current iteration of the loop. (0 indexed)
-    l["length"] << num;           // The number of items in the sequence.
-    l["revindex"] << num - i - 1; // The number of iterations from the end of the loop (0 indexed)
-    l["first"] << (i == 0);       // "1" if first iteration, "0" otherwise.
-    l["last"] << (i == num-1);    // "1" if last iteration, "0" otherwise.
-    l["odd"] = to_csubstr((i & 1) != 0 ? "1" : "0");
-    l["even"] = to_csubstr((i & 1) == 0 ? "1" : "0");
+    // name(a, b=default)
+    std::vector<csubstr> params;
+    C4_CHECK_MSG(split_call(head, &m_name, &params), "{% macro %}: parse error");
+    m_params.resize(params.size());
+    for(size_t i = 0; i < params.size(); ++i)
+    {
+        csubstr p = params[i];
+        pos = p.find('=');
+        m_params[i].m_name = p.left_of(pos).trim(' ');
+        m_params[i].m_default = Expr();
+        if(pos != npos)
+        {
+            m_params[i].m_default.compile(p.right_of(pos).trim(' '));
+        }
+        C4_CHECK_MSG( ! m_params[i].m_name.empty(), "{% macro %}: parse error");
+    }
+
+    TplLocation start = {rope(), {m_rope_entry, size_t(body.begin() - full_text().begin())}};
+    m_block = m_tokens->add_block(body, start);
+}
+
+void TokenMacro::parse_body(TokenContainer *cont) const
+{
+    cont->m_macros.push_back(this->id());
+    cont->parse_block(m_block);
+}
+
+size_t TokenMacro::render(NodeRef & /*root*/, Rope *rope, RenderContext * /*ctx*/) const
+{
+    block(m_block).clear(rope);
+    return m_rope_entry;
+}
+
+size_t TokenMacro::duplicate(NodeRef & /*root*/, Rope * /*rope*/, size_t start_entry, RenderContext * /*ctx*/) const
+{
+    return start_entry;
 }
 
-void TokenFor::_clear_loop_properties(NodeRef & root) const
+void TokenMacro::clear(Rope *rope) const
 {
-    root.remove_child(m_var);
-    root.remove_child("loop");
+    block(m_block).clear(rope);
+}
+
+size_t TokenMacro::call(NodeRef & root, Rope *rope, size_t after, Expr const* args, size_t num_args, RenderContext *ctx) const
+{
+    C4_CHECK_MSG(num_args <= m_params.size(), "macro called with too many arguments");
+    // evaluate all the arguments in the scope of the caller, and only
+    // then give them their names
+    size_t frame = ctx->m_vars.size();
+    for(size_t i = 0; i < m_params.size(); ++i)
+    {
+        Value v;
+        if(i < num_args)
+        {
+            v = args[i].eval(root, ctx);
+        }
+        else if( ! m_params[i].m_default.empty())
+        {
+            v = m_params[i].m_default.eval(root, ctx);
+        }
+        ctx->bind({}, v);
+    }
+    for(size_t i = 0; i < m_params.size(); ++i)
+    {
+        ctx->m_vars[frame + i].m_name = m_params[i].m_name;
+    }
+    // the body is rendered after the call; its entries where it was
+    // defined are not used
+    after = block(m_block).duplicate(root, rope, after, ctx);
+    ctx->m_vars.resize(frame);
+    return after;
+}
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+void TokenSet::parse(csubstr *rem, TplLocation *curr_pos)
+{
+    base_type::parse(rem, curr_pos);
+    csubstr s = interior_text().trim(" \r\n");
+    size_t pos = s.find('=');
+    C4_CHECK_MSG(pos != npos, "{% set %}: expected name = expression");
+    m_name = s.left_of(pos).trim(' ');
+    csubstr expr = s.right_of(pos).trim(' ');
+    C4_CHECK_MSG( ! m_name.empty() && m_name.first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_") == npos,
+                 "{% set %}: invalid name");
+    C4_CHECK_MSG( ! expr.empty(), "{% set %}: expected name = expression");
+    m_expr.compile(expr);
+}
+
+size_t TokenSet::render(NodeRef & root, Rope *rope, RenderContext *ctx) const
+{
+    ctx->bind(m_name, m_expr.eval(root, ctx));
+    rope->replace(m_rope_entry, {});
+    return m_rope_entry;
+}
+
+size_t TokenSet::duplicate(NodeRef & root, Rope * /*rope*/, size_t start_entry, RenderContext *ctx) const
+{
+    ctx->bind(m_name, m_expr.eval(root, ctx));
+    return start_entry;
 }
 
 } // namespace tpl
@@ -4,6 +4,7 @@
 #include <c4/yml/tree.hpp>
 #include <c4/yml/node.hpp>
 #include "c4/tpl/token_container.hpp"
+#include "c4/tpl/expr.hpp"
 
 namespace c4 {
 namespace tpl {
@@ -11,17 +12,21 @@ namespace tpl {
 // try to do it like this, it's really well done:
 // http://jinja.pocoo.org/docs/2.10/templates/
 
-using Tree = c4::yml::Tree;
-using NodeRef = c4::yml::NodeRef;
-
-struct TemplateBlock;
+class Engine;
 
 class TokenBase;
 
 class TokenExpression;
 class TokenIf;
 class TokenFor;
+class TokenBreak;
+class TokenContinue;
 class TokenComment;
+class TokenAutoescape;
+class TokenInclude;
+class TokenMacro;
+class TokenSet;
+class TokenRaw;
 
 
 inline void register_known_tokens(TokenContainer &c)
@@ -29,7 +34,24 @@ inline void register_known_tokens(TokenContainer &c)
     C4TPL_REGISTER_TOKEN(c, TokenExpression);
     C4TPL_REGISTER_TOKEN(c, TokenIf);
     C4TPL_REGISTER_TOKEN(c, TokenFor);
+    C4TPL_REGISTER_TOKEN(c, TokenBreak);
+    C4TPL_REGISTER_TOKEN(c, TokenContinue);
     C4TPL_REGISTER_TOKEN(c, TokenComment);
+    C4TPL_REGISTER_TOKEN(c, TokenAutoescape);
+    C4TPL_REGISTER_TOKEN(c, TokenInclude);
+    C4TPL_REGISTER_TOKEN(c, TokenMacro);
+    C4TPL_REGISTER_TOKEN(c, TokenSet);
+    C4TPL_REGISTER_TOKEN(c, TokenRaw);
+}
+
+/** visit all the tokens, calling v(T&) with the concrete type of the
+ * known tokens, and v(TokenBase&) for the tokens of any other type. See
+ * ObjMgr::visit_all(). */
+template<class Visitor>
+void visit_known_tokens(TokenContainer &c, Visitor &&v)
+{
+    c.visit_all<TokenExpression, TokenIf, TokenFor, TokenBreak, TokenContinue, TokenComment,
+                TokenAutoescape, TokenInclude, TokenMacro, TokenSet, TokenRaw>(v);
 }
 
 //-----------------------------------------------------------------------------
@@ -50,20 +72,32 @@ public:
 
 public:
 
-    bool m_root_level{true};
-
-    TplLocation m_start;
-    TplLocation m_end;
-    size_t m_rope_entry;
+    // the token header is kept compact, as there may be many tokens:
+    // the text is stored as 32 bit offsets into the source of the
+    // container, and everything else is derived from it.
 
-    csubstr m_full_text;
-    csubstr m_interior_text;
+    bool     m_root_level{true};
+    uint8_t  m_trail{0};       ///< the length of the line ending merged into the full text, after the end token
+    uint32_t m_rope_entry{0};
+    uint32_t m_offs{0};        ///< the offset of the full text in TokenContainer::m_src
+    uint32_t m_len{0};         ///< the length of the full text
+    TokenContainer *m_tokens{nullptr};  ///< the container of this token, where its blocks are stored
 
 public:
 
-    Rope * rope() const { return m_start.m_rope; }
+    Rope * rope() const { return m_tokens->m_rope; }
     size_t rope_entry() const { return m_rope_entry; }
 
+    /** the text of the token, from the start token to the end token,
+     * and the line ending after it, if any */
+    csubstr full_text() const { return m_tokens->m_src.sub(m_offs, m_len); }
+    /** the text between the start and end tokens */
+    csubstr interior_text() const
+    {
+        size_t s = stoken().len;
+        return m_tokens->m_src.sub(m_offs + s, m_len - m_trail - etoken().len - s);
+    }
+
     virtual void parse(csubstr *rem, TplLocation *curr_pos);
 
     virtual void parse_body(TokenContainer * /*cont*/) const {}
@@ -74,7 +108,7 @@ public:
         return false;
     }
 
-    virtual size_t render(NodeRef & root, Rope *rope) const
+    virtual size_t render(NodeRef & root, Rope *rope, RenderContext * /*ctx*/) const
     {
         csubstr val = {};
         resolve(root, &val);
@@ -82,7 +116,7 @@ public:
         return m_rope_entry;
     }
 
-    virtual size_t duplicate(NodeRef & /*root*/, Rope * /*rope*/, size_t /*start_entry*/) const
+    virtual size_t duplicate(NodeRef & /*root*/, Rope * /*rope*/, size_t /*start_entry*/, RenderContext * /*ctx*/) const
     {
         // empty by default
         return m_rope_entry;
@@ -102,15 +136,19 @@ public:
     };
     static PropResult get_property(NodeRef const& root, csubstr name, bool inside_brackets=false);
 
-    bool eval(NodeRef const& root, csubstr key, csubstr *result) const;
-
     void mark();
+    /** like mark(), with the marker of a known token type */
+    template<class T>
+    void mark_as()
+    {
+        rope()->replace(m_rope_entry, T::s_marker());
+    }
 
-    csubstr sub() const { return m_start.m_rope->sub(m_rope_entry, 0); }
+    csubstr sub() const { return rope()->sub(m_rope_entry, 0); }
 
-    csubstr skip_nested(csubstr s) const;
+    virtual csubstr skip_nested(csubstr s) const;
 
-    virtual TemplateBlock* get_block(size_t bid) = 0;
+    TemplateBlock const& block(size_t bid) const { return m_tokens->m_blocks[bid]; }
 
 protected:
 
@@ -129,36 +167,49 @@ public:
 public:
 
     csubstr  m_expr;
-    size_t m_expr_offs;
+    Expr     m_compiled;
+    size_t   m_call{NONE};  ///< for macro calls, eg {{ name(x, y) }}: the index in TokenContainer::m_calls
+
+    void parse(csubstr *rem, TplLocation *curr_pos) override;
 
-    void parse(csubstr *rem, TplLocation *curr_pos) override
+    void parse_body(TokenContainer *cont) const override
     {
-        csubstr orig = *rem; (void)orig;
-        base_type::parse(rem, curr_pos);
-        m_expr = m_interior_text.trim(" ");
-        C4_ASSERT(orig.contains(m_expr));
-        m_expr_offs = m_expr.begin() - orig.begin();
+        // the macro of a call may be defined after it, so it is resolved
+        // when parsing ends. See TokenContainer::resolve_calls()
+        C4_ASSERT(m_expr.find('|') == npos && "filters not implemented");
+        C4_ASSERT(m_tokens == cont); (void)cont;
     }
 
-    void parse_body(TokenContainer * /*cont*/) const override
+    /** evaluate the expression, and get its text */
+    csubstr _eval(NodeRef const& root, RenderContext *ctx) const
     {
-        C4_ASSERT(m_expr.find('|') == npos && "filters not implemented");
+        csubstr val = m_compiled.eval(root, ctx).to_str(&ctx->m_arena);
+        return escape(ctx->m_escape, val, &ctx->m_arena);
     }
 
-    bool resolve(NodeRef const& root, csubstr *value) const override
+    size_t render(NodeRef & root, Rope *rope, RenderContext *ctx) const override
     {
-        return this->eval(root, m_expr, value);
+        if(m_call != NONE)
+        {
+            rope->replace(m_rope_entry, {});
+            return _call(root, rope, m_rope_entry, ctx);
+        }
+        rope->replace(m_rope_entry, _eval(root, ctx));
+        return m_rope_entry;
     }
 
-    size_t duplicate(NodeRef & root, Rope *rope, size_t start_entry) const override
+    size_t duplicate(NodeRef & root, Rope *rope, size_t start_entry, RenderContext *ctx) const override
     {
-        csubstr val = {};
-        resolve(root, &val);
-        size_t insert_entry = rope->insert_after(start_entry, val);
+        if(m_call != NONE)
+        {
+            return _call(root, rope, start_entry, ctx);
+        }
+        size_t insert_entry = rope->insert_after(start_entry, _eval(root, ctx));
         return insert_entry;
     }
 
-    TemplateBlock* get_block(size_t /*bid*/) override { C4_ERROR("never call"); return nullptr; }
+    /** render the macro after the given entry */
+    size_t _call(NodeRef & root, Rope *rope, size_t after, RenderContext *ctx) const;
 
 };
 
@@ -169,9 +220,6 @@ public:
 class TokenFilter : public TokenBase
 {
     C4_DECLARE_TOKEN(TokenFilter, "|", " ", "<<<filter>>>")
-
-    TemplateBlock* get_block(size_t bid) override { C4_ERROR("never call"); return nullptr; }
-
 };
 */
 
@@ -185,172 +233,293 @@ public:
 
     C4TPL_DECLARE_TOKEN(TokenComment, "{#", "#}", "<<<cmt>>>");
 
-    TemplateBlock* get_block(size_t /*bid*/) override { C4_ERROR("never call"); return nullptr; }
 };
 
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
-
-struct TemplateBlock
+/** {% raw %}...{% endraw %}: literal text, which may contain template
+ * syntax. The scanner jumps to the end marker, and the text becomes a
+ * single rope entry. Raw blocks do not nest. */
+class TokenRaw : public TokenBase
 {
-    struct subpart
+public:
+
+    C4TPL_DECLARE_TOKEN(TokenRaw, "{% raw %}", "{% endraw %}", "<<<raw>>>")
+
+    /** s starts with {% raw %}: get the rest after the matching {% endraw %} */
+    static csubstr skip(csubstr s)
     {
-        size_t entry{NONE};
-        csubstr body{};
-        size_t token{NONE};
-    };
+        C4_ASSERT(s.begins_with(s_stoken()));
+        size_t pos = s.find(s_etoken());
+        C4_CHECK_MSG(pos != npos, "{% raw %}: missing {% endraw %}");
+        return s.sub(pos + s_etoken().len);
+    }
 
-    csubstr body;
-    TplLocation start;
-    std::vector<subpart> parts;
-    TokenContainer *tokens; // to get the tokens from their ids
-    size_t owner_id, block_id; // major smell - rewrite TokenContainer to avoid relocations
+    csubstr skip_nested(csubstr s) const override { return skip(s); }
+
+    size_t render(NodeRef & /*root*/, Rope *rope, RenderContext * /*ctx*/) const override
+    {
+        rope->replace(m_rope_entry, interior_text());
+        return m_rope_entry;
+    }
 
-    void set_body(csubstr b)
+    size_t duplicate(NodeRef & /*root*/, Rope *rope, size_t start_entry, RenderContext * /*ctx*/) const override
     {
-        body = b;
-        start.m_rope->replace(start.m_rope_pos.entry, b);
+        return rope->insert_after(start_entry, interior_text());
     }
+};
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+class TokenIf : public TokenBase
+{
+public:
+
+    C4TPL_DECLARE_TOKEN(TokenIf, "{% if ", "{% endif %}", "<<<if>>>")
+
+    void parse(csubstr *rem, TplLocation *curr_pos) override;
 
-    void parse(TokenContainer *cont);
+    void parse_body(TokenContainer *cont) const override;
 
-    size_t render(NodeRef & root, Rope *r) const;
+    static csubstr _scan_condition(csubstr token, csubstr *s);
+
+    bool resolve(NodeRef const& root, csubstr *value) const override;
 
-    size_t duplicate(NodeRef & root, Rope *r, size_t start_entry) const;
+    size_t render(NodeRef & root, Rope *rope, RenderContext *ctx) const override;
 
-    void clear(Rope *r) const;
+    size_t duplicate(NodeRef & root, Rope *rope, size_t start_entry, RenderContext *ctx) const override;
 
+    void clear(Rope *rope) const override;
+
+public:
+
+    size_t m_first_block{NONE};      ///< the index of the first block in TokenContainer::m_blocks. The blocks are contiguous.
+    size_t m_first_condition{NONE};  ///< the index of the condition of the first block in TokenContainer::m_conditions
+    size_t m_num_blocks{0};
+
+    IfCondition const& condition(size_t i) const { return m_tokens->m_conditions[m_first_condition + i]; }
+
+    size_t _add_block(csubstr cond, csubstr s, bool as_else=false);
+    /** the first block whose condition is true, or NONE */
+    size_t _true_block(NodeRef const& root, RenderContext *ctx) const;
 };
 
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
+class TokenFor : public TokenBase
+{
+public:
 
-struct IfCondition
+    C4TPL_DECLARE_TOKEN(TokenFor, "{% for ", "{% endfor %}", "<<<for>>>")
+
+    void parse(csubstr *rem, TplLocation *curr_pos) override;
+
+    void parse_body(TokenContainer *cont) const override;
+
+    bool resolve(NodeRef const& root, csubstr *value) const override;
+
+    size_t render(NodeRef & root, Rope *rope, RenderContext *ctx) const override;
+
+    size_t duplicate(NodeRef & root, Rope *rope, size_t start_entry, RenderContext *ctx) const override;
+
+    void clear(Rope *rope) const override;
+
+public:
+
+    void _bind_loop_vars(NodeRef const& child, size_t index, RenderContext *ctx) const;
+    void _bind_loop_vars(Value const& val, size_t index, RenderContext *ctx) const;
+
+    size_t _do_render(NodeRef& root, Rope *rope, size_t start_entry, bool duplicating, RenderContext *ctx) const;
+
+    static bool _needs_length(csubstr body);
+
+public:
+
+    size_t m_block{NONE};  ///< the index of the body in TokenContainer::m_blocks
+    bool    m_preselect{false};  ///< whether the filter is evaluated for all the elements before the body, see _needs_length()
+    csubstr m_key;  ///< the key variable in {% for k, v in m %}, if any
+    csubstr m_var;
+    csubstr m_val;
+    Expr    m_seq;     ///< the compiled m_val
+    Expr    m_filter;  ///< the condition in {% for v in seq if cond %}, if any
+};
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+/** {% break %}: skip the rest of the innermost loop */
+class TokenBreak : public TokenBase
 {
+public:
 
-    typedef enum {
-        _INVALID,
-        ARG,             //!< foo: true if arg value is not empty
-        ARG_IN_CMP,      //!< foo in bar
-        ARG_NOT_IN_CMP,  //!< foo not in bar
-        ARG_EQ_CMP,      //!< foo == bar
-        ARG_NE_CMP,      //!< foo != bar
-        ARG_GE_CMP,      //!< foo >= bar
-        ARG_GT_CMP,      //!< foo >  bar
-        ARG_LE_CMP,      //!< foo <= bar
-        ARG_LT_CMP,      //!< foo <  bar
-        ELSE,            //!< else- blocks, always true
-    } Type_e;
-
-    csubstr  m_str;
-    csubstr  m_arg;
-    csubstr  m_argval;
-    csubstr  m_cmp;
-    csubstr  m_cmpval;
-    Type_e   m_ctype;
-
-    void init_as_else()
-    {
-        m_str.clear();
-        m_ctype = ELSE;
-    }
+    C4TPL_DECLARE_TOKEN(TokenBreak, "{% break ", "%}", "<<<break>>>")
 
-    void init(csubstr str)
-    {
-        C4_ASSERT( ! str.begins_with("{% if"));
-        m_str = str;
-        parse();
-    }
+    size_t render(NodeRef & root, Rope *rope, RenderContext *ctx) const override;
 
-    bool resolve(TokenIf const* tk, NodeRef & root);
+    size_t duplicate(NodeRef & root, Rope *rope, size_t start_entry, RenderContext *ctx) const override;
 
-    void parse();
+};
 
-private:
 
-    void _eval(TokenIf const* tk, NodeRef & root);
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+/** {% continue %}: skip the rest of the current iteration of the innermost loop */
+class TokenContinue : public TokenBase
+{
+public:
+
+    C4TPL_DECLARE_TOKEN(TokenContinue, "{% continue ", "%}", "<<<continue>>>")
+
+    size_t render(NodeRef & root, Rope *rope, RenderContext *ctx) const override;
+
+    size_t duplicate(NodeRef & root, Rope *rope, size_t start_entry, RenderContext *ctx) const override;
+
 };
 
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
-class TokenIf : public TokenBase
+/** {% autoescape html %}...{% endautoescape %}: escape the values of the
+ * expressions in the block. Accepts the names understood by
+ * escape_from_name(). */
+class TokenAutoescape : public TokenBase
 {
 public:
 
-    C4TPL_DECLARE_TOKEN(TokenIf, "{% if ", "{% endif %}", "<<<if>>>")
+    C4TPL_DECLARE_TOKEN(TokenAutoescape, "{% autoescape ", "{% endautoescape %}", "<<<autoescape>>>")
 
     void parse(csubstr *rem, TplLocation *curr_pos) override;
 
     void parse_body(TokenContainer *cont) const override;
 
-    static csubstr _scan_condition(csubstr token, csubstr *s);
+    size_t render(NodeRef & root, Rope *rope, RenderContext *ctx) const override;
 
-    bool resolve(NodeRef const& root, csubstr *value) const override;
+    size_t duplicate(NodeRef & root, Rope *rope, size_t start_entry, RenderContext *ctx) const override;
 
-    size_t render(NodeRef & root, Rope *rope) const override;
+    void clear(Rope *rope) const override;
 
-    size_t duplicate(NodeRef & root, Rope *rope, size_t start_entry) const override;
+public:
 
-    void clear(Rope *rope) const override;
+    size_t m_block{NONE};  ///< the index of the body in TokenContainer::m_blocks
+    Escape_e m_escape;
+};
 
-    TemplateBlock* get_block(size_t bid) override { C4_ASSERT(bid < m_blocks.size()); return &m_blocks[bid]; }
 
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+/** {% include "name" %}: render a template from the registry of the
+ * engine, with the current names and loops. The included template is
+ * looked up when parsing, and is not copied: it is rendered from its
+ * parsed form, into a scratch rope which is reused in each render. */
+class TokenInclude : public TokenBase
+{
 public:
 
-    struct condblock : public TemplateBlock
-    {
-        mutable IfCondition condition;
-    };
+    C4TPL_DECLARE_TOKEN(TokenInclude, "{% include ", "%}", "<<<include>>>")
+
+    void parse(csubstr *rem, TplLocation *curr_pos) override;
+
+    void parse_body(TokenContainer *cont) const override;
+
+    size_t render(NodeRef & root, Rope *rope, RenderContext *ctx) const override;
+
+    size_t duplicate(NodeRef & root, Rope *rope, size_t start_entry, RenderContext *ctx) const override;
+
+
+public:
+
+    size_t _insert(NodeRef & root, Rope *rope, size_t after, RenderContext *ctx) const;
 
-    mutable std::vector<condblock> m_blocks;
+public:
 
-    condblock* _add_block(csubstr cond, csubstr s, bool as_else=false);
+    csubstr m_name;
+    mutable Engine const* m_tpl{nullptr};  ///< set in parse_body()
+    mutable size_t m_tpl_index{NONE};      ///< the position of m_tpl in the registry, set in parse_body()
 };
 
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
-class TokenFor : public TokenBase
+/** {% macro name(a, b=default) %}...{% endmacro %}: a block rendered
+ * where it is called with {{ name(x, y) }}. The body is parsed once;
+ * each call binds the arguments as names in the render context and
+ * renders the body after the call. The macro renders nothing where it
+ * is defined. */
+class TokenMacro : public TokenBase
 {
 public:
 
-    C4TPL_DECLARE_TOKEN(TokenFor, "{% for ", "{% endfor %}", "<<<for>>>")
+    C4TPL_DECLARE_TOKEN(TokenMacro, "{% macro ", "{% endmacro %}", "<<<macro>>>")
 
     void parse(csubstr *rem, TplLocation *curr_pos) override;
 
     void parse_body(TokenContainer *cont) const override;
 
-    bool resolve(NodeRef const& root, csubstr *value) const override;
-
-    size_t render(NodeRef & root, Rope *rope) const override;
+    size_t render(NodeRef & root, Rope *rope, RenderContext *ctx) const override;
 
-    size_t duplicate(NodeRef & root, Rope *rope, size_t start_entry) const override;
+    size_t duplicate(NodeRef & root, Rope *rope, size_t start_entry, RenderContext *ctx) const override;
 
     void clear(Rope *rope) const override;
 
-    TemplateBlock* get_block(size_t bid) override { C4_ASSERT(bid == 0); (void)bid; return &m_block; }
+    /** render the body after the given entry, with the given arguments */
+    size_t call(NodeRef & root, Rope *rope, size_t after, Expr const* args, size_t num_args, RenderContext *ctx) const;
+
+public:
+
+    struct param
+    {
+        csubstr m_name;
+        Expr    m_default;  ///< empty if there is no default
+    };
+
+    size_t m_block{NONE};  ///< the index of the body in TokenContainer::m_blocks
+    csubstr m_name;
+    std::vector<param> m_params;
+};
 
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+/** {% set name = expr %}: evaluate the expression once, and bind its
+ * value to the name in the render context. The name is visible until
+ * the end of the enclosing loop iteration, macro or included template,
+ * or else until the end of the render. The data tree is not modified. */
+class TokenSet : public TokenBase
+{
 public:
 
-    void _set_loop_properties(NodeRef &root, NodeRef const& var, size_t i, size_t num) const;
-    void _clear_loop_properties(NodeRef &root) const;
+    C4TPL_DECLARE_TOKEN(TokenSet, "{% set ", "%}", "<<<set>>>")
+
+    void parse(csubstr *rem, TplLocation *curr_pos) override;
+
+    size_t render(NodeRef & root, Rope *rope, RenderContext *ctx) const override;
+
+    size_t duplicate(NodeRef & root, Rope *rope, size_t start_entry, RenderContext *ctx) const override;
 
-    size_t _do_render(NodeRef& root, Rope *rope, size_t start_entry, bool duplicating) const;
 
 public:
 
-    mutable TemplateBlock m_block;
-    csubstr m_var;
-    csubstr m_val;
+    csubstr m_name;
+    Expr    m_expr;
 };
 
+
+/** split `name(arg, arg...)` into the name and the arguments, if the
+ * string is entirely of that form */
+bool split_call(csubstr s, csubstr *name, std::vector<csubstr> *args);
+
 } // namespace tpl
 } // namespace c4
 
@@ -1,5 +1,6 @@
 #include "c4/tpl/token_container.hpp"
 #include "c4/tpl/token.hpp"
+#include <algorithm>
 
 namespace c4 {
 namespace tpl {
@@ -13,11 +14,139 @@ size_t TokenContainer::next_token(csubstr *rem, TplLocation *loc)
     auto result = rem->first_of_any_iter(m_token_starts.begin(), m_token_starts.end());
     if( ! result) return NONE;
     TokenBase *t = this->create_from_pool(result.which);
+    t->m_tokens = this;
     m_token_seq.push_back(t->id());
     *rem = rem->sub(result.pos);
     loc->m_rope_pos.i += result.pos;
     return t->id();
 }
 
+size_t TokenContainer::reserve_for(csubstr src)
+{
+    // the start tokens are in the order of the types. They are followed
+    // by the tags which start the further blocks of an {% if %}.
+    std::vector<csubstr> patterns(m_token_starts);
+    patterns.emplace_back("{% elif ");
+    patterns.emplace_back("{% else %}");
+    std::vector<size_t> counts(patterns.size(), 0);
+    size_t total = 0;
+    csubstr rem = src;
+    while( ! rem.empty())
+    {
+        auto result = rem.first_of_any_iter(patterns.begin(), patterns.end());
+        if( ! result) break;
+        ++counts[result.which];
+        rem = rem.sub(result.pos + patterns[result.which].len);
+    }
+    for(size_t type_id = 0; type_id < m_token_starts.size(); ++type_id)
+    {
+        total += counts[type_id];
+        if(counts[type_id] == 0) continue;
+        pool_type *p = get_pool(type_id);
+        p->reserve(p->size() + counts[type_id]);
+    }
+    m_token_seq.reserve(m_token_seq.size() + total);
+    m_root_seq.reserve(m_root_seq.size() + total);
+    // each token has at most one block, except for the further blocks
+    // of an {% if %}, which have one condition each. A block has at
+    // most one part for each token in it, and one for the text before
+    // each token and at its end.
+    size_t num_blocks = total + counts[m_token_starts.size()] + counts[m_token_starts.size() + 1];
+    size_t num_parts = 2 * total + num_blocks;
+    m_blocks.reserve(m_blocks.size() + num_blocks);
+    m_conditions.reserve(m_conditions.size() + num_blocks);
+    m_parts.reserve(m_parts.size() + num_parts);
+    m_part_stack.reserve(m_part_stack.size() + num_parts);
+    return total;
+}
+
+void TokenContainer::resolve_calls()
+{
+    if(m_calls.empty()) return;
+    // sort the macros by name, keeping the first of the same name first
+    using name_id = std::pair<csubstr, size_t>;
+    std::vector<name_id> macros;
+    macros.reserve(m_macros.size());
+    for(size_t id : m_macros)
+    {
+        macros.emplace_back(static_cast<TokenMacro const*>(get(id))->m_name, id);
+    }
+    auto less = [](name_id const& a, name_id const& b) { return a.first.compare(b.first) < 0; };
+    std::stable_sort(macros.begin(), macros.end(), less);
+    for(MacroCall &c : m_calls)
+    {
+        auto it = std::lower_bound(macros.begin(), macros.end(), name_id(c.m_name, NONE), less);
+        C4_CHECK_MSG(it != macros.end() && it->first == c.m_name, "macro not found");
+        c.m_macro = it->second;
+    }
+}
+
+void TokenContainer::parse_block(size_t bid)
+{
+    // the nested tokens add their blocks and parts while this one is
+    // parsed, so the parts are gathered in the stack, and moved to
+    // m_parts at the end, where they become contiguous
+    C4_ASSERT(bid < m_blocks.size());
+    csubstr body = m_blocks[bid].body;
+    TplLocation pos = m_blocks[bid].start;
+    C4_ASSERT(pos.m_rope != nullptr);
+    size_t first = m_part_stack.size();
+    csubstr curr = body;
+    csubstr rem = body;
+    Rope *rope = pos.m_rope;
+    auto &rp = pos.m_rope_pos;
+    rope->replace(rp.entry, body);
+    rp.i = 0;
+    while( ! rem.empty())
+    {
+        C4_ASSERT(rem == rope->sub(rp).sub(0, rem.len));
+        size_t tk_pos = next_token(&rem, &pos);
+        if(tk_pos == NONE)
+        {
+            m_part_stack.emplace_back();
+            auto &p = m_part_stack.back();
+            p.body = rem;
+            p.entry = rope->replace(rp.entry, rp.i, p.body.len, p.body);
+            curr = rem;
+            break;
+        }
+        // is there an entry for the block before the token?
+        if(rem.begin() != curr.begin())
+        {
+            m_part_stack.emplace_back();
+            auto &p = m_part_stack.back();
+            p.body = curr.sub(0, rem.begin() - curr.begin());
+            p.entry = rp.entry;
+            rp.entry = rope->split(rp.entry, p.body.len);
+            rp.entry = rope->next(rp.entry);
+            C4_ASSERT(rp.entry != NONE);
+            rp.i = 0;
+            curr = rem;
+        }
+        // add the entry for the token
+        {
+            size_t ip = m_part_stack.size();
+            m_part_stack.emplace_back();
+            m_part_stack[ip].token = tk_pos;
+            m_part_stack[ip].entry = NONE;
+            m_part_stack[ip].body = rem;
+            rope->replace(rp.entry, rem);
+            TokenBase *tk = get(tk_pos);  // the pools are paged: the tokens are not relocated
+            tk->m_root_level = false;
+            tk->parse(&rem, &pos);
+            tk->parse_body(this);
+            csubstr &pbody = m_part_stack[ip].body;
+            C4_ASSERT(pbody.contains(rem));
+            pbody = pbody.sub(0, rem.begin() - pbody.begin());
+            curr = rem;
+        }
+    }
+    TemplateBlock &b = m_blocks[bid];
+    b.first_part = m_parts.size();
+    b.num_parts = m_part_stack.size() - first;
+    m_parts.insert(m_parts.end(), m_part_stack.begin() + (ptrdiff_t)first, m_part_stack.end());
+    m_part_stack.resize(first);
+}
+
 } // namespace tpl
 } // namespace c4
@@ -5,6 +5,8 @@
 #include <c4/std/vector.hpp>
 #include "c4/tpl/rope.hpp"
 #include "c4/tpl/mgr.hpp"
+#include "c4/tpl/render_context.hpp"
+#include "c4/tpl/expr.hpp"
 
 #ifdef __GNUC__
 #   pragma GCC diagnostic push
@@ -16,6 +18,7 @@ namespace tpl {
 
 class TokenBase;
 class TokenContainer;
+class TemplateRegistry;
 
 class Rope;
 
@@ -31,6 +34,87 @@ struct TplLocation
 
 void register_known_tokens(TokenContainer &c);
 
+using Tree = c4::yml::Tree;
+using NodeRef = c4::yml::NodeRef;
+
+/** the condition of an if/elif block. See Expr for the syntax. */
+struct IfCondition
+{
+    csubstr m_str;
+    Expr    m_expr;
+    bool    m_else;
+
+    void init_as_else()
+    {
+        m_str.clear();
+        m_expr = Expr();
+        m_else = true;
+    }
+
+    void init(csubstr str)
+    {
+        C4_ASSERT( ! str.begins_with("{% if"));
+        m_str = str;
+        m_else = false;
+        m_expr.compile(str);
+    }
+
+    bool resolve(NodeRef const& root, RenderContext *ctx) const
+    {
+        return m_else || m_expr.eval_bool(root, ctx);
+    }
+};
+
+/** a call of a macro, eg {{ name(x, y) }}. Few expressions are calls,
+ * so the calls are kept in the token container instead of in each
+ * TokenExpression. */
+struct MacroCall
+{
+    csubstr m_name;
+    size_t  m_first_arg;  ///< the index of the first argument in TokenContainer::m_call_args. The arguments are contiguous.
+    size_t  m_num_args;
+    size_t  m_macro;      ///< the id of the macro token. See TokenContainer::resolve_calls()
+};
+
+/** a template block: the text of a control structure (eg the body of a
+ * {% for %}), split into the text parts and the tokens inside it. The
+ * blocks and their parts are stored flat in the token container, and
+ * are addressed by their index there, so that they do not need to
+ * care about relocations. */
+struct TemplateBlock
+{
+    struct subpart
+    {
+        size_t entry{NONE};
+        csubstr body{};
+        size_t token{NONE};
+    };
+
+    csubstr body;
+    TplLocation start;
+    size_t first_part{0};  ///< the index of the first part in TokenContainer::m_parts
+    size_t num_parts{0};
+    TokenContainer *tokens{nullptr}; // to get the tokens and the parts
+
+    void set_body(csubstr b)
+    {
+        body = b;
+        start.m_rope->replace(start.m_rope_pos.entry, b);
+    }
+
+    subpart const& part(size_t i) const;
+
+    size_t render(NodeRef & root, Rope *r, RenderContext *ctx) const;
+
+    size_t duplicate(NodeRef & root, Rope *r, size_t start_entry, RenderContext *ctx) const;
+
+    void clear(Rope *r) const { _clear(r, 0); }
+
+    /** clear the parts starting at the given one */
+    void _clear(Rope *r, size_t first) const;
+
+};
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
@@ -57,7 +141,9 @@ public:                                                                 \
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 using TokenPoolType = pool_linear_paged<256, size_t, allocator_mr<char>>;
-constexpr const size_t TokenTypesMax = 32;
+/** the max number of token types: 0 means the pools are allocated from
+ * the heap, so any number of token types can be registered */
+constexpr const size_t TokenTypesMax = 0;
 
 class TokenContainer : public ObjMgr<TokenBase, TokenPoolType, TokenTypesMax>
 {
@@ -67,7 +153,19 @@ class TokenContainer : public ObjMgr<TokenBase, TokenPoolType, TokenTypesMax>
 public:
 
     std::vector<csubstr>    m_token_starts;
-    std::vector<size_t>     m_token_seq;
+    std::vector<size_t>     m_token_seq;   ///< the ids of all the tokens, in the order of the source
+    std::vector<size_t>     m_root_seq;    ///< the ids of the root-level tokens, in the order of the source
+    TemplateRegistry const* m_registry{nullptr};  ///< where to look for included templates
+    csubstr                 m_src;   ///< the source of the tokens. Their text is stored as offsets into it.
+    Rope *                  m_rope{nullptr};  ///< the rope of the tokens
+    std::vector<size_t>     m_macros;  ///< the ids of the {% macro %} tokens
+
+    std::vector<TemplateBlock>          m_blocks;      ///< the blocks of all the tokens, by index
+    std::vector<TemplateBlock::subpart> m_parts;       ///< the parts of all the blocks. The parts of each block are contiguous.
+    std::vector<TemplateBlock::subpart> m_part_stack;  ///< the parts of the blocks being parsed, the innermost last
+    std::vector<IfCondition>            m_conditions;  ///< the conditions of the blocks of the {% if %} tokens
+    std::vector<MacroCall>              m_calls;       ///< the macro calls of the {{ }} tokens
+    std::vector<Expr>                   m_call_args;   ///< the arguments of the macro calls
 
     using ObjMgr::ObjMgr;
     ~TokenContainer();
@@ -83,8 +181,62 @@ public:
 
     size_t next_token(csubstr *rem, TplLocation *loc);
 
+    /** reserve the pools, the token lists and the blocks for the
+     * tokens of a source, from a cheap scan counting the start tokens of
+     * each type and the else/elif tags. The count is an upper bound, as
+     * it includes the tags in raw blocks and comments. Returns the
+     * number of tokens counted. */
+    size_t reserve_for(csubstr src);
+
+    /** add a block, to be parsed later with parse_block(). Returns its index. */
+    size_t add_block(csubstr body, TplLocation const& start)
+    {
+        m_blocks.emplace_back();
+        TemplateBlock &b = m_blocks.back();
+        b.body = body;
+        b.start = start;
+        b.tokens = this;
+        return m_blocks.size() - 1;
+    }
+
+    /** add a macro call, with its arguments. Returns its index. */
+    size_t add_call(csubstr name, std::vector<csubstr> const& args)
+    {
+        m_calls.push_back({name, m_call_args.size(), args.size(), NONE});
+        for(csubstr a : args)
+        {
+            m_call_args.emplace_back();
+            m_call_args.back().compile(a);
+        }
+        return m_calls.size() - 1;
+    }
+
+    /** find the macro of each call. The macros may be defined after
+     * their calls, so this is done when parsing ends. */
+    void resolve_calls();
+
+    /** parse the tokens of a block. The blocks added by its tokens may
+     * relocate m_blocks, so the block is addressed by its index. */
+    void parse_block(size_t bid);
+
+    void clear_blocks()
+    {
+        m_blocks.clear();
+        m_parts.clear();
+        m_part_stack.clear();
+        m_conditions.clear();
+        m_calls.clear();
+        m_call_args.clear();
+    }
+
 };
 
+inline TemplateBlock::subpart const& TemplateBlock::part(size_t i) const
+{
+    C4_ASSERT(i < num_parts);
+    return tokens->m_parts[first_part + i];
+}
+
 } // namespace tpl
 } // namespace c4
 
@@ -0,0 +1,191 @@
+#include "c4/tpl/value.hpp"
+#include "c4/tpl/arena.hpp"
+#include <c4/charconv.hpp>
+
+namespace c4 {
+namespace tpl {
+
+Value Value::node(c4::yml::NodeRef n)
+{
+    Value v(NODE);
+    if(n.valid())
+    {
+        v.m_tree = n.tree();
+        v.m_node = n.id();
+        if(n.has_val())
+        {
+            v.m_str = n.val();
+        }
+    }
+    return v;
+}
+
+Value Value::slice(c4::yml::NodeRef n, int64_t start, int64_t stop, int64_t step)
+{
+    Value v = range(start, stop, step);
+    v.m_tree = n.tree();
+    v.m_node = n.id();
+    C4_ASSERT(v.m_range.size() == 0 || start >= 0);
+    return v;
+}
+
+size_t Value::slice_next(size_t node) const
+{
+    C4_ASSERT(is_slice());
+    if(m_range.step > 0)
+    {
+        for(int64_t i = 0; i < m_range.step && node != NONE; ++i)
+        {
+            node = m_tree->next_sibling(node);
+        }
+    }
+    else
+    {
+        for(int64_t i = 0; i > m_range.step && node != NONE; --i)
+        {
+            node = m_tree->prev_sibling(node);
+        }
+    }
+    return node;
+}
+
+bool Value::from_number_str(csubstr s, Value *v)
+{
+    // validate the format first: from_chars() would accept a prefix
+    size_t i = 0;
+    if(s.begins_with_any("+-")) ++i;
+    size_t num_digits = 0;
+    bool is_int = true;
+    for( ; i < s.len && s[i] >= '0' && s[i] <= '9'; ++i) ++num_digits;
+    if(i < s.len && s[i] == '.')
+    {
+        is_int = false;
+        for(++i; i < s.len && s[i] >= '0' && s[i] <= '9'; ++i) ++num_digits;
+    }
+    if(num_digits == 0) return false;
+    if(i < s.len && (s[i] == 'e' || s[i] == 'E'))
+    {
+        is_int = false;
+        ++i;
+        if(i < s.len && (s[i] == '+' || s[i] == '-')) ++i;
+        size_t num_exp_digits = 0;
+        for( ; i < s.len && s[i] >= '0' && s[i] <= '9'; ++i) ++num_exp_digits;
+        if(num_exp_digits == 0) return false;
+    }
+    if(i != s.len) return false;
+    csubstr txt = s;
+    if(s.begins_with('+')) s = s.sub(1);
+    if(is_int)
+    {
+        int64_t val;
+        if( ! from_chars(s, &val)) return false;
+        *v = integer(val);
+    }
+    else
+    {
+        double val;
+        if( ! from_chars(s, &val)) return false;
+        *v = floating(val);
+    }
+    v->m_str = txt;
+    return true;
+}
+
+bool Value::is_container() const
+{
+    return is_node() && m_tree->is_container(m_node);
+}
+
+bool Value::truthy() const
+{
+    switch(m_type)
+    {
+    case NIL:   return false;
+    case BOOL:  return m_bool;
+    case INT:   return m_int != 0;
+    case FLOAT: return m_float != 0.;
+    case STR:   return ! m_str.empty();
+    case NODE:
+        if(is_container())
+        {
+            return m_tree->num_children(m_node) > 0;
+        }
+        return ! m_str.empty();
+    case RANGE: return m_range.size() > 0;
+    }
+    C4_ERROR("never reach");
+    return false;
+}
+
+bool Value::get_number(Value *num) const
+{
+    switch(m_type)
+    {
+    case INT:
+    case FLOAT:
+        *num = *this;
+        return true;
+    case BOOL:
+        *num = integer(m_bool ? 1 : 0);
+        return true;
+    case NODE:
+        return from_number_str(m_str, num);
+    default:
+        break;
+    }
+    return false;
+}
+
+int Value::compare_number(Value const& that) const
+{
+    C4_ASSERT(is_number() && that.is_number());
+    if(m_type == INT && that.m_type == INT)
+    {
+        return m_int < that.m_int ? -1 : (m_int > that.m_int ? 1 : 0);
+    }
+    double a = as_double(), b = that.as_double();
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+namespace {
+template<class T>
+csubstr _format(Arena *arena, T v)
+{
+    char tmp[64];
+    size_t len = to_chars(substr(tmp, sizeof(tmp)), v);
+    if(len > sizeof(tmp))
+    {
+        substr buf = arena->alloc(len);
+        to_chars(buf, v);
+        return buf;
+    }
+    return arena->copy(csubstr(tmp, len));
+}
+} // anon namespace
+
+csubstr Value::to_str(Arena *arena) const
+{
+    switch(m_type)
+    {
+    case NIL:
+        return {};
+    case INT:
+        return m_str.str != nullptr ? m_str : _format(arena, m_int);
+    case FLOAT:
+        return m_str.str != nullptr ? m_str : _format(arena, m_float);
+    case NODE:
+        if(is_container())
+        {
+            return m_tree->is_map(m_node) ? csubstr("<<<map>>>") : csubstr("<<<seq>>>");
+        }
+        return m_str;
+    case RANGE:
+        return "<<<seq>>>";
+    default:
+        break;
+    }
+    return m_str;
+}
+
+} // namespace tpl
+} // namespace c4
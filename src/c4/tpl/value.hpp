@@ -0,0 +1,116 @@
+#ifndef _C4_TPL_VALUE_HPP_
+#define _C4_TPL_VALUE_HPP_
+
+#include <c4/yml/tree.hpp>
+#include <c4/yml/node.hpp>
+#include "c4/tpl/common.hpp"
+
+namespace c4 {
+namespace tpl {
+
+class Arena;
+
+/** a small tagged value, used while evaluating expressions. Strings and
+ * nodes are views: evaluating does not copy or format anything. Text
+ * is produced only when a value is emitted, with to_str(). */
+struct Value
+{
+    typedef enum : uint8_t {
+        NIL,    //!< no value, eg a name which was not found. m_str holds the name.
+        BOOL,
+        INT,
+        FLOAT,
+        STR,    //!< a string view, eg a literal
+        NODE,   //!< a node of the data tree. m_str holds its val, if it has one.
+        RANGE,  //!< a lazy sequence of integers, from range(). If it has a node, it is a slice of the node's children, and the integers are their positions.
+    } Type_e;
+
+    /** the integers start, start+step, ... up to (and excluding) stop */
+    struct Range
+    {
+        int64_t start, stop, step;
+
+        size_t size() const
+        {
+            // unsigned, to avoid overflows with extreme values
+            if(step > 0 && start < stop) return static_cast<size_t>((static_cast<uint64_t>(stop) - static_cast<uint64_t>(start) - 1u) / static_cast<uint64_t>(step) + 1u);
+            if(step < 0 && start > stop) return static_cast<size_t>((static_cast<uint64_t>(start) - static_cast<uint64_t>(stop) - 1u) / (0u - static_cast<uint64_t>(step)) + 1u);
+            return 0;
+        }
+    };
+
+    Type_e m_type;
+    union
+    {
+        bool    m_bool;
+        int64_t m_int;
+        double  m_float;
+        Range   m_range;
+    };
+    /** the text of the value. Numbers produced by the evaluation have
+     * no text until they are formatted. */
+    csubstr m_str;
+    c4::yml::Tree *m_tree;
+    size_t m_node;
+
+public:
+
+    static Value nil(csubstr name={})  { Value v(NIL); v.m_str = name; return v; }
+    static Value boolean(bool b)       { Value v(BOOL); v.m_bool = b; v.m_str = b ? csubstr("true") : csubstr("false"); return v; }
+    static Value integer(int64_t i)    { Value v(INT); v.m_int = i; return v; }
+    static Value floating(double f)    { Value v(FLOAT); v.m_float = f; return v; }
+    static Value str(csubstr s)        { Value v(STR); v.m_str = s; return v; }
+    /** a string from the data, eg a map key. Unlike str(), it is
+     * compared as a number when it looks like one. */
+    static Value data(csubstr s)       { Value v(NODE); v.m_str = s; return v; }
+    static Value node(c4::yml::NodeRef n);
+    static Value range(int64_t start, int64_t stop, int64_t step) { Value v(RANGE); v.m_range = {start, stop, step}; return v; }
+    /** a slice of the children of a node: the range must be within the children */
+    static Value slice(c4::yml::NodeRef n, int64_t start, int64_t stop, int64_t step);
+
+    /** decode a string which must be entirely a number, eg 10, -3, 1.5e3.
+     * The string is kept as the text of the number. */
+    static bool from_number_str(csubstr s, Value *v);
+
+public:
+
+    Value() : m_type(NIL), m_int(0), m_str(), m_tree(nullptr), m_node(NONE) {}
+
+    bool is_nil() const { return m_type == NIL; }
+    bool is_number() const { return m_type == INT || m_type == FLOAT; }
+    bool is_node() const { return m_type == NODE && m_tree != nullptr; }
+    bool is_container() const;
+    bool is_range() const { return m_type == RANGE; }
+    bool is_slice() const { return m_type == RANGE && m_tree != nullptr; }
+
+    c4::yml::NodeRef get_node() const { C4_ASSERT(is_node() || is_slice()); return c4::yml::NodeRef(m_tree, m_node); }
+
+    /** for slices: get the first node of the slice */
+    size_t slice_first() const { C4_ASSERT(is_slice()); return m_tree->child(m_node, static_cast<size_t>(m_range.start)); }
+    /** for slices: get the node following a node of the slice */
+    size_t slice_next(size_t node) const;
+
+    bool truthy() const;
+
+    /** get the value as a number. Bools are 0/1; nodes are decoded
+     * only here, ie only when they are needed as numbers. */
+    bool get_number(Value *num) const;
+
+    double as_double() const { C4_ASSERT(is_number()); return m_type == INT ? static_cast<double>(m_int) : m_float; }
+
+    /** compare two numbers */
+    int compare_number(Value const& that) const;
+
+    /** get the text of the value, formatting it into the arena if needed.
+     * Names which were not found are empty. */
+    csubstr to_str(Arena *arena) const;
+
+private:
+
+    explicit Value(Type_e t) : m_type(t), m_int(0), m_str(), m_tree(nullptr), m_node(NONE) {}
+};
+
+} // namespace tpl
+} // namespace c4
+
+#endif /* _C4_TPL_VALUE_HPP_ */
@@ -0,0 +1,111 @@
+#include "c4/tpl/whitespace.hpp"
+
+namespace c4 {
+namespace tpl {
+
+namespace {
+
+C4_ALWAYS_INLINE bool _is_ws(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+C4_ALWAYS_INLINE bool _is_tag_char(char c)
+{
+    return c == '%' || c == '{' || c == '#';
+}
+
+/** {%- {{- {#- */
+C4_ALWAYS_INLINE bool _is_trim_open(csubstr s, size_t i)
+{
+    return s[i] == '{' && i + 2 < s.len && _is_tag_char(s[i+1]) && s[i+2] == '-';
+}
+
+/** -%} -}} -#} */
+C4_ALWAYS_INLINE bool _is_trim_close(csubstr s, size_t i)
+{
+    return s[i] == '-' && i + 2 < s.len && s[i+2] == '}' && (s[i+1] == '%' || s[i+1] == '}' || s[i+1] == '#');
+}
+
+/** find the end of the contents of a raw block: its {% endraw %}
+ * tag, which may have a marker */
+size_t _find_endraw(csubstr s, size_t pos)
+{
+    size_t e = s.find("{% endraw", pos);
+    size_t em = s.find("{%- endraw", pos);
+    e = em < e ? em : e;
+    return e != npos ? e : s.len;
+}
+
+C4_ALWAYS_INLINE bool _ends_with(std::string const& s, csubstr pattern)
+{
+    return s.size() >= pattern.len && 0 == s.compare(s.size() - pattern.len, pattern.len, pattern.str, pattern.len);
+}
+
+} // anon namespace
+
+bool has_whitespace_control(csubstr src)
+{
+    for(size_t i = 0; i < src.len; ++i)
+    {
+        if(_is_trim_open(src, i) || _is_trim_close(src, i))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void apply_whitespace_control(csubstr src, std::string *out)
+{
+    out->clear();
+    out->reserve(src.len);
+    size_t i = 0;
+    while(i < src.len)
+    {
+        if(_ends_with(*out, "{% raw %}")) // the contents of raw blocks are kept
+        {
+            size_t e = _find_endraw(src, i);
+            out->append(src.str + i, e - i);
+            i = e;
+            if(i == src.len) break;
+        }
+        if(_is_trim_open(src, i))
+        {
+            while( ! out->empty() && _is_ws(out->back()))
+            {
+                out->pop_back();
+            }
+            out->push_back('{');
+            out->push_back(src[i+1]);
+            i += 3;
+            // the tags are recognized by their start, eg "{% if "
+            if(i < src.len && ! _is_ws(src[i]))
+            {
+                out->push_back(' ');
+            }
+        }
+        else if(_is_trim_close(src, i))
+        {
+            if( ! out->empty() && ! _is_ws(out->back()))
+            {
+                out->push_back(' ');
+            }
+            out->push_back(src[i+1]);
+            out->push_back('}');
+            i += 3;
+            while(i < src.len && _is_ws(src[i]))
+            {
+                ++i;
+            }
+        }
+        else
+        {
+            out->push_back(src[i]);
+            ++i;
+        }
+    }
+}
+
+} // namespace tpl
+} // namespace c4
@@ -0,0 +1,25 @@
+#ifndef _C4_TPL_WHITESPACE_HPP_
+#define _C4_TPL_WHITESPACE_HPP_
+
+#include <string>
+#include "c4/tpl/common.hpp"
+
+namespace c4 {
+namespace tpl {
+
+/** @return true if the source has whitespace control markers, ie a
+ * tag starting with {%- {{- {#- or ending with -%} -}} -#} */
+bool has_whitespace_control(csubstr src);
+
+/** resolve the whitespace control markers of src into out: the
+ * whitespace (including line endings) before a tag starting with {%-
+ * and after a tag ending with -%} is removed, and so are the markers.
+ * The contents of {% raw %} blocks are not changed.
+ * This is done once, before parsing, so it costs nothing when
+ * rendering. */
+void apply_whitespace_control(csubstr src, std::string *out);
+
+} // namespace tpl
+} // namespace c4
+
+#endif /* _C4_TPL_WHITESPACE_HPP_ */
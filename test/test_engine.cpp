@@ -1,4 +1,5 @@
 #include "c4/tpl/engine.hpp"
+#include "c4/tpl/whitespace.hpp"
 #include "c4/yml/parse.hpp"
 
 //#include "../../../test_case.hpp"
@@ -15,13 +16,13 @@ namespace tpl {
 struct tpl_results { const char* name; csubstr props_yml, result; };
 using tpl_cases = std::initializer_list<tpl_results>;
 
-void do_engine_test(csubstr tpl, csubstr parsed_tpl, tpl_cases cases)
+void do_engine_test(csubstr tpl, csubstr parsed_tpl, tpl_cases cases, Escape_e escape=ESCAPE_NONE)
 {
     std::vector<char> parsed_tpl_buf;
     std::vector<char> parsed_yml_buf;
     std::vector<char> result_buf;
 
-    c4::tpl::Engine eng;
+    c4::tpl::Engine eng(escape);
     c4::tpl::Rope parsed_rope;
     eng.parse(tpl, &parsed_rope);
     csubstr ret = parsed_rope.chain_all_resize(&parsed_tpl_buf);
@@ -47,6 +48,30 @@ void do_engine_test(csubstr tpl, csubstr parsed_tpl, tpl_cases cases)
     }
 }
 
+std::string render_with(Engine const& eng, csubstr props_yml)
+{
+    std::vector<char> yml_buf(props_yml.begin(), props_yml.end());
+    std::vector<char> result_buf;
+    c4::yml::Tree tree;
+    c4::yml::parse(to_substr(yml_buf), &tree);
+    Rope rope;
+    eng.render(tree, &rope);
+    csubstr ret = rope.chain_all_resize(&result_buf);
+    return std::string(ret.str, ret.len);
+}
+
+std::string render_registered(TemplateRegistry const& reg, csubstr name, csubstr props_yml)
+{
+    std::vector<char> yml_buf(props_yml.begin(), props_yml.end());
+    std::vector<char> result_buf;
+    c4::yml::Tree tree;
+    c4::yml::parse(to_substr(yml_buf), &tree);
+    Rope rope;
+    reg.find(name)->m_engine.render(tree, &rope);
+    csubstr ret = rope.chain_all_resize(&result_buf);
+    return std::string(ret.str, ret.len);
+}
+
 //-----------------------------------------------------------------------------
 
 TEST(expr, basic)
@@ -71,6 +96,16 @@ TEST(expr, basic2)
                    });
 }
 
+TEST(expr, hyphenated_keys)
+{
+    do_engine_test("{{ my-key }}|{% if some-flag %}on{% else %}off{% endif %}|{{ my-key - 1 }}",
+                   "<<<expr>>>|<<<if>>>|<<<expr>>>",
+                   tpl_cases{
+                       {"case 0", "{my-key: 10, some-flag: true}", "10|on|9"},
+                       {"case 1", "{my-key: 1}", "1|off|0"},
+                   });
+}
+
 //-----------------------------------------------------------------------------
 TEST(if, simple)
 {
@@ -307,6 +342,141 @@ TEST(if, equality_with_strings)
                    });
 }
 
+TEST(if, numeric_comparison)
+{
+    do_engine_test("{% if count > 9 %}gt{% endif %}|{% if count <= 9 %}le{% endif %}|{% if count == 10 %}eq{% endif %}|{% if count != 10.0 %}ne{% endif %}",
+                   "<<<if>>>|<<<if>>>|<<<if>>>|<<<if>>>",
+                   tpl_cases{
+                       {"case 2", "{count: 2}", "|le||ne"},
+                       {"case 9", "{count: 9}", "|le||ne"},
+                       {"case 10", "{count: 10}", "gt||eq|"},
+                       {"case 10.0", "{count: 10.0}", "gt||eq|"},
+                       {"case 100", "{count: 100}", "gt|||ne"},
+                       {"case -1", "{count: -1}", "|le||ne"},
+                       {"case 9.5", "{count: 9.5}", "gt|||ne"},
+                       {"case 1e3", "{count: 1e3}", "gt|||ne"},
+                   });
+}
+
+TEST(if, numeric_comparison_between_paths)
+{
+    do_engine_test("{% if a < b %}lt{% else %}ge{% endif %}",
+                   "<<<if>>>",
+                   tpl_cases{
+                       {"case 0", "{a: 9, b: 10}", "lt"},
+                       {"case 1", "{a: 10, b: 9}", "ge"},
+                       {"case 2", "{a: -2, b: 1.5}", "lt"},
+                       // not numbers: compared as strings
+                       {"case 3", "{a: abc, b: abd}", "lt"},
+                       {"case 4", "{a: 9, b: 10x}", "ge"},
+                   });
+}
+
+TEST(if, numeric_literal_vs_string_literal)
+{
+    do_engine_test("{% if foo == \"10\" %}str{% endif %}|{% if foo == 10 %}num{% endif %}",
+                   "<<<if>>>|<<<if>>>",
+                   tpl_cases{
+                       {"case 0", "{foo: 10}", "str|num"},
+                       {"case 1", "{foo: 10.0}", "|num"},
+                       {"case 2", "{foo: '010'}", "|num"},
+                   });
+}
+
+TEST(if, boolean_operators)
+{
+    do_engine_test("{% if a and b %}and{% endif %}|{% if a or b %}or{% endif %}|{% if not a %}not{% endif %}",
+                   "<<<if>>>|<<<if>>>|<<<if>>>",
+                   tpl_cases{
+                       {"case 00", "{}", "||not"},
+                       {"case 01", "{b: 1}", "|or|not"},
+                       {"case 10", "{a: 1}", "|or|"},
+                       {"case 11", "{a: 1, b: 1}", "and|or|"},
+                   });
+}
+
+TEST(if, precedence_and_parentheses)
+{
+    // and binds tighter than or; not is looser than the comparisons
+    do_engine_test("{% if a or b and c %}x{% endif %}|{% if (a or b) and c %}y{% endif %}|{% if not n > 2 %}z{% endif %}",
+                   "<<<if>>>|<<<if>>>|<<<if>>>",
+                   tpl_cases{
+                       {"case 0", "{a: 1, n: 3}", "x||"},
+                       {"case 1", "{a: 1, c: 1, n: 2}", "x|y|z"},
+                       {"case 2", "{b: 1, n: 1}", "||z"},
+                       {"case 3", "{b: 1, c: 1, n: 5}", "x|y|"},
+                   });
+}
+
+TEST(if, compound_conditions)
+{
+    do_engine_test("{% if count >= 10 and (name == \"foo\" or \"x\" not in tags) %}yes{% else %}no{% endif %}",
+                   "<<<if>>>",
+                   tpl_cases{
+                       {"case 0", "{count: 9, name: foo, tags: []}", "no"},
+                       {"case 1", "{count: 10, name: foo, tags: [x]}", "yes"},
+                       {"case 2", "{count: 10, name: bar, tags: [x]}", "no"},
+                       {"case 3", "{count: 10, name: bar, tags: [y]}", "yes"},
+                       {"case 4", "{count: 1e2, name: bar, tags: {x: 0}}", "no"},
+                   });
+}
+
+TEST(if, boolean_literals)
+{
+    do_engine_test("{% if flag == true %}t{% elif flag == false %}f{% else %}?{% endif %}",
+                   "<<<if>>>",
+                   tpl_cases{
+                       {"case 0", "{flag: true}", "t"},
+                       {"case 1", "{flag: 1}", "t"},
+                       {"case 2", "{flag: false}", "f"},
+                       {"case 3", "{flag: 0}", "f"},
+                       {"case 4", "{flag: maybe}", "?"},
+                   });
+}
+
+
+TEST(if, arithmetic)
+{
+    do_engine_test("{% if a + b > 10 %}gt{% else %}le{% endif %}|{% if a % 2 == 0 %}even{% endif %}",
+                   "<<<if>>>|<<<if>>>",
+                   tpl_cases{
+                       {"case 0", "{a: 4, b: 6}", "le|even"},
+                       {"case 1", "{a: 5, b: 6}", "gt|"},
+                       {"case 2", "{a: 5.5, b: 6}", "gt|"},
+                   });
+}
+
+
+//-----------------------------------------------------------------------------
+TEST(expr, arithmetic)
+{
+    do_engine_test("{{ price * qty }}|{{ i + 1 }}|{{ -i * 2 }}|{{ i // 2 }}",
+                   "<<<expr>>>|<<<expr>>>|<<<expr>>>|<<<expr>>>",
+                   tpl_cases{
+                       {"case 0", "{price: 3, qty: 4, i: 9}", "12|10|-18|4"},
+                       {"case 1", "{price: 2.5, qty: 2, i: -1}", "5|0|2|-1"},
+                       {"case 2", "{price: x, i: 0}", "|1|0|0"},
+                   });
+}
+
+TEST(expr, concatenation)
+{
+    do_engine_test("{{ prefix ~ name }}|{{ name ~ '-' ~ loop.index }}{% for v in seq %}[{{ v ~ '-' ~ loop.index + 1 }}]{% endfor %}",
+                   "<<<expr>>>|<<<expr>>><<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{prefix: a, name: b, seq: [x, y]}", "ab|b-[x-1][y-2]"},
+                   });
+}
+
+TEST(expr, concatenation_is_escaped)
+{
+    do_engine_test("{{ a ~ b }}",
+                   "<<<expr>>>",
+                   tpl_cases{
+                       {"case 0", "{a: '<', b: '&'}", "&lt;&amp;"},
+                   },
+                   ESCAPE_HTML);
+}
 
 //-----------------------------------------------------------------------------
 TEST(for, simple_no_vars)
@@ -332,8 +502,817 @@ TEST(for, simple_with_vars)
                    });
 }
 
+TEST(for, loop_properties)
+{
+    do_engine_test("{% for v in var %}{{loop.index}}/{{loop.length}}/{{loop.revindex}}:{{loop.first}}{{loop.last}}{{loop.odd}}{{loop.even}}{% if not loop.last %}, {% endif %}{% endfor %}",
+                   "<<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{}", ""},
+                       {"case 1", "{var: [a]}", "0/1/0:1101"},
+                       {"case 3", "{var: [a, b, c]}", "0/3/2:1001, 1/3/1:0010, 2/3/0:0101"},
+                   });
+}
+
+TEST(for, map_key_value)
+{
+    do_engine_test("{% for k, v in m %}{{k}}={{v}};{% endfor %}",
+                   "<<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{m: {}}", ""},
+                       {"case 1", "{m: {a: 1}}", "a=1;"},
+                       {"case 2", "{m: {a: 1, b: 2, c: 3}}", "a=1;b=2;c=3;"},
+                   });
+}
+
+TEST(for, map_key_value_with_container_values)
+{
+    do_engine_test("{% for name, user in users %}{{name}}:{{user.age}}{% if user.tags[0] %}({{user.tags[0]}}){% endif %} {% endfor %}",
+                   "<<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{users: {joe: {age: 30, tags: [a]}, ann: {age: 25, tags: []}}}", "joe:30(a) ann:25 "},
+                   });
+}
+
+TEST(for, seq_index_value)
+{
+    do_engine_test("{% for i, v in seq %}{{i}}:{{v}} {% endfor %}",
+                   "<<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{seq: [a, b, c]}", "0:a 1:b 2:c "},
+                   });
+}
+
+TEST(for, nested_over_loop_variable)
+{
+    do_engine_test("{% for row in rows %}{% for c in row %}{{c}}{% endfor %}|{% endfor %}",
+                   "<<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{rows: [[a, b], [c], []]}", "ab|c||"},
+                   });
+}
+
+TEST(for, loop_variable_shadows_the_tree)
+{
+    do_engine_test("{{v}}|{% for v in seq %}{{v}}{% endfor %}|{{v}}",
+                   "<<<expr>>>|<<<for>>>|<<<expr>>>",
+                   tpl_cases{
+                       {"case 0", "{v: x, seq: [a, b]}", "x|ab|x"},
+                   });
+}
+
+TEST(for, loop_names_from_the_tree)
+{
+    // loop is only special when followed by a loop field
+    do_engine_test("{{ loop }}|{{ loop[1] }}|{% for v in seq %}{{ loop }}{% endfor %}",
+                   "<<<expr>>>|<<<expr>>>|<<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{loop: 1, seq: [a, b]}", "1||11"},
+                       {"case 1", "{loop: [x, y], seq: [a]}", "<<<seq>>>|y|<<<seq>>>"},
+                   });
+}
+
+TEST(for, range)
+{
+    do_engine_test("{% for i in range(n) %}{{i}}{% endfor %}|{% for i in range(2, n) %}{{i}}{% endfor %}|{% for i in range(n, 0, -2) %}{{i}}{% endfor %}",
+                   "<<<for>>>|<<<for>>>|<<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{n: 0}", "||"},
+                       {"case 1", "{n: 1}", "0||1"},
+                       {"case 5", "{n: 5}", "01234|234|531"},
+                   });
+}
+
+TEST(for, range_with_loop_properties)
+{
+    do_engine_test("{% for k, i in range(10, 13) %}{{k}}:{{i}}/{{loop.index}}/{{loop.length}} {% endfor %}",
+                   "<<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{}", "0:10/0/3 1:11/1/3 2:12/2/3 "},
+                   });
+}
+
+TEST(for, slice)
+{
+    do_engine_test("{% for x in items[1:3] %}{{x}}{% endfor %}|{% for x in items[-2:] %}{{x}}{% endfor %}|{% for x in items[::-2] %}{{x}}{% endfor %}|{% for x in items[page*2:(page+1)*2] %}{{x}}{% endfor %}",
+                   "<<<for>>>|<<<for>>>|<<<for>>>|<<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{items: [], page: 0}", "|||"},
+                       {"case 1", "{items: [a, b, c, d, e], page: 0}", "bc|de|eca|ab"},
+                       {"case 2", "{items: [a, b, c, d, e], page: 2}", "bc|de|eca|e"},
+                       {"case 3", "{items: [a, b, c, d, e], page: 3}", "bc|de|eca|"},
+                   });
+}
+
+TEST(for, slice_of_map)
+{
+    do_engine_test("{% for k, v in m[1:] %}{{k}}={{v}} {% endfor %}",
+                   "<<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{m: {a: 0, b: 1, c: 2}}", "b=1 c=2 "},
+                   });
+}
+
+TEST(for, filter)
+{
+    do_engine_test("{% for v in var if v > 1 %}{{loop.index}}/{{loop.length}}:{{v}}{% if not loop.last %}, {% endif %}{% endfor %}",
+                   "<<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{}", ""},
+                       {"case 1", "{var: [0, 1]}", ""},
+                       {"case 2", "{var: [0, 2, 1, 3]}", "0/2:2, 1/2:3"},
+                       {"case 3", "{var: [5, 0, 0, 0, 0, 0, 7]}", "0/2:5, 1/2:7"},
+                   });
+}
+
+TEST(for, filter_key_value)
+{
+    do_engine_test("{% for k, v in m if k != 'b' and v.on == 1 %}{{k}} {% endfor %}|{% for i in range(10) if i % 3 == 0 %}{{i}}{% endfor %}|{% for x in s[1:] if x != 'c' %}{{x}}{% endfor %}",
+                   "<<<for>>>|<<<for>>>|<<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{m: {a: {on: 1}, b: {on: 1}, c: {on: 0}, d: {on: 1}}, s: [a, b, c, d]}", "a d |0369|bd"},
+                   });
+}
+
+TEST(for, filter_is_lazy)
+{
+    do_engine_test("{% for v in var if v > 1 %}{{loop.index}}{{loop.first}}:{{v}}{% if v == 9 %}{% break %}{% endif %} {% endfor %}|{% for a in outer %}{% for b in inner if b != loop.index %}{{b}}{% endfor %},{% endfor %}",
+                   "<<<for>>>|<<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{}", "|"},
+                       {"case 1", "{var: [0, 1], outer: [x], inner: [0, 1]}", "|1,"},
+                       {"case 2", "{var: [0, 2, 1, 3], outer: [x, y], inner: [0, 1, 2]}", "01:2 10:3 |12,02,"},
+                       {"case 3", "{var: [5, 0, 9, 7, 8], outer: [], inner: []}", "01:5 10:9|"},
+                   });
+}
+
+TEST(for, filter_preselects_only_for_the_length)
+{
+    TemplateRegistry reg;
+    reg.add("inc", "{{v}}");
+    auto preselects = [&](csubstr name, csubstr src){
+        Engine const& eng = reg.add(name, src);
+        TokenFor const* tk = nullptr;
+        for(size_t id : eng.m_tokens.m_token_seq)
+        {
+            if(eng.m_tokens.get(id)->marker() == TokenFor::s_marker())
+            {
+                tk = static_cast<TokenFor const*>(eng.m_tokens.get(id));
+                break;
+            }
+        }
+        EXPECT_NE(tk, nullptr);
+        return tk && tk->m_preselect;
+    };
+    EXPECT_FALSE(preselects("a", "{% for v in vs %}{{loop.length}}{% endfor %}"));
+    EXPECT_FALSE(preselects("b", "{% for v in vs if v != 'x' %}{{loop.index}}{{loop.first}}{{v}} {% endfor %}"));
+    EXPECT_FALSE(preselects("h", "{% for v in vs if v %}{{ range(2) }}{% endfor %}"));
+    EXPECT_TRUE(preselects("c", "{% for v in vs if v %}{{loop.length}}{% endfor %}"));
+    EXPECT_TRUE(preselects("d", "{% for v in vs if v %}{{loop.revindex}}{% endfor %}"));
+    EXPECT_TRUE(preselects("e", "{% for v in vs if v %}{% if loop.last %}.{% endif %}{% endfor %}"));
+    EXPECT_TRUE(preselects("f", "{% for v in vs if v %}{% include 'inc' %}{% endfor %}"));
+    EXPECT_TRUE(preselects("g", "{% for v in vs if v %}{{ m(v) }}{% endfor %}{% macro m(x) %}{{x}}{% endmacro %}"));
+    // the lazy loops do not use the selection
+    Engine const& lazy = reg.find("b")->m_engine;
+    EXPECT_EQ(render_with(lazy, "{vs: [x, a, x, b]}"), "01a 10b ");
+    EXPECT_EQ(lazy.m_ctx.m_selection.capacity(), 0u);
+    EXPECT_EQ(render_with(reg.find("e")->m_engine, "{vs: [a, b]}"), ".");
+}
+
+TEST(for, break)
+{
+    do_engine_test("{% for v in var %}{% if v == 'stop' %}{% break %}{% endif %}{{v}} {% endfor %}.",
+                   "<<<for>>>.",
+                   tpl_cases{
+                       {"case 0", "{var: []}", "."},
+                       {"case 1", "{var: [a, b]}", "a b ."},
+                       {"case 2", "{var: [stop, b]}", "."},
+                       {"case 3", "{var: [a, stop, b, stop, c]}", "a ."},
+                   });
+}
+
+TEST(for, continue)
+{
+    do_engine_test("{% for v in var %}<{% if v == 'skip' %}{% continue %}{% endif %}{{v}}>{% endfor %}.",
+                   "<<<for>>>.",
+                   tpl_cases{
+                       {"case 0", "{var: []}", "."},
+                       {"case 1", "{var: [a, b]}", "<a><b>."},
+                       {"case 2", "{var: [skip, b]}", "<<b>."},
+                       {"case 3", "{var: [a, skip, b, skip]}", "<a><<b><."},
+                   });
+}
+
+TEST(for, break_affects_only_the_innermost_loop)
+{
+    do_engine_test("{% for row in rows %}[{% for v in row %}{% if v > 1 %}{% break %}{% endif %}{{v}}{% endfor %}]{% endfor %}",
+                   "<<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{rows: [[0, 1, 2, 0], [2, 0], [1]]}", "[01][][1]"},
+                   });
+}
+
+TEST(for, nested_loop_properties)
+{
+    do_engine_test("{% for a in outer %}[{% for b in inner %}{{loop.index}}{% endfor %}]{{loop.index}}{% endfor %}",
+                   "<<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{outer: [x, y], inner: [p, q, r]}", "[012]0[012]1"},
+                   });
+}
+
 
 //-----------------------------------------------------------------------------
+TEST(autoescape, engine)
+{
+    do_engine_test("<p>{{foo}}</p>",
+                   "<p><<<expr>>></p>",
+                   tpl_cases{
+                       {"case 0", "{foo: bar}", "<p>bar</p>"},
+                       {"case 1", "{foo: 'a<b & c>d'}", "<p>a&lt;b &amp; c&gt;d</p>"},
+                       {"case 2", "{foo: '\"quoted\"'}", "<p>&quot;quoted&quot;</p>"},
+                   },
+                   ESCAPE_HTML);
+    do_engine_test("{\"foo\": \"{{foo}}\"}",
+                   "{\"foo\": \"<<<expr>>>\"}",
+                   tpl_cases{
+                       {"case 0", "{foo: bar}", "{\"foo\": \"bar\"}"},
+                       {"case 1", "{foo: 'a\"b\\c'}", "{\"foo\": \"a\\\"b\\\\c\"}"},
+                   },
+                   ESCAPE_JSON);
+}
+
+TEST(autoescape, block)
+{
+    do_engine_test("{{foo}}|{% autoescape html %}{{foo}}{% endautoescape %}|{{foo}}",
+                   "<<<expr>>>|<<<autoescape>>>|<<<expr>>>",
+                   tpl_cases{
+                       {"case 0", "{foo: bar}", "bar|bar|bar"},
+                       {"case 1", "{foo: '<b>'}", "<b>|&lt;b&gt;|<b>"},
+                   });
+    do_engine_test("{{foo}}|{% autoescape none %}{{foo}}{% endautoescape %}|{{foo}}",
+                   "<<<expr>>>|<<<autoescape>>>|<<<expr>>>",
+                   tpl_cases{
+                       {"case 0", "{foo: '<b>'}", "&lt;b&gt;|<b>|&lt;b&gt;"},
+                   },
+                   ESCAPE_HTML);
+    // as in jinja
+    do_engine_test("{% autoescape true %}{{foo}}{% autoescape false %}{{foo}}{% endautoescape %}{% endautoescape %}",
+                   "<<<autoescape>>>",
+                   tpl_cases{
+                       {"case 0", "{foo: '<b>'}", "&lt;b&gt;<b>"},
+                   });
+}
+
+TEST(autoescape, in_for)
+{
+    do_engine_test("{% autoescape html %}{% for v in var %}<{{v}}>{% endfor %}{% endautoescape %}",
+                   "<<<autoescape>>>",
+                   tpl_cases{
+                       {"case 0", "{}", ""},
+                       {"case 1", "{var: [a, '&', b]}", "<a><&amp;><b>"},
+                   });
+}
+
+
+//-----------------------------------------------------------------------------
+TEST(raw, basic)
+{
+    do_engine_test("{{a}}{% raw %}{{a}} {% if a %}{% for %}{# x{% endraw %}{{a}}",
+                   "<<<expr>>><<<raw>>><<<expr>>>",
+                   tpl_cases{
+                       {"case 0", "{a: 1}", "1{{a}} {% if a %}{% for %}{# x1"},
+                   });
+}
+
+TEST(raw, inside_blocks)
+{
+    do_engine_test("{% for v in vs %}{% if v %}{% raw %}{% endif %}{% endfor %}{{v}}{% endraw %}{{v}}{% endif %}{% endfor %}",
+                   "<<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{vs: []}", ""},
+                       {"case 1", "{vs: [a, b]}", "{% endif %}{% endfor %}{{v}}a{% endif %}{% endfor %}{{v}}b"},
+                   });
+    do_engine_test("{% if x %}{% raw %}{% else %}{% endraw %}{% else %}no{% endif %}",
+                   "<<<if>>>",
+                   tpl_cases{
+                       {"case 0", "{x: 1}", "{% else %}"},
+                       {"case 1", "{x: ''}", "no"},
+                   });
+}
+
+TEST(raw, whitespace_control_and_blocks)
+{
+    std::string out;
+    apply_whitespace_control("a {%- raw -%} b {{- c -}} d {%- endraw -%} e", &out);
+    EXPECT_EQ(out, "a{% raw %}b {{- c -}} d{% endraw %}e");
+    TemplateRegistry reg;
+    reg.add("base", "{% raw %}{% block a %}{% endraw %}{% block a %}A{% endblock %}");
+    reg.add("child", "{% extends 'base' %}{% block a %}{% raw %}{% endblock %}{% endraw %}{% endblock %}");
+    EXPECT_EQ(render_registered(reg, "child", "{}"), "{% block a %}{% endblock %}");
+}
+
+//-----------------------------------------------------------------------------
+TEST(whitespace_control, apply)
+{
+    std::string out;
+    EXPECT_FALSE(has_whitespace_control("a - b {% if x %} {{ x - 1 }} {# - #}"));
+    EXPECT_TRUE(has_whitespace_control("a {%- if x %}"));
+    EXPECT_TRUE(has_whitespace_control("a {{ x -}}"));
+    EXPECT_TRUE(has_whitespace_control("{#- c #}"));
+    apply_whitespace_control("a  \n\t {%- if x -%} \n b \n {%- endif %}", &out);
+    EXPECT_EQ(out, "a{% if x %}b{% endif %}");
+    apply_whitespace_control("a {{-x-}}\n b {#- c -#} d", &out);
+    EXPECT_EQ(out, "a{{ x }}b{# c #}d");
+    apply_whitespace_control("{%-if x-%}", &out);
+    EXPECT_EQ(out, "{% if x %}");
+}
+
+TEST(whitespace_control, engine)
+{
+    do_engine_test(R"(<ul>
+    {%- for v in vs %}
+    <li>{{ v -}} </li>
+    {%- endfor %}
+</ul>)",
+                   "",
+                   tpl_cases{
+                       {"case 0", "{vs: []}", "<ul>\n</ul>"},
+                       {"case 1", "{vs: [a, b]}", "<ul>    <li>a</li>    <li>b</li>\n</ul>"}, // the for body starts after the line ending
+                   });
+    do_engine_test("{% if x -%}\n  yes  \n{%- else -%}\n  no  \n{%- endif %}|{{- x }}",
+                   "",
+                   tpl_cases{
+                       {"case 0", "{x: 1}", "yes|1"},
+                       {"case 1", "{x: ''}", "no|"},
+                   });
+}
+
+//-----------------------------------------------------------------------------
+TEST(syntax, apply)
+{
+    Syntax latex("<%", "%>", "<<", ">>", "<#", "#>");
+    EXPECT_FALSE(latex.is_default());
+    EXPECT_TRUE(Syntax().is_default());
+    std::string out;
+    apply_syntax(latex, "\\frac{{a}}{b} <<x>> <% if y %>{%<# c #>{#<% endif %>", &out);
+    EXPECT_EQ(out, "\\frac{% raw %}{{{% endraw %}a}}{b} {{x}} {% if y %}{% raw %}{%{% endraw %}{# c #}{% raw %}{#{% endraw %}{% endif %}");
+    apply_syntax(latex, "<%- raw %>{{<<x>>}}<% endraw -%>", &out);
+    EXPECT_EQ(out, "{%- raw %}{{<<x>>}}{% endraw -%}");
+    Syntax brackets("[%", "%]", "[[", "]]", "[#", "#]");
+    apply_syntax(brackets, "a[[b]]c]]", &out);
+    EXPECT_EQ(out, "a{{b}}c]]");
+    // a literal brace right before a tag must not merge with it
+    apply_syntax(brackets, "{[[b]]}", &out);
+    EXPECT_EQ(out, "{% raw %}{{% endraw %}{{b}}}");
+}
+
+TEST(syntax, apply_is_linear)
+{
+    // each opener is searched again only after the cursor went past
+    // it, so this takes a single pass even with openers which are far
+    // apart (the comment) or absent (the block)
+    Syntax latex("<%", "%>", "<<", ">>", "<#", "#>");
+    const size_t num_tags = 50000;
+    std::string src, expected;
+    for(size_t i = 0; i < num_tags; ++i)
+    {
+        src += "{ <<x>> ";
+        expected += "{ {{x}} ";
+    }
+    src += "<# c #>";
+    expected += "{# c #}";
+    std::string out;
+    apply_syntax(latex, to_csubstr(src), &out);
+    EXPECT_EQ(out, expected);
+}
+
+TEST(syntax, engine)
+{
+    Engine latex(Syntax("<%", "%>", "<<", ">>", "<#", "#>"));
+    Engine brackets(Syntax("[%", "%]", "[[", "]]", "[#", "#]"));
+    Engine jinja;
+    Rope r0, r1, r2;
+    latex.parse("\\section{<<title>>}<# comment #>\n<% for x in xs -%>\n\\item{{<<x>>}}<% endfor %>{{not}}<% raw %><<raw>><% endraw %>", &r0);
+    brackets.parse("[[title]][% for x in xs %]{[[x]]}[% endfor %]{{x}}", &r1);
+    jinja.parse("{{title}}{% for x in xs %}[[{{x}}]]{% endfor %}", &r2);
+    EXPECT_EQ(render_with(latex, "{title: T, xs: [a, b]}"), "\\section{T}\n\\item{{a}}\\item{{b}}{{not}}<<raw>>");
+    EXPECT_EQ(render_with(brackets, "{title: T, xs: [a, b]}"), "T{a}{b}{{x}}");
+    EXPECT_EQ(render_with(jinja, "{title: T, xs: [a, b]}"), "T[[a]][[b]]");
+}
+
+TEST(syntax, registry)
+{
+    TemplateRegistry reg(Syntax("<%", "%>", "<<", ">>", "<#", "#>"));
+    reg.add("base", "{<% block body %>{}<% endblock %>}");
+    reg.add("child", "<% extends 'base' %><% block body %>{{<<x>>}}<% endblock %>");
+    EXPECT_EQ(render_registered(reg, "child", "{x: 1}"), "{{{1}}}");
+}
+
+//-----------------------------------------------------------------------------
+TEST(macro, basic)
+{
+    do_engine_test("{% macro field(name, value) %}<{{name}}={{value}}>{% endmacro %}{{ field('a', x) }}{{field(\"b\", x + 1)}}.",
+                   "<<<macro>>><<<expr>>><<<expr>>>.",
+                   tpl_cases{
+                       {"case 0", "{x: 1}", "<a=1><b=2>."},
+                       {"case 1", "{x: 10}", "<a=10><b=11>."},
+                   });
+}
+
+TEST(macro, defaults_and_missing_args)
+{
+    do_engine_test("{% macro m(a, b=a * 2, c) %}{{a}},{{b}},{{c}};{% endmacro %}{{m(1)}}{{m(1, 5)}}{{m(1, 5, 'x')}}",
+                   "<<<macro>>><<<expr>>><<<expr>>><<<expr>>>",
+                   tpl_cases{
+                       {"case 0", "{a: 3}", "1,6,;1,5,;1,5,x;"},
+                   });
+}
+
+TEST(macro, args_are_evaluated_in_the_caller_scope)
+{
+    do_engine_test("{% macro swap(a, b) %}{{a}}{{b}}{% endmacro %}{{swap(b, a)}}|{{a}}{{b}}",
+                   "<<<macro>>><<<expr>>>|<<<expr>>><<<expr>>>",
+                   tpl_cases{
+                       {"case 0", "{a: 1, b: 2}", "21|12"},
+                   });
+}
+
+TEST(macro, called_in_loops_and_ifs)
+{
+    do_engine_test("{{ item(first) }}{% for v in items %}{% if v != 'skip' %}{{ item(v, loop.index) }}{% endif %}{% endfor %}{% macro item(v, i='-') %}[{{i}}:{% for c in v.split %}{{c}}{% endfor %}{{v}}]{% endmacro %}",
+                   "<<<expr>>><<<for>>><<<macro>>>",
+                   tpl_cases{
+                       {"case 0", "{first: f, items: []}", "[-:f]"},
+                       {"case 1", "{first: f, items: [a, skip, b]}", "[-:f][0:a][2:b]"},
+                   });
+}
+
+TEST(macro, nested_calls)
+{
+    do_engine_test("{% macro inner(x) %}({{x}}){% endmacro %}{% macro outer(x) %}{{inner(x)}}{{inner(x ~ x)}}{% endmacro %}{{outer(a)}}{% for v in vs %}{{outer(v)}}{% endfor %}",
+                   "<<<macro>>><<<macro>>><<<expr>>><<<for>>>",
+                   tpl_cases{
+                       {"case 0", "{a: a, vs: [b, c]}", "(a)(aa)(b)(bb)(c)(cc)"},
+                   });
+}
+
+TEST(macro, calls_are_resolved_when_parsing)
+{
+    TemplateRegistry reg;
+    Engine const& eng = reg.add("t", "{{ m(1, x) }}{{x}}{% macro n() %}n{% endmacro %}{{n()}}{% macro m(a, b) %}{{a}}{{b}}{% endmacro %}");
+    TokenContainer const& tokens = eng.m_tokens;
+    ASSERT_EQ(tokens.m_calls.size(), 2u);
+    ASSERT_EQ(tokens.m_call_args.size(), 2u);
+    EXPECT_EQ(tokens.m_calls[0].m_name, "m");
+    EXPECT_EQ(tokens.m_calls[0].m_num_args, 2u);
+    EXPECT_EQ(tokens.m_calls[1].m_name, "n");
+    EXPECT_EQ(tokens.m_calls[1].m_first_arg, 2u);
+    EXPECT_EQ(tokens.m_calls[1].m_num_args, 0u);
+    for(MacroCall const& c : tokens.m_calls)
+    {
+        ASSERT_NE(c.m_macro, NONE);
+        EXPECT_EQ(static_cast<TokenMacro const*>(tokens.get(c.m_macro))->m_name, c.m_name);
+    }
+    size_t num_plain = 0;
+    for(size_t id : tokens.m_token_seq)
+    {
+        if(tokens.get(id)->marker() != TokenExpression::s_marker()) continue;
+        auto const* tk = static_cast<TokenExpression const*>(tokens.get(id));
+        num_plain += tk->m_call == NONE;
+    }
+    EXPECT_EQ(num_plain, 3u); // {{x}}, and {{a}}{{b}} in m
+    // the expressions carry only the index of their call
+    EXPECT_EQ(sizeof(TokenExpression), sizeof(TokenBase) + sizeof(csubstr) + sizeof(Expr) + sizeof(size_t));
+    EXPECT_EQ(render_registered(reg, "t", "{x: 2}"), "122n");
+}
+
+TEST(macro, split_call)
+{
+    csubstr name;
+    std::vector<csubstr> args;
+    EXPECT_TRUE(split_call("f()", &name, &args));
+    EXPECT_EQ(name, "f");
+    EXPECT_TRUE(args.empty());
+    EXPECT_TRUE(split_call(" f_1 ( a, (b, c), 'd,e', x[0] ) ", &name, &args));
+    EXPECT_EQ(name, "f_1");
+    ASSERT_EQ(args.size(), 4u);
+    EXPECT_EQ(args[0], "a");
+    EXPECT_EQ(args[1], "(b, c)");
+    EXPECT_EQ(args[2], "'d,e'");
+    EXPECT_EQ(args[3], "x[0]");
+    EXPECT_FALSE(split_call("f(a) + g(b)", &name, &args));
+    EXPECT_FALSE(split_call("a.b(c)", &name, &args));
+    EXPECT_FALSE(split_call("(a)", &name, &args));
+    EXPECT_FALSE(split_call("a", &name, &args));
+}
+
+//-----------------------------------------------------------------------------
+TEST(set, basic)
+{
+    do_engine_test("{% set d = a.b.c.d %}{% set big = d > 10 %}{{d}}:{% if big %}big{% else %}small{% endif %}:{{d * 2}}",
+                   "<<<set>>><<<set>>><<<expr>>>:<<<if>>>:<<<expr>>>",
+                   tpl_cases{
+                       {"case 0", "{a: {b: {c: {d: 5}}}}", "5:small:10"},
+                       {"case 1", "{a: {b: {c: {d: 50}}}}", "50:big:100"},
+                       {"case 2", "{}", ":small:"},
+                   });
+}
+
+TEST(set, shadows_and_is_reassigned)
+{
+    do_engine_test("{{x}}{% set x = x + 1 %}{{x}}{% set x = x * 10 %}{{x}}",
+                   "<<<expr>>><<<set>>><<<expr>>><<<set>>><<<expr>>>",
+                   tpl_cases{
+                       {"case 0", "{x: 1}", "1220"},
+                   });
+}
+
+TEST(set, is_scoped_to_the_loop_iteration)
+{
+    do_engine_test("{% set total = 'none' %}{% for v in vs %}{% if loop.first %}{% set total = v %}{% endif %}{% set sq = v * v %}{{sq}}:{{total}} {% endfor %}{{sq}}|{{total}}",
+                   "<<<set>>><<<for>>><<<expr>>>|<<<expr>>>",
+                   tpl_cases{
+                       {"case 0", "{vs: []}", "|none"},
+                       {"case 1", "{vs: [2, 3]}", "4:2 9:none |none"},
+                   });
+}
+
+//-----------------------------------------------------------------------------
+TEST(include, basic)
+{
+    TemplateRegistry reg;
+    reg.add("header", "<h1>{{title}}</h1>");
+    reg.add("empty", "");
+    reg.add("page", "{% include \"header\" %}<p>{{body}}</p>{% include 'empty' %}.");
+    EXPECT_EQ(render_registered(reg, "page", "{title: T, body: B}"), "<h1>T</h1><p>B</p>.");
+    EXPECT_EQ(render_registered(reg, "page", "{title: U}"), "<h1>U</h1><p></p>.");
+}
+
+TEST(include, sees_the_loop_variables)
+{
+    TemplateRegistry reg;
+    reg.add("item", "<li>{{loop.index}}:{{v}}</li>");
+    reg.add("list", "<ul>{% for v in items %}{% include \"item\" %}{% endfor %}</ul>");
+    EXPECT_EQ(render_registered(reg, "list", "{items: []}"), "<ul></ul>");
+    EXPECT_EQ(render_registered(reg, "list", "{items: [a]}"), "<ul><li>0:a</li></ul>");
+    EXPECT_EQ(render_registered(reg, "list", "{items: [a, b, c]}"), "<ul><li>0:a</li><li>1:b</li><li>2:c</li></ul>");
+}
+
+TEST(include, nested)
+{
+    TemplateRegistry reg;
+    reg.add("a", "a{{x}}");
+    reg.add("b", "[{% include \"a\" %}{% if x > 1 %}{% include \"a\" %}{% endif %}]");
+    reg.add("c", "{% for x in xs %}{% include \"b\" %}{% endfor %}");
+    EXPECT_EQ(render_registered(reg, "c", "{xs: [1, 2]}"), "[a1][a2a2]");
+}
+
+TEST(include, parsed_once)
+{
+    TemplateRegistry reg;
+    Engine const& partial = reg.add("partial", "{{a}}{{b}}{% if c %}{{c}}{% endif %}");
+    size_t num_tokens = partial.m_tokens.size();
+    for(int i = 0; i < 10; ++i)
+    {
+        std::string name = "page" + std::to_string(i);
+        Engine const& page = reg.add(to_csubstr(name), "{% include \"partial\" %}{% include \"partial\" %}");
+        EXPECT_EQ(page.m_tokens.size(), 2u);
+    }
+    EXPECT_EQ(partial.m_tokens.size(), num_tokens);
+    EXPECT_EQ(render_registered(reg, "page3", "{a: 1, b: 2, c: 3}"), "123123");
+}
+
+TEST(include, many_templates)
+{
+    TemplateRegistry reg;
+    std::vector<std::string> srcs(1000);
+    for(size_t i = 0; i < srcs.size(); ++i)
+    {
+        srcs[i] = "t" + std::to_string(i);
+        reg.add(to_csubstr(srcs[i]), to_csubstr(srcs[i]));
+    }
+    EXPECT_EQ(reg.size(), srcs.size());
+    EXPECT_GE(reg.m_index.size(), 2 * srcs.size());
+    for(auto const& s : srcs)
+    {
+        auto const* e = reg.find(to_csubstr(s));
+        ASSERT_NE(e, nullptr);
+        EXPECT_EQ(e->m_engine.m_src, to_csubstr(s));
+    }
+    EXPECT_EQ(reg.find("t1000"), nullptr);
+    EXPECT_EQ(reg.find(""), nullptr);
+    reg.add("page", "{% include \"t999\" %}|{% include \"t0\" %}");
+    EXPECT_EQ(render_registered(reg, "page", "{}"), "t999|t0");
+}
+
+TEST(include, from_an_unregistered_engine)
+{
+    TemplateRegistry reg;
+    reg.add("x", "x{{v}}");
+    Engine eng(&reg);
+    Rope parsed, rope;
+    eng.parse("<{% include \"x\" %}>", &parsed);
+    char yml[] = "{v: 1}";
+    yml::Tree t;
+    yml::parse(to_substr(yml), &t);
+    eng.render(t, &rope);
+    std::vector<char> buf;
+    EXPECT_EQ(rope.chain_all_resize(&buf), "<x1>");
+}
+
+//-----------------------------------------------------------------------------
+TEST(extends, overrides_are_flattened_into_the_base)
+{
+    TemplateRegistry reg;
+    reg.add("base", "<title>{% block title %}default{% endblock %}</title><body>{% block body %}{% endblock %}</body>");
+    reg.add("child", "{% extends \"base\" %}ignored{% block body %}<p>{{text}}</p>{% endblock body %}");
+    EXPECT_EQ(render_registered(reg, "base", "{text: hi}"), "<title>default</title><body></body>");
+    EXPECT_EQ(render_registered(reg, "child", "{text: hi}"), "<title>default</title><body><p>hi</p></body>");
+    // the child is parsed as if it was written by hand
+    Engine const& child = reg.find("child")->m_engine;
+    EXPECT_EQ(child.m_src, "<title>default</title><body><p>{{text}}</p></body>");
+    EXPECT_EQ(child.m_tokens.size(), 1u);
+}
+
+TEST(extends, multiple_levels)
+{
+    TemplateRegistry reg;
+    reg.add("base", "[{% block a %}A{% endblock %}|{% block b %}B{% endblock %}|{% block c %}C{% endblock %}]");
+    reg.add("mid", "{% extends 'base' %}{% block a %}mid{% endblock %}{% block b %}{% for x in xs %}{{x}}{% endfor %}{% endblock %}");
+    reg.add("leaf", "{% extends 'mid' %}{% block c %}leaf{% endblock %}{% block a %}{% if xs %}full{% else %}empty{% endif %}{% endblock %}");
+    EXPECT_EQ(render_registered(reg, "mid", "{xs: [1, 2]}"), "[mid|12|C]");
+    EXPECT_EQ(render_registered(reg, "leaf", "{xs: [1, 2]}"), "[full|12|leaf]");
+    EXPECT_EQ(render_registered(reg, "leaf", "{xs: []}"), "[empty||leaf]");
+}
+
+TEST(extends, nested_blocks)
+{
+    TemplateRegistry reg;
+    reg.add("base", "{% block outer %}<{% block inner %}i{% endblock %}>{% endblock %}");
+    reg.add("c1", "{% extends \"base\" %}{% block inner %}I{% endblock %}");
+    reg.add("c2", "{% extends \"base\" %}{% block outer %}({% block inner %}j{% endblock %}){% endblock %}");
+    reg.add("c3", "{% extends \"c2\" %}{% block inner %}J{% endblock %}");
+    EXPECT_EQ(render_registered(reg, "base", "{}"), "<i>");
+    EXPECT_EQ(render_registered(reg, "c1", "{}"), "<I>");
+    EXPECT_EQ(render_registered(reg, "c2", "{}"), "(j)");
+    EXPECT_EQ(render_registered(reg, "c3", "{}"), "(J)");
+}
+
+TEST(include, set_does_not_leak_from_macros_or_includes)
+{
+    TemplateRegistry reg;
+    reg.add("inc", "{% set x = 'inc' %}{{x}}");
+    reg.add("page", "{% macro m() %}{% set x = 'mac' %}{{x}}{% endmacro %}{% set x = 'page' %}{{m()}}{% include 'inc' %}{{x}}");
+    EXPECT_EQ(render_registered(reg, "page", "{}"), "macincpage");
+}
+
+//-----------------------------------------------------------------------------
+TEST(engine, blocks_are_stored_flat)
+{
+    TemplateRegistry reg;
+    Engine const& eng = reg.add("t", "{% for x in xs %}[{% if x > 1 %}<{{x}}>{% else %}-{% endif %}]{% endfor %}");
+    TokenContainer const& tokens = eng.m_tokens;
+    ASSERT_EQ(tokens.m_blocks.size(), 3u); // the for, and the if and else
+    ASSERT_EQ(tokens.m_conditions.size(), 2u); // the if and else
+    EXPECT_EQ(tokens.m_conditions[0].m_str, "x > 1");
+    EXPECT_TRUE(tokens.m_conditions[1].m_else);
+    EXPECT_TRUE(tokens.m_part_stack.empty());
+    size_t num_parts = 0;
+    for(TemplateBlock const& b : tokens.m_blocks)
+    {
+        EXPECT_LE(b.first_part + b.num_parts, tokens.m_parts.size());
+        num_parts += b.num_parts;
+    }
+    EXPECT_EQ(num_parts, tokens.m_parts.size());
+    // the body of the for: the text, the if, and the text
+    TemplateBlock const& body = tokens.m_blocks[0];
+    ASSERT_EQ(body.num_parts, 3u);
+    EXPECT_EQ(body.part(0).body, "[");
+    EXPECT_NE(body.part(1).token, NONE);
+    EXPECT_EQ(body.part(2).body, "]");
+    EXPECT_EQ(render_registered(reg, "t", "{xs: [1, 2, 3]}"), "[-][<2>][<3>]");
+}
+
+TEST(engine, renders_only_the_root_level_tokens)
+{
+    TemplateRegistry reg;
+    Engine const& eng = reg.add("t", "{{a}}{% for x in xs %}{% if x > 1 %}{{x}}{% endif %}{% endfor %}{{b}}");
+    ASSERT_EQ(eng.m_tokens.m_token_seq.size(), 5u);
+    ASSERT_EQ(eng.m_tokens.m_root_seq.size(), 3u);
+    for(size_t id : eng.m_tokens.m_root_seq)
+    {
+        EXPECT_TRUE(eng.m_tokens.get(id)->m_root_level);
+    }
+    EXPECT_EQ(eng.m_tokens.m_root_seq[0], eng.m_tokens.m_token_seq[0]);
+    EXPECT_EQ(eng.m_tokens.m_root_seq[1], eng.m_tokens.m_token_seq[1]);
+    EXPECT_EQ(eng.m_tokens.m_root_seq[2], eng.m_tokens.m_token_seq[4]);
+    EXPECT_EQ(render_registered(reg, "t", "{a: <, b: >, xs: [1, 2, 3]}"), "<23>");
+}
+
+TEST(engine, token_text_is_stored_as_offsets)
+{
+    // the token header is a vtable pointer, the id, the container, and offsets
+    EXPECT_LE(sizeof(TokenBase), 6 * sizeof(void*));
+    Engine eng;
+    Rope parsed;
+    csubstr src = "a{{ x }}b{% if y %}\nyes\n{% endif %}\nc";
+    eng.parse(src, &parsed);
+    ASSERT_EQ(eng.m_tokens.m_token_seq.size(), 2u);
+    TokenBase const* expr = eng.m_tokens.get(eng.m_tokens.m_token_seq[0]);
+    TokenBase const* cond = eng.m_tokens.get(eng.m_tokens.m_token_seq[1]);
+    EXPECT_EQ(expr->full_text(), "{{ x }}");
+    EXPECT_EQ(expr->interior_text(), " x ");
+    EXPECT_EQ(expr->full_text().str, src.str + 1);
+    // the line ending after the end token is merged into the full text
+    EXPECT_EQ(cond->full_text(), "{% if y %}\nyes\n{% endif %}\n");
+    EXPECT_EQ(cond->interior_text(), "y %}\nyes\n");
+}
+
+struct CountingResource : public MemoryResource
+{
+    size_t num_allocs = 0;
+protected:
+    void* do_allocate(size_t sz, size_t alignment, void* hint) override
+    {
+        ++num_allocs;
+        return get_memory_resource()->allocate(sz, alignment, hint);
+    }
+    void* do_reallocate(void* ptr, size_t oldsz, size_t newsz, size_t alignment) override
+    {
+        ++num_allocs;
+        return get_memory_resource()->reallocate(ptr, oldsz, newsz, alignment);
+    }
+    void do_deallocate(void* ptr, size_t sz, size_t alignment) override
+    {
+        get_memory_resource()->deallocate(ptr, sz, alignment);
+    }
+};
+
+size_t count_parse_allocs(size_t num_repeats)
+{
+    std::string src;
+    for(size_t i = 0; i < num_repeats; ++i)
+    {
+        src += "<{{a}}>{% for x in xs %}{% if x %}{{x}}{% else %}-{% endif %}{% endfor %}\n";
+    }
+    CountingResource mr;
+    Engine eng(&mr);
+    eng.parse("", nullptr); // register the token types
+    Rope parsed(&mr);
+    size_t before = mr.num_allocs;
+    eng.parse(to_csubstr(src), &parsed);
+    return mr.num_allocs - before;
+}
+
+TEST(engine, parse_reserves_up_front)
+{
+    // the pools and the rope are sized before parsing, so the number
+    // of allocations does not depend on the size of the template
+    size_t small = count_parse_allocs(2);
+    size_t large = count_parse_allocs(2000);
+    EXPECT_EQ(small, large);
+}
+
+TEST(include, reuses_a_scratch_rope)
+{
+    CountingResource mr;
+    TemplateRegistry reg(&mr);
+    reg.add("x", "x{{v}}");
+    reg.add("two", "<{% include \"x\" %}{% include \"x\" %}>");
+    reg.add("loop", "{% for v in vs %}{% include \"two\" %}{% endfor %}");
+    csubstr yml = "{vs: [1, 2, 3, 4, 5, 6, 7, 8]}";
+    EXPECT_EQ(render_registered(reg, "loop", yml), "<x1x1><x2x2><x3x3><x4x4><x5x5><x6x6><x7x7><x8x8>");
+    // the ropes of the includes are not copied anew in each iteration,
+    // nor in the following renders
+    size_t before = mr.num_allocs;
+    EXPECT_EQ(render_registered(reg, "loop", yml), "<x1x1><x2x2><x3x3><x4x4><x5x5><x6x6><x7x7><x8x8>");
+    EXPECT_EQ(mr.num_allocs, before);
+}
+
+TEST(engine, parse_reserves_the_blocks)
+{
+    std::string src;
+    for(size_t i = 0; i < 100; ++i)
+    {
+        src += "<{{a}}>{% for x in xs %}{% if x > 1 %}{{x}}{% elif x %}-{% else %}{% for y in x %}{{y}}{% endfor %}{% endif %}{% endfor %}\n";
+    }
+    Engine eng;
+    eng.parse("", nullptr); // register the token types
+    TokenContainer const& tk = eng.m_tokens;
+    eng.m_tokens.reserve_for(to_csubstr(src));
+    size_t blocks = tk.m_blocks.capacity(), parts = tk.m_parts.capacity();
+    size_t stack = tk.m_part_stack.capacity(), conditions = tk.m_conditions.capacity();
+    // parsing reserves the same again, and does not need to grow them
+    Rope parsed;
+    eng.parse(to_csubstr(src), &parsed);
+    EXPECT_EQ(tk.m_blocks.size(), 500u);
+    EXPECT_EQ(tk.m_conditions.size(), 300u);
+    EXPECT_EQ(tk.m_blocks.capacity(), blocks);
+    EXPECT_EQ(tk.m_parts.capacity(), parts);
+    EXPECT_EQ(tk.m_part_stack.capacity(), stack);
+    EXPECT_EQ(tk.m_conditions.capacity(), conditions);
+}
+
 TEST(engine, basic)
 {
     do_engine_test(R"(
@@ -0,0 +1,134 @@
+#include "c4/tpl/escape.hpp"
+#include "c4/tpl/arena.hpp"
+#include <c4/std/string.hpp>
+
+#include <gtest/gtest.h>
+#include <string>
+
+namespace c4 {
+
+inline void PrintTo(const substr& s, ::std::ostream* os) { *os << s; }
+inline void PrintTo(const csubstr& s, ::std::ostream* os) { *os << s; }
+
+namespace tpl {
+
+// check the result at all positions relative to the 16/32 byte SIMD
+// blocks, and with a tail handled by the scalar loop
+void do_escape_test(Escape_e e, csubstr special, csubstr expected)
+{
+    Arena arena;
+    for(size_t before = 0; before < 70; ++before)
+    {
+        for(size_t after : {size_t(0), size_t(1), size_t(17), size_t(33)})
+        {
+            SCOPED_TRACE(before);
+            SCOPED_TRACE(after);
+            std::string in(before, 'a'), out(before, 'a');
+            in.append(special.str, special.len);
+            out.append(expected.str, expected.len);
+            in.append(after, 'b');
+            out.append(after, 'b');
+            csubstr sin = to_csubstr(in);
+            EXPECT_EQ(first_to_escape(e, sin), special.empty() ? npos : before);
+            // as to_chars(): report the required size when the buffer is small
+            EXPECT_EQ(escape(e, substr{}, sin), out.size());
+            std::string buf(out.size(), '\0');
+            EXPECT_EQ(escape(e, to_substr(buf), sin), out.size());
+            EXPECT_EQ(buf, out);
+            csubstr ret = escape(e, sin, &arena);
+            EXPECT_EQ(ret, to_csubstr(out));
+            if(special.empty())
+            {
+                EXPECT_EQ(ret.str, sin.str); // no copy was made
+            }
+            arena.reset();
+        }
+    }
+}
+
+TEST(escape_html, nothing_to_escape)
+{
+    do_escape_test(ESCAPE_HTML, "", "");
+}
+
+TEST(escape_html, chars)
+{
+    do_escape_test(ESCAPE_HTML, "<", "&lt;");
+    do_escape_test(ESCAPE_HTML, ">", "&gt;");
+    do_escape_test(ESCAPE_HTML, "&", "&amp;");
+    do_escape_test(ESCAPE_HTML, "\"", "&quot;");
+    do_escape_test(ESCAPE_HTML, "'", "&#39;");
+    do_escape_test(ESCAPE_HTML, "<a href='x'>", "&lt;a href=&#39;x&#39;&gt;");
+}
+
+TEST(escape_json, nothing_to_escape)
+{
+    do_escape_test(ESCAPE_JSON, "", "");
+}
+
+TEST(escape_json, chars)
+{
+    do_escape_test(ESCAPE_JSON, "\"", "\\\"");
+    do_escape_test(ESCAPE_JSON, "\\", "\\\\");
+    do_escape_test(ESCAPE_JSON, "\n", "\\n");
+    do_escape_test(ESCAPE_JSON, "\t", "\\t");
+    do_escape_test(ESCAPE_JSON, "\x01", "\\u0001");
+    do_escape_test(ESCAPE_JSON, "\x1f", "\\u001f");
+    do_escape_test(ESCAPE_JSON, "\"b\nc", "\\\"b\\nc");
+}
+
+TEST(escape_json, high_bytes_are_kept)
+{
+    // utf8 sequences must not be taken as control characters
+    csubstr s = "\xc3\xa1\xc3\xa9\xc3\xad\xc3\xb3\xc3\xba\xc3\xa1\xc3\xa9\xc3\xad\xc3\xb3\xc3\xba\xc3\xa1\xc3\xa9\xc3\xad\xc3\xb3\xc3\xba";
+    EXPECT_EQ(first_to_escape_json(s), npos);
+}
+
+TEST(escape_none, is_identity)
+{
+    Arena arena;
+    csubstr s = "<\"&'>";
+    EXPECT_EQ(first_to_escape(ESCAPE_NONE, s), npos);
+    EXPECT_EQ(escape(ESCAPE_NONE, s, &arena).str, s.str);
+}
+
+TEST(escape, from_name)
+{
+    Escape_e e = ESCAPE_JSON;
+    EXPECT_TRUE(escape_from_name("html", &e)); EXPECT_EQ(e, ESCAPE_HTML);
+    EXPECT_TRUE(escape_from_name("none", &e)); EXPECT_EQ(e, ESCAPE_NONE);
+    EXPECT_TRUE(escape_from_name("xml", &e)); EXPECT_EQ(e, ESCAPE_HTML);
+    EXPECT_TRUE(escape_from_name("json", &e)); EXPECT_EQ(e, ESCAPE_JSON);
+    EXPECT_TRUE(escape_from_name("true", &e)); EXPECT_EQ(e, ESCAPE_HTML);
+    EXPECT_TRUE(escape_from_name("false", &e)); EXPECT_EQ(e, ESCAPE_NONE);
+    EXPECT_FALSE(escape_from_name("HTML", &e)); EXPECT_EQ(e, ESCAPE_NONE);
+    EXPECT_FALSE(escape_from_name("", &e));
+    EXPECT_FALSE(escape_from_name("yes", &e));
+}
+
+
+//-----------------------------------------------------------------------------
+
+TEST(arena, strings_survive_growth)
+{
+    Arena arena;
+    std::vector<csubstr> strs;
+    std::string expected;
+    for(size_t i = 0; i < 100; ++i)
+    {
+        expected.assign(i + 1, char('a' + i % 26));
+        strs.push_back(arena.copy(to_csubstr(expected)));
+    }
+    for(size_t i = 0; i < strs.size(); ++i)
+    {
+        expected.assign(i + 1, char('a' + i % 26));
+        EXPECT_EQ(strs[i], to_csubstr(expected));
+    }
+    size_t cap = arena.capacity();
+    arena.reset();
+    EXPECT_EQ(arena.capacity(), cap);
+    EXPECT_EQ(arena.m_curr->m_prev, nullptr); // coalesced into a single chunk
+}
+
+} // namespace tpl
+} // namespace c4
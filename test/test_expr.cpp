@@ -0,0 +1,323 @@
+#include "c4/tpl/expr.hpp"
+#include "c4/tpl/arena.hpp"
+#include "c4/yml/parse.hpp"
+
+#include <gtest/gtest.h>
+#include <string>
+
+namespace c4 {
+
+inline void PrintTo(const substr& s, ::std::ostream* os) { *os << s; }
+inline void PrintTo(const csubstr& s, ::std::ostream* os) { *os << s; }
+
+namespace tpl {
+
+TEST(expr, postfix_code)
+{
+    Expr e;
+    e.compile("not a == 1 or (b and c in d)");
+    std::vector<Expr::Op_e> ops;
+    for(auto const& in : e.m_code)
+    {
+        ops.push_back(in.op);
+    }
+    EXPECT_EQ(ops, (std::vector<Expr::Op_e>{
+        Expr::OP_PUSH, Expr::OP_PUSH, Expr::OP_EQ, Expr::OP_NOT,
+        Expr::OP_OR,
+        Expr::OP_PUSH, Expr::OP_AND, Expr::OP_PUSH, Expr::OP_PUSH, Expr::OP_IN,
+    }));
+    // the jumps skip the right side
+    EXPECT_EQ(e.m_code[4].arg, 10u);
+    EXPECT_EQ(e.m_code[6].arg, 10u);
+    ASSERT_EQ(e.m_operands.size(), 5u);
+    EXPECT_EQ(e.m_operands[0].m_type, Expr::Operand::PATH);
+    EXPECT_EQ(e.m_operands[1].m_type, Expr::Operand::LITERAL);
+    EXPECT_EQ(e.m_operands[1].m_val.m_type, Value::INT);
+    EXPECT_EQ(e.m_operands[1].m_val.m_int, 1);
+}
+
+TEST(expr, operands)
+{
+    Expr e;
+    e.compile("a.b[0] == 'x y' or -1.5 < 2e3 or true or loop.index or loop.foo");
+    ASSERT_EQ(e.m_operands.size(), 7u);
+    EXPECT_EQ(e.m_operands[0].m_type, Expr::Operand::PATH);
+    EXPECT_EQ(e.m_operands[0].m_str, "a.b[0]");
+    EXPECT_EQ(e.m_operands[1].m_val.m_type, Value::STR);
+    EXPECT_EQ(e.m_operands[1].m_val.m_str, "x y");
+    EXPECT_EQ(e.m_operands[2].m_val.m_type, Value::FLOAT);
+    EXPECT_EQ(e.m_operands[2].m_val.m_float, -1.5);
+    EXPECT_EQ(e.m_operands[3].m_val.m_type, Value::FLOAT);
+    EXPECT_EQ(e.m_operands[4].m_val.m_type, Value::BOOL);
+    EXPECT_EQ(e.m_operands[5].m_type, Expr::Operand::LOOP);
+    EXPECT_EQ(e.m_operands[5].m_loop_field, LoopInfo::INDEX);
+    EXPECT_EQ(e.m_operands[6].m_type, Expr::Operand::PATH);
+}
+
+TEST(expr, short_circuit_keeps_the_deciding_value)
+{
+    char yml[] = "{a: foo, b: '', c: bar}";
+    yml::Tree t;
+    yml::parse(to_substr(yml), &t);
+    RenderContext ctx;
+    Expr e;
+
+    e.compile("a or c");
+    EXPECT_EQ(e.eval(t.rootref(), &ctx).to_str(&ctx.m_arena), "foo");
+    e.compile("b or c");
+    EXPECT_EQ(e.eval(t.rootref(), &ctx).to_str(&ctx.m_arena), "bar");
+    e.compile("b and c");
+    EXPECT_EQ(e.eval(t.rootref(), &ctx).to_str(&ctx.m_arena), "");
+    e.compile("a and c");
+    EXPECT_EQ(e.eval(t.rootref(), &ctx).to_str(&ctx.m_arena), "bar");
+    e.compile("nothing and c");
+    EXPECT_EQ(e.eval(t.rootref(), &ctx).m_type, Value::NIL);
+}
+
+TEST(expr, in)
+{
+    char yml[] = "{seq: [c0, c1], map: {k: v}, str: abcd, c1: c0}";
+    yml::Tree t;
+    yml::parse(to_substr(yml), &t);
+    RenderContext ctx;
+    Expr e;
+
+    e.compile("c0 in seq"); // c0 is not in the tree: used literally
+    EXPECT_TRUE(e.eval_bool(t.rootref(), &ctx));
+    e.compile("c1 in seq"); // c1 is in the tree: its value is used
+    EXPECT_TRUE(e.eval_bool(t.rootref(), &ctx));
+    e.compile("'c2' in seq");
+    EXPECT_FALSE(e.eval_bool(t.rootref(), &ctx));
+    e.compile("'k' in map and 'v' not in map");
+    EXPECT_TRUE(e.eval_bool(t.rootref(), &ctx));
+    e.compile("'bc' in str and not 'x' in str");
+    EXPECT_TRUE(e.eval_bool(t.rootref(), &ctx));
+    e.compile("'x' in nothing");
+    EXPECT_FALSE(e.eval_bool(t.rootref(), &ctx));
+}
+
+TEST(expr, values_are_formatted_only_when_emitted)
+{
+    char yml[] = "{a: 10}";
+    yml::Tree t;
+    yml::parse(to_substr(yml), &t);
+    RenderContext ctx;
+    Expr e;
+
+    e.compile("a");
+    Value v = e.eval(t.rootref(), &ctx);
+    EXPECT_EQ(v.m_type, Value::NODE);
+    EXPECT_EQ(v.to_str(&ctx.m_arena).str, t.rootref()["a"].val().str); // a view into the tree
+
+    e.compile("loop.revindex");
+    ctx.m_loops.push_back({2, 10});
+    v = e.eval(t.rootref(), &ctx);
+    EXPECT_EQ(v.m_type, Value::INT);
+    EXPECT_EQ(v.m_int, 7);
+    EXPECT_EQ(ctx.m_arena.capacity(), 0u); // nothing formatted yet
+    EXPECT_EQ(v.to_str(&ctx.m_arena), "7");
+    e.compile("loop.revindex < a");
+    EXPECT_TRUE(e.eval_bool(t.rootref(), &ctx));
+}
+
+TEST(expr, arithmetic)
+{
+    char yml[] = "{price: 2.5, qty: 4, i: 7, n: -7, s: abc}";
+    yml::Tree t;
+    yml::parse(to_substr(yml), &t);
+    RenderContext ctx;
+    Expr e;
+    auto eval = [&](csubstr expr) {
+        e.compile(expr);
+        return e.eval(t.rootref(), &ctx);
+    };
+
+    EXPECT_EQ(eval("i + 1").m_int, 8);
+    EXPECT_EQ(eval("1 + 2 * 3").m_int, 7);
+    EXPECT_EQ(eval("(1 + 2) * 3").m_int, 9);
+    EXPECT_EQ(eval("i - 2 - 3").m_int, 2); // left associative
+    EXPECT_EQ(eval("price * qty").m_float, 10.);
+    EXPECT_EQ(eval("i / 2").m_float, 3.5);
+    EXPECT_EQ(eval("i // 2").m_int, 3);
+    EXPECT_EQ(eval("n // 2").m_int, -4);
+    EXPECT_EQ(eval("i % 3").m_int, 1);
+    EXPECT_EQ(eval("n % 3").m_int, 2);
+    EXPECT_EQ(eval("-i").m_int, -7);
+    EXPECT_EQ(eval("- -i").m_int, 7);
+    EXPECT_EQ(eval("i-1").m_int, 6);
+    EXPECT_EQ(eval("i / 0").m_type, Value::NIL);
+    EXPECT_EQ(eval("s + 1").m_type, Value::NIL);
+    EXPECT_EQ(eval("nothing * 2").m_type, Value::NIL);
+    EXPECT_TRUE(eval("i * 2 > 10 and i - 7 == 0").truthy());
+    EXPECT_EQ(ctx.m_arena.capacity(), 0u); // no strings were needed
+}
+
+TEST(expr, hyphenated_keys)
+{
+    char yml[] = "{my-key: 10, some-flag: true, a: 5, b: 2, a-b: ab, m: {x-y: {z: 1}, 'k 2': 3}, c-1: c}";
+    yml::Tree t;
+    yml::parse(to_substr(yml), &t);
+    RenderContext ctx;
+    Expr e;
+    auto eval = [&](csubstr expr) {
+        e.compile(expr);
+        return e.eval(t.rootref(), &ctx);
+    };
+
+    // a hyphen between names is part of the path
+    EXPECT_EQ(eval("my-key").m_str, "10");
+    EXPECT_TRUE(eval("some-flag").truthy());
+    EXPECT_EQ(eval("a-b").m_str, "ab");
+    EXPECT_EQ(eval("m.x-y.z").m_str, "1");
+    EXPECT_EQ(eval("my-key + 1").m_int, 11);
+    EXPECT_EQ(eval("nothing-here").m_type, Value::NIL);
+    // with spaces, or before a number, it is a subtraction
+    EXPECT_EQ(eval("a - b").m_int, 3);
+    EXPECT_EQ(eval("a -b").m_int, 3);
+    EXPECT_EQ(eval("a-1").m_int, 4);
+    EXPECT_EQ(eval("c-1").m_type, Value::NIL);
+    EXPECT_EQ(eval("m['x-y'].z").m_str, "1");
+    EXPECT_EQ(eval("m[\"k 2\"]").m_str, "3");
+    EXPECT_EQ(eval("m.x-y['z']").m_str, "1");
+}
+
+TEST(expr, negative_literals_are_folded)
+{
+    Expr e;
+    e.compile("-1 < -2.5");
+    ASSERT_EQ(e.m_code.size(), 3u);
+    EXPECT_EQ(e.m_operands[0].m_val.m_int, -1);
+    EXPECT_EQ(e.m_operands[1].m_val.m_float, -2.5);
+    e.compile("-(a)");
+    ASSERT_EQ(e.m_code.size(), 2u);
+    EXPECT_EQ(e.m_code[1].op, Expr::OP_NEG);
+}
+
+TEST(expr, concatenation)
+{
+    char yml[] = "{prefix: pre, name: fix, n: 3}";
+    yml::Tree t;
+    yml::parse(to_substr(yml), &t);
+    RenderContext ctx;
+    Expr e;
+
+    e.compile("prefix ~ name");
+    EXPECT_EQ(e.eval(t.rootref(), &ctx).to_str(&ctx.m_arena), "prefix");
+    e.compile("prefix ~ '-' ~ n + 1");
+    EXPECT_EQ(e.eval(t.rootref(), &ctx).to_str(&ctx.m_arena), "pre-4");
+    e.compile("nothing ~ name");
+    Value v = e.eval(t.rootref(), &ctx);
+    EXPECT_EQ(v.to_str(&ctx.m_arena), "fix");
+    EXPECT_EQ(v.m_str.str, t.rootref()["name"].val().str); // no copy was needed
+}
+
+TEST(expr, range)
+{
+    yml::Tree t;
+    RenderContext ctx;
+    Expr e;
+    auto eval = [&](csubstr expr) {
+        e.compile(expr);
+        return e.eval(t.rootref(), &ctx);
+    };
+
+    Value v = eval("range(5)");
+    ASSERT_TRUE(v.is_range());
+    EXPECT_FALSE(v.is_slice());
+    EXPECT_EQ(v.m_range.start, 0);
+    EXPECT_EQ(v.m_range.stop, 5);
+    EXPECT_EQ(v.m_range.size(), 5u);
+    EXPECT_EQ(eval("range(10, 0, -3)").m_range.size(), 4u);
+    EXPECT_EQ(eval("range(0, 10, -3)").m_range.size(), 0u);
+    EXPECT_EQ(eval("range(0, 10, 0)").m_type, Value::NIL);
+    EXPECT_TRUE(eval("4 in range(0, 10, 2)").truthy());
+    EXPECT_FALSE(eval("5 in range(0, 10, 2)").truthy());
+    EXPECT_FALSE(eval("10 in range(0, 10, 2)").truthy());
+    v = eval("range(100)[10:20:5]");
+    ASSERT_TRUE(v.is_range());
+    EXPECT_EQ(v.m_range.start, 10);
+    EXPECT_EQ(v.m_range.step, 5);
+    EXPECT_EQ(v.m_range.size(), 2u);
+}
+
+TEST(expr, slice)
+{
+    char yml[] = "{s: [a, b, c, d, e, f, g, h, i, j]}";
+    yml::Tree t;
+    yml::parse(to_substr(yml), &t);
+    RenderContext ctx;
+    Expr e;
+    auto eval = [&](csubstr expr) {
+        e.compile(expr);
+        return e.eval(t.rootref(), &ctx);
+    };
+    auto check = [&](csubstr expr, int64_t start, int64_t stop, int64_t step, size_t size) {
+        SCOPED_TRACE(expr);
+        Value v = eval(expr);
+        ASSERT_TRUE(v.is_slice());
+        EXPECT_EQ(v.m_range.start, start);
+        EXPECT_EQ(v.m_range.stop, stop);
+        EXPECT_EQ(v.m_range.step, step);
+        EXPECT_EQ(v.m_range.size(), size);
+    };
+
+    check("s[2:5]", 2, 5, 1, 3);
+    check("s[:]", 0, 10, 1, 10);
+    check("s[-3:]", 7, 10, 1, 3);
+    check("s[:-3]", 0, 7, 1, 7);
+    check("s[5:100]", 5, 10, 1, 5);
+    check("s[-100:2]", 0, 2, 1, 2);
+    check("s[::-1]", 9, -1, -1, 10);
+    check("s[8:2:-3]", 8, 2, -3, 2);
+    check("s[5:2]", 5, 2, 1, 0);
+    check("s[20:30]", 20, 10, 1, 0);
+    check("s[1 + 1:10 // 2]", 2, 5, 1, 3);
+    EXPECT_TRUE(eval("'h' in s[5:]").truthy());
+    EXPECT_FALSE(eval("'b' in s[5:]").truthy());
+    EXPECT_EQ(eval("s[::0]").m_type, Value::NIL);
+    EXPECT_EQ(eval("nothing[1:]").m_type, Value::NIL);
+}
+
+TEST(expr, slice_does_not_count_the_children)
+{
+    std::string yml = "{s: [0";
+    for(size_t i = 1; i < 100000; ++i)
+    {
+        yml += ", " + std::to_string(i);
+    }
+    yml += "]}";
+    yml::Tree t;
+    yml::parse(to_substr(yml), &t);
+    RenderContext ctx;
+    Expr e;
+    auto eval = [&](csubstr expr) {
+        e.compile(expr);
+        return e.eval(t.rootref(), &ctx);
+    };
+    Value v = eval("s[10:13]");
+    ASSERT_TRUE(v.is_slice());
+    EXPECT_EQ(v.m_range.start, 10);
+    EXPECT_EQ(v.m_range.stop, 13);
+    EXPECT_EQ(v.m_range.size(), 3u);
+    EXPECT_EQ(t.val(v.slice_first()), "10");
+    EXPECT_TRUE(eval("12 in s[10:13]").truthy());
+    EXPECT_FALSE(eval("13 in s[10:13]").truthy());
+    // out of range bounds are clamped to the children
+    v = eval("s[99998:200000]");
+    EXPECT_EQ(v.m_range.stop, 100000);
+    EXPECT_EQ(v.m_range.size(), 2u);
+    EXPECT_EQ(eval("s[200000:300000]").m_range.size(), 0u);
+    EXPECT_EQ(eval("s[20:10]").m_range.size(), 0u);
+    // the children after stop are not visited: this would take
+    // seconds if each slice counted the children
+    e.compile("s[0:2]");
+    size_t total = 0;
+    for(size_t i = 0; i < 10000; ++i)
+    {
+        total += e.eval(t.rootref(), &ctx).m_range.size();
+    }
+    EXPECT_EQ(total, 20000u);
+}
+
+} // namespace tpl
+} // namespace c4
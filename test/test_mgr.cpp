@@ -1,8 +1,208 @@
-//#include "c4/tpl/mgr.hpp"
+#include "c4/tpl/mgr.hpp"
 #include <gtest/gtest.h>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 namespace c4 {
 namespace tpl {
 
+struct Shape
+{
+    C4_DECLARE_MANAGED_BASE(Shape, size_t)
+public:
+    static std::atomic<int> s_num_alive;
+    Shape() { ++s_num_alive; }
+    virtual ~Shape() { --s_num_alive; }
+};
+C4_DEFINE_MANAGED_BASE(Shape, size_t);
+std::atomic<int> Shape::s_num_alive{0};
+
+struct Circle : public Shape
+{
+    C4_DECLARE_MANAGED(Circle, Shape, size_t)
+public:
+    double m_radius = 1.;
+};
+C4_DEFINE_MANAGED(Circle, size_t);
+
+struct Square : public Shape
+{
+    C4_DECLARE_MANAGED(Square, Shape, size_t)
+public:
+    double m_side = 2.;
+};
+C4_DEFINE_MANAGED(Square, size_t);
+
+using ShapeMgr = ObjMgr<Shape, pool_linear_paged<16, size_t, allocator_mr<char>>, 0>;
+
+TEST(ObjMgr, release_reuses_memory)
+{
+    {
+        ShapeMgr mgr;
+        C4_REGISTER_MANAGED(mgr, Circle);
+        C4_REGISTER_MANAGED(mgr, Square);
+        std::vector<size_t> ids;
+        for(int i = 0; i < 10; ++i)
+        {
+            ids.push_back(mgr.create_from_pool_as<Circle>()->id());
+            ids.push_back(mgr.create_from_pool_as<Square>()->id());
+        }
+        EXPECT_EQ(mgr.size(), 20u);
+        EXPECT_EQ(Shape::s_num_alive, 20);
+        // release in the middle: the objects are destroyed, and their
+        // memory is reused by the next objects of the same type
+        void *mem = mgr.get(ids[4]);
+        mgr.release(ids[4]);
+        EXPECT_EQ(mgr.size(), 19u);
+        EXPECT_EQ(Shape::s_num_alive, 19);
+        Circle *c = mgr.create_from_pool_as<Circle>();
+        EXPECT_EQ((void*)c, mem);
+        EXPECT_EQ(mgr.get_as<Circle>(c->id()), c);
+        ids[4] = c->id();
+        // the iteration skips the released objects
+        mgr.release(ids[6]);
+        mgr.release(ids[7]);
+        size_t num = 0;
+        for(Shape const& s : mgr)
+        {
+            EXPECT_NE(s.id(), ids[6]);
+            EXPECT_NE(s.id(), ids[7]);
+            ++num;
+        }
+        EXPECT_EQ(num, 18u);
+        EXPECT_EQ(num, mgr.size());
+        // creating and releasing continuously does not grow the pools
+        size_t cap = mgr.get_pool<Circle>()->capacity();
+        for(int i = 0; i < 1000; ++i)
+        {
+            mgr.release(mgr.create_from_pool_as<Circle>()->id());
+        }
+        EXPECT_EQ(mgr.get_pool<Circle>()->capacity(), cap);
+        EXPECT_EQ(Shape::s_num_alive, 18);
+        mgr.clear();
+        EXPECT_EQ(mgr.size(), 0u);
+        EXPECT_EQ(Shape::s_num_alive, 0);
+    }
+    EXPECT_EQ(Shape::s_num_alive, 0);
+}
+
+TEST(ObjMgr, concurrent_creation)
+{
+    {
+        ObjMgr<Shape, pool_linear_paged_mt<16, size_t, allocator_mr<char>>, 0> mgr;
+        C4_REGISTER_MANAGED(mgr, Circle);
+        C4_REGISTER_MANAGED(mgr, Square);
+        const int num_threads = 4, num_per_thread = 1000;
+        std::vector<std::thread> threads;
+        for(int t = 0; t < num_threads; ++t)
+        {
+            threads.emplace_back([&mgr, t]{
+                for(int i = 0; i < num_per_thread; ++i)
+                {
+                    if((i + t) & 1)
+                    {
+                        Circle *c = mgr.create_from_pool_as<Circle>();
+                        c->m_radius = t;
+                    }
+                    else
+                    {
+                        Square *s = mgr.create_from_pool_as<Square>();
+                        s->m_side = t;
+                    }
+                }
+            });
+        }
+        for(auto &th : threads)
+        {
+            th.join();
+        }
+        EXPECT_EQ(mgr.size(), size_t(num_threads * num_per_thread));
+        EXPECT_EQ(mgr.get_pool<Circle>()->size(), size_t(num_threads * num_per_thread / 2));
+        size_t num = 0;
+        for(Shape const& s : mgr)
+        {
+            EXPECT_EQ(mgr.get(s.id()), &s);
+            ++num;
+        }
+        EXPECT_EQ(num, mgr.size());
+        EXPECT_EQ(Shape::s_num_alive, num_threads * num_per_thread);
+        mgr.clear();
+    }
+    EXPECT_EQ(Shape::s_num_alive, 0);
+}
+
+struct CountShapes
+{
+    size_t num_circles = 0, num_squares = 0, num_others = 0;
+    void operator() (Circle &) { ++num_circles; }
+    void operator() (Square &) { ++num_squares; }
+    void operator() (Shape &) { ++num_others; }
+};
+
+TEST(ObjMgr, typed_visitation)
+{
+    {
+        ShapeMgr mgr;
+        C4_REGISTER_MANAGED(mgr, Circle);
+        C4_REGISTER_MANAGED(mgr, Square);
+        std::vector<size_t> circles;
+        for(int i = 0; i < 40; ++i)
+        {
+            circles.push_back(mgr.create_from_pool_as<Circle>()->id());
+            mgr.create_from_pool_as<Square>();
+        }
+        mgr.for_each<Circle>([](Circle &c){ c.m_radius = 3.; });
+        double sum = 0.;
+        mgr.for_each<Circle>([&sum](Circle const& c){ sum += c.m_radius; });
+        EXPECT_EQ(sum, 120.);
+        // released objects are skipped
+        mgr.release(circles[5]);
+        mgr.release(circles[17]);
+        size_t num = 0;
+        ShapeMgr const& cmgr = mgr;
+        cmgr.for_each<Circle>([&num](Circle const&){ ++num; });
+        EXPECT_EQ(num, 38u);
+
+        CountShapes all;
+        mgr.visit_all<Circle, Square>(all);
+        EXPECT_EQ(all.num_circles, 38u);
+        EXPECT_EQ(all.num_squares, 40u);
+        EXPECT_EQ(all.num_others, 0u);
+        // the types not given are visited as the base
+        CountShapes some;
+        mgr.visit_all<Square>(some);
+        EXPECT_EQ(some.num_circles, 0u);
+        EXPECT_EQ(some.num_squares, 40u);
+        EXPECT_EQ(some.num_others, 38u);
+        mgr.clear();
+    }
+    EXPECT_EQ(Shape::s_num_alive, 0);
+}
+
+TEST(ObjMgr, create_by_name)
+{
+    {
+        ShapeMgr mgr;
+        EXPECT_EQ(mgr.get_pool("Circle"), nullptr);
+        size_t circle_type = C4_REGISTER_MANAGED(mgr, Circle);
+        size_t square_type = C4_REGISTER_MANAGED(mgr, Square);
+        ASSERT_NE(mgr.get_pool("Circle"), nullptr);
+        ASSERT_NE(mgr.get_pool("Square"), nullptr);
+        EXPECT_EQ(mgr.get_pool("Circle")->m_type_id, circle_type);
+        EXPECT_EQ(mgr.get_pool("Square")->m_type_id, square_type);
+        EXPECT_EQ(mgr.get_pool("Triangle"), nullptr);
+        EXPECT_EQ(mgr.get_pool("Circl"), nullptr);
+        Shape *c = mgr.create_from_pool("Circle");
+        Shape *s = mgr.create_from_pool("Square");
+        EXPECT_NE(dynamic_cast<Circle*>(c), nullptr);
+        EXPECT_NE(dynamic_cast<Square*>(s), nullptr);
+        EXPECT_EQ(mgr.size(), 2u);
+        mgr.free();
+        EXPECT_EQ(mgr.get_pool("Circle"), nullptr);
+    }
+    EXPECT_EQ(Shape::s_num_alive, 0);
+}
+
 } // namespace tpl
 } // namespace c4
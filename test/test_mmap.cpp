@@ -0,0 +1,105 @@
+#include "c4/tpl/mmap.hpp"
+#include "c4/tpl/engine.hpp"
+#include "c4/yml/parse.hpp"
+
+#include <gtest/gtest.h>
+
+namespace c4 {
+namespace tpl {
+
+TEST(mmap, blocks_are_reused)
+{
+    MemoryResourceMmap mr;
+    EXPECT_EQ(mr.num_arenas(), 0u);
+    void *a = mr.allocate(100, 8);
+    void *b = mr.allocate(100, 8);
+    EXPECT_EQ(mr.num_arenas(), 1u);
+    EXPECT_EQ(mr.mapped_bytes(), mr.arena_size());
+    EXPECT_EQ(mr.allocated_bytes(), 256u); // rounded up to 128 each
+    EXPECT_NE(a, b);
+    mr.deallocate(a, 100, 8);
+    EXPECT_EQ(mr.allocated_bytes(), 128u);
+    void *c = mr.allocate(120, 8); // same block size
+    EXPECT_EQ(c, a);
+    void *d = mr.allocate(1000, 256);
+    EXPECT_EQ(((uintptr_t)d) & 255u, 0u);
+    memset(d, 0, 1000);
+    mr.deallocate(b, 100, 8);
+    mr.deallocate(c, 120, 8);
+    mr.deallocate(d, 1000, 256);
+    EXPECT_EQ(mr.allocated_bytes(), 0u);
+    EXPECT_EQ(mr.num_arenas(), 1u);
+}
+
+TEST(mmap, large_allocations)
+{
+    MemoryResourceMmap mr(MemoryResourceMmap::HugePageSize, MemoryResourceMmap::HUGE_PAGES|MemoryResourceMmap::POPULATE);
+    EXPECT_EQ(mr.arena_size(), size_t(MemoryResourceMmap::HugePageSize));
+    size_t sz = 3 * MemoryResourceMmap::HugePageSize;
+    char *mem = (char*)mr.allocate(sz);
+    EXPECT_EQ(((uintptr_t)mem) % MemoryResourceMmap::HugePageSize, 0u);
+    EXPECT_EQ(mr.num_arenas(), 0u);
+    EXPECT_EQ(mr.mapped_bytes(), sz);
+    mem[0] = mem[sz - 1] = 'a';
+    mr.deallocate(mem, sz);
+    EXPECT_EQ(mr.mapped_bytes(), 0u);
+}
+
+TEST(mmap, rope)
+{
+    MemoryResourceMmap mr(MemoryResourceMmap::DefaultArenaSize, 0);
+    Rope r(&mr);
+    for(size_t i = 0; i < 1000; ++i)
+    {
+        r.append("abc");
+    }
+    EXPECT_EQ(r.str_size(), 3000u);
+    EXPECT_GT(mr.allocated_bytes(), 0u);
+    Rope cp(&mr);
+    cp = r;
+    EXPECT_EQ(cp.str_size(), 3000u);
+}
+
+TEST(mmap, engine)
+{
+    MemoryResourceMmap mr;
+    std::vector<char> result_buf;
+    {
+        Engine eng(&mr);
+        Rope parsed(&mr);
+        eng.parse("{% for x in xs %}<{{x}}>{% endfor %}", &parsed);
+        EXPECT_EQ(mr.num_arenas(), 1u);
+        size_t allocated = mr.allocated_bytes();
+        EXPECT_GT(allocated, 0u);
+        char yml[] = "{xs: [a, b, c]}";
+        yml::Tree t;
+        yml::parse(to_substr(yml), &t);
+        Rope r(&mr);
+        eng.render(t, &r);
+        EXPECT_EQ(r.chain_all_resize(&result_buf), "<a><b><c>");
+        EXPECT_GT(mr.allocated_bytes(), allocated);
+    }
+    EXPECT_EQ(mr.allocated_bytes(), 0u);
+}
+
+TEST(mmap, registry)
+{
+    MemoryResourceMmap mr;
+    std::vector<char> result_buf;
+    {
+        TemplateRegistry reg(&mr);
+        reg.add("item", "<li>{{x}}</li>");
+        Engine const& eng = reg.add("list", "{% for x in xs %}{% include 'item' %}{% endfor %}");
+        EXPECT_GT(mr.allocated_bytes(), 0u);
+        char yml[] = "{xs: [a, b]}";
+        yml::Tree t;
+        yml::parse(to_substr(yml), &t);
+        Rope r;
+        eng.render(t, &r);
+        EXPECT_EQ(r.chain_all_resize(&result_buf), "<li>a</li><li>b</li>");
+    }
+    EXPECT_EQ(mr.allocated_bytes(), 0u);
+}
+
+} // namespace tpl
+} // namespace c4
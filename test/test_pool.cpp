@@ -1,5 +1,7 @@
 #include "c4/tpl/pool.hpp"
 #include <gtest/gtest.h>
+#include <thread>
+#include <vector>
 
 namespace c4 {
 
@@ -101,4 +103,239 @@ TEST(pool_linear_paged, collection_indices)
 }
 
 
+//-----------------------------------------------------------------------------
+
+TEST(pool_collection_runtime, indices)
+{
+    pool_collection<ppag, 0> p(16);
+    EXPECT_EQ(p.capacity(), 16u);
+    EXPECT_EQ(p._pool_shift(), (pool_collection<ppag, 16>::s_pool_shift));
+    for(size_t pool = 0; pool < p.capacity(); ++pool)
+    {
+        for(size_t pos = 0; pos < 512; ++pos)
+        {
+            do_test_pool_collection_indices(p, pool, pos);
+        }
+    }
+}
+
+TEST(pool_collection_runtime, many_pools)
+{
+    pool_collection<ppag, 0> p;
+    EXPECT_EQ(p.capacity(), 0u);
+    EXPECT_LT(sizeof(p), (sizeof(pool_collection<ppag, 32>)));
+    const size_t num_pools = 100;
+    for(size_t i = 0; i < num_pools; ++i)
+    {
+        EXPECT_EQ(p.add_pool(sizeof(size_t), alignof(size_t), 0), i);
+    }
+    EXPECT_EQ(p.num_pools(), num_pools);
+    EXPECT_GE(p.capacity(), num_pools);
+    std::vector<size_t> ids;
+    for(size_t i = 0; i < num_pools; ++i)
+    {
+        for(size_t j = 0; j < 3; ++j)
+        {
+            size_t id = p.claim(i);
+            EXPECT_EQ(p.decode_pool(id), i);
+            EXPECT_EQ(p.decode_pos(id), j);
+            *(size_t*)p.get(id) = 10 * i + j;
+            ids.push_back(id);
+        }
+    }
+    for(size_t id : ids)
+    {
+        EXPECT_EQ(*(size_t*)p.get(id), 10 * p.decode_pool(id) + p.decode_pos(id));
+    }
+    size_t n = 0;
+    for(auto &pool : p)
+    {
+        EXPECT_EQ(pool.size(), 3u);
+        pool.m_num_objs = 0;
+        ++n;
+    }
+    EXPECT_EQ(n, num_pools);
+}
+
+
+//-----------------------------------------------------------------------------
+
+TEST(pool_linear_paged, free_list)
+{
+    ppag p(sizeof(size_t), alignof(size_t), 0);
+    size_t ids[8];
+    for(size_t i = 0; i < 8; ++i)
+    {
+        ids[i] = p.claim();
+        EXPECT_EQ(ppag::_slot(ids[i]), i);
+        *(size_t*)p.get(ids[i]) = i;
+    }
+    p.release(ids[2]);
+    p.release(ids[5]);
+    EXPECT_EQ(p.size(), 6u);
+    EXPECT_EQ(p.num_free(), 2u);
+    // the last released is the first reused
+    size_t id = p.claim();
+    EXPECT_EQ(ppag::_slot(id), 5u);
+    id = p.claim();
+    EXPECT_EQ(ppag::_slot(id), 2u);
+    EXPECT_EQ(p.num_free(), 0u);
+    id = p.claim();
+    EXPECT_EQ(ppag::_slot(id), 8u);
+    EXPECT_EQ(p.size(), 9u);
+    // releasing the most recent decreases the size
+    p.release(id);
+    EXPECT_EQ(p.size(), 8u);
+    EXPECT_EQ(p.num_free(), 0u);
+    for(size_t i : {0, 1, 3, 4, 6, 7})
+    {
+        EXPECT_EQ(*(size_t*)p.get(ids[i]), i);
+    }
+    p.destroy([](void*){});
+    EXPECT_EQ(p.size(), 0u);
+}
+
+TEST(pool_linear_paged, free_list_keeps_memory_bounded)
+{
+    ppag p(sizeof(size_t), alignof(size_t), 0);
+    std::vector<size_t> ids;
+    for(size_t i = 0; i < 100; ++i)
+    {
+        ids.push_back(p.claim());
+    }
+    size_t cap = p.capacity();
+    for(size_t round = 0; round < 100; ++round)
+    {
+        for(size_t i = 0; i < ids.size(); i += 2)
+        {
+            p.release(ids[i]);
+        }
+        for(size_t i = 0; i < ids.size(); i += 2)
+        {
+            ids[i] = p.claim();
+        }
+    }
+    EXPECT_EQ(p.size(), 100u);
+    EXPECT_EQ(p.capacity(), cap);
+    p.destroy([](void*){});
+}
+
+TEST(pool_linear_paged, generations)
+{
+    ppag p(sizeof(size_t), alignof(size_t), 0);
+    size_t a = p.claim();
+    p.claim();
+    p.release(a);
+    size_t b = p.claim();
+    EXPECT_EQ(ppag::_slot(a), ppag::_slot(b));
+    if(ppag::has_gen)
+    {
+        EXPECT_NE(a, b); // a is now stale
+    }
+    else
+    {
+        EXPECT_EQ(a, b);
+    }
+    p.destroy([](void*){});
+}
+
+TEST(pool_linear_paged, reserve_many_pages)
+{
+    ppag p(sizeof(size_t), alignof(size_t), 4 * ppag::page_size());
+    EXPECT_EQ(p.num_pages(), 4u);
+    for(size_t i = 0; i < p.capacity(); ++i)
+    {
+        *(size_t*)p.get(p.claim()) = i;
+    }
+    for(size_t i = 0; i < p.capacity(); ++i)
+    {
+        EXPECT_EQ(*(size_t*)p.get(i), i);
+    }
+    p.destroy([](void*){});
+}
+
+TEST(pool_linear_paged, slot_states_survive_growth)
+{
+    // the slot states are held with the pages, so growing keeps them
+    ppag p(sizeof(size_t), alignof(size_t), 0);
+    size_t first = p.claim();
+    size_t second = p.claim();
+    p.release(first);
+    for(size_t i = 0; i < 3 * ppag::page_size(); ++i)
+    {
+        *(size_t*)p.get(p.claim()) = i;
+    }
+    EXPECT_EQ(p.num_pages(), 4u);
+    EXPECT_EQ(p.num_free(), 0u); // the first claim reused the released slot
+    EXPECT_EQ(ppag::_slot(first), 0u);
+    EXPECT_FALSE(p._is_free(ppag::_slot(second)));
+    p.release(second);
+    EXPECT_TRUE(p._is_free(ppag::_slot(second)));
+    EXPECT_EQ(ppag::_slot(p.claim()), ppag::_slot(second));
+    p.destroy([](void*){});
+}
+
+
+//-----------------------------------------------------------------------------
+
+using pmt = pool_linear_paged_mt<16, size_t, Allocator<char,MemRes>>;
+
+TEST(pool_linear_paged_mt, segments)
+{
+    size_t pos;
+    EXPECT_EQ(pmt::_segment(0, &pos), 0u);
+    EXPECT_EQ(pos, 0u);
+    EXPECT_EQ(pmt::_segment(15, &pos), 0u);
+    EXPECT_EQ(pos, 15u);
+    EXPECT_EQ(pmt::_segment(16, &pos), 1u);
+    EXPECT_EQ(pos, 0u);
+    EXPECT_EQ(pmt::_segment(47, &pos), 1u);
+    EXPECT_EQ(pos, 31u);
+    EXPECT_EQ(pmt::_segment(48, &pos), 2u);
+    EXPECT_EQ(pos, 0u);
+    pmt p(sizeof(size_t), alignof(size_t), 20);
+    EXPECT_EQ(p.capacity(), 48u);
+    EXPECT_EQ(p.size(), 0u);
+}
+
+TEST(pool_linear_paged_mt, concurrent_claims)
+{
+    pmt p(sizeof(size_t), alignof(size_t), 0);
+    const size_t num_threads = 4, num_per_thread = 10000;
+    std::vector<std::thread> threads;
+    for(size_t t = 0; t < num_threads; ++t)
+    {
+        threads.emplace_back([&p, t, num_per_thread]{
+            for(size_t i = 0; i < num_per_thread; ++i)
+            {
+                size_t id = p.claim();
+                *(size_t*)p.get(id) = t * num_per_thread + i;
+            }
+        });
+    }
+    for(auto &th : threads)
+    {
+        th.join();
+    }
+    ASSERT_EQ(p.size(), num_threads * num_per_thread);
+    // every value was written exactly once, to a distinct object
+    std::vector<size_t> seen(num_threads * num_per_thread, 0);
+    for(size_t id = 0; id < p.size(); ++id)
+    {
+        size_t val = *(size_t*)p.get(id);
+        ASSERT_LT(val, seen.size());
+        ++seen[val];
+    }
+    for(size_t n : seen)
+    {
+        EXPECT_EQ(n, 1u);
+    }
+    p.release(3);
+    EXPECT_EQ(p.size(), num_threads * num_per_thread - 1);
+    size_t num_destroyed = 0;
+    p.destroy([&num_destroyed](void*){ ++num_destroyed; });
+    EXPECT_EQ(num_destroyed, num_threads * num_per_thread - 1);
+    EXPECT_EQ(p.size(), 0u);
+}
+
 } // namespace c4
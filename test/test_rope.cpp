@@ -389,6 +389,57 @@ tututu
 }
 
 
+TEST(rope, reserve_keeps_the_free_list)
+{
+    std::vector< char > result;
+    Rope r;
+    r.reserve(4);
+    r.append("a");
+    r.append("b");
+    // grow twice while there are free entries: all of them must
+    // remain usable
+    r.reserve(8);
+    r.reserve(16);
+    csubstr more = "cdefghijklmnop";
+    for(size_t i = 0; i < more.len; ++i)
+    {
+        r.append(more.sub(i, 1));
+    }
+    EXPECT_EQ(r.num_entries(), 16u);
+    EXPECT_EQ(r.m_cap, 16u);
+    EXPECT_EQ(r.chain_all_resize(&result), "abcdefghijklmnop");
+}
+
+TEST(rope, assign_reuses_the_buffer)
+{
+    std::vector< char > result;
+    Rope parsed;
+    parsed.append("a");
+    parsed.append("b");
+    Rope r;
+    r.assign(parsed);
+    EXPECT_EQ(r.chain_all_resize(&result), "ab");
+    for(int i = 0; i < 40; ++i)
+    {
+        r.append("x"); // grow beyond the parsed rope
+    }
+    Rope::rope_entry const* buf = r.m_buf;
+    size_t cap = r.m_cap;
+    r.assign(parsed);
+    EXPECT_EQ(r.m_buf, buf);
+    EXPECT_EQ(r.m_cap, cap);
+    EXPECT_EQ(r.num_entries(), 2u);
+    EXPECT_EQ(r.chain_all_resize(&result), "ab");
+    // the extra entries are free
+    for(int i = 0; i < 40; ++i)
+    {
+        r.append("y");
+    }
+    EXPECT_EQ(r.m_buf, buf);
+    csubstr ret = r.chain_all_resize(&result);
+    EXPECT_EQ(std::string(ret.str, ret.len), "ab" + std::string(40, 'y'));
+}
+
 } // namespace tpl
 } // namespace c4
 